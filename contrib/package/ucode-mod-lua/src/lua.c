@@ -24,8 +24,16 @@
 
 #include "ucode/module.h"
 
+#define LUA_POOL_MAX 8
+
 static uc_resource_type_t *vm_type, *lv_type;
 
+static struct {
+	lua_State *states[LUA_POOL_MAX];
+	size_t count, limit;
+	uint64_t hits, misses;
+} pool;
+
 
 typedef struct {
 	uc_vm_t *vm;
@@ -1003,20 +1011,110 @@ uc_lua_lv_tostring(uc_vm_t *vm, size_t nargs)
 }
 
 
-static uc_value_t *
-uc_lua_create(uc_vm_t *vm, size_t nargs)
+static lua_State *
+uc_lua_state_new(void)
 {
 	lua_State *L = luaL_newstate();
 
+	if (!L)
+		return NULL;
+
 	luaL_openlibs(L);
 
 	luaL_newmetatable(L, "ucode.value");
 	luaL_register(L, NULL, ucode_ud_methods);
 	lua_pop(L, 1);
 
+	return L;
+}
+
+static uc_value_t *
+uc_lua_create(uc_vm_t *vm, size_t nargs)
+{
+	lua_State *L;
+
+	if (pool.count > 0) {
+		L = pool.states[--pool.count];
+		pool.hits++;
+	}
+	else {
+		L = uc_lua_state_new();
+		pool.misses++;
+	}
+
 	return uc_resource_new(vm_type, L);
 }
 
+/*
+ * prewarm([count[, modules]]) - create count Lua states with the given
+ * modules already loaded, lua.create() hands them out before creating new
+ * ones. Every pooled state is only used once and closed afterwards, module
+ * tables may have been modified by the previous user so states are never
+ * recycled. The intended use is prewarming in a server process whose forked
+ * request handlers each inherit a pristine copy of the pool.
+ */
+static uc_value_t *
+uc_lua_prewarm(uc_vm_t *vm, size_t nargs)
+{
+	uc_value_t *count = uc_fn_arg(0);
+	uc_value_t *modules = uc_fn_arg(1);
+	uc_value_t *name;
+	lua_State *L;
+	int64_t n;
+	size_t i;
+
+	if (count && ucv_type(count) != UC_INTEGER)
+		return NULL;
+
+	if (modules && ucv_type(modules) != UC_ARRAY)
+		return NULL;
+
+	n = count ? ucv_int64_get(count) : 1;
+	pool.limit = (n < 0) ? 0 : (n > LUA_POOL_MAX) ? LUA_POOL_MAX : (size_t)n;
+
+	while (pool.count > pool.limit)
+		lua_close(pool.states[--pool.count]);
+
+	while (pool.count < pool.limit) {
+		L = uc_lua_state_new();
+
+		if (!L)
+			break;
+
+		for (i = 0; i < ucv_array_length(modules); i++) {
+			name = ucv_array_get(modules, i);
+
+			if (ucv_type(name) != UC_STRING)
+				continue;
+
+			lua_getglobal(L, "require");
+			lua_pushstring(L, ucv_string_get(name));
+
+			/* ignore modules failing to load, they'll be required
+			 * again at runtime and report the error there */
+			if (lua_pcall(L, 1, 0, 0))
+				lua_pop(L, 1);
+		}
+
+		pool.states[pool.count++] = L;
+	}
+
+	return ucv_uint64_new(pool.count);
+}
+
+static uc_value_t *
+uc_lua_pool(uc_vm_t *vm, size_t nargs)
+{
+	uc_value_t *rv = ucv_object_new(vm);
+
+	ucv_object_add(rv, "limit", ucv_uint64_new(pool.limit));
+	ucv_object_add(rv, "available", ucv_uint64_new(pool.count));
+	ucv_object_add(rv, "hits", ucv_uint64_new(pool.hits));
+	ucv_object_add(rv, "misses", ucv_uint64_new(pool.misses));
+
+	return rv;
+}
+
 
 static const uc_function_list_t vm_fns[] = {
 	{ "invoke",		uc_lua_vm_invoke },
@@ -1038,6 +1136,8 @@ static const uc_function_list_t lv_fns[] = {
 
 static const uc_function_list_t lua_fns[] = {
 	{ "create",		uc_lua_create },
+	{ "prewarm",	uc_lua_prewarm },
+	{ "pool",		uc_lua_pool },
 };
 
 static void
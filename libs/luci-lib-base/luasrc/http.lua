@@ -8,12 +8,22 @@ local table = require "table"
 local lhttp = require "lucihttp"
 
 local L, table, ipairs, pairs, type, error = _G.L, table, ipairs, pairs, type, error
+local package = package
 
 module "luci.http"
 
 HTTP_MAX_CONTENT      = 1024*100		-- 100 kB maximum content size
 
+-- Buffered template output must be written before any direct output
+local function flush_template()
+	local tpl = package.loaded["luci.template"]
+	if type(tpl) == "table" and tpl.flush then
+		tpl.flush()
+	end
+end
+
 function close()
+	flush_template()
 	L.http:close()
 end
 
@@ -65,10 +75,12 @@ function write(content, src_err)
 		error(src_err)
 	end
 
+	flush_template()
 	return L.print(content)
 end
 
 function splice(fd, size)
+	flush_template()
 	coroutine.yield(6, fd, size)
 end
 
@@ -95,6 +107,7 @@ urldecode = util.urldecode
 urlencode = util.urlencode
 
 function write_json(x)
+	flush_template()
 	L.printf('%J', x)
 end
 
@@ -34,10 +34,19 @@ limitations under the License.
 #include <netlink/msg.h>
 #include <netlink/attr.h>
 #include <netlink/socket.h>
+#include <sys/socket.h>
 #include <linux/rtnetlink.h>
 
 #define LUCI_IP "luci.ip"
 #define LUCI_IP_CIDR "luci.ip.cidr"
+#define LUCI_IP_CACHE "luci.ip.cache"
+#define LUCI_IP_ROUTEITER "luci.ip.routeiter"
+#define LUCI_IP_PREFIXSET "luci.ip.prefixset"
+#define LUCI_IP_CIDRLIST "luci.ip.cidrlist"
+
+#ifndef NETLINK_GET_STRICT_CHK
+#define NETLINK_GET_STRICT_CHK 12
+#endif
 
 #define RTA_INT(x)	(*(int *)RTA_DATA(x))
 #define RTA_U32(x)	(*(uint32_t *)RTA_DATA(x))
@@ -53,6 +62,7 @@ limitations under the License.
 			((f) == AF_PACKET ? 6 : 0)))
 
 static int hz = 0;
+static bool strict_chk = false;
 static struct nl_sock *sock = NULL;
 
 typedef struct {
@@ -83,18 +93,49 @@ struct dump_filter {
 	struct ether_addr mac;
 	bool from_exact;
 	bool dst_exact;
+	int offset;
+	int limit;
+};
+
+struct cache_entry {
+	struct cache_entry *hnext;
+	struct cache_entry *prev, *next;
+	uint32_t hash;
+	uint8_t keylen;
+	uint8_t key[64];
+	struct nlmsghdr *hdr;
+};
+
+struct cache_table {
+	struct cache_entry **buckets;
+	struct cache_entry *head, *tail;
+	size_t size, count;
 };
 
+typedef struct {
+	struct nl_sock *sock;
+	struct cache_table routes;
+	struct cache_table neighs;
+	struct cache_table links;
+	uint32_t generation;
+	bool resync;
+	int busy;
+} cache_t;
+
 struct dump_state {
 	int index;
+	int skipped;
 	int pending;
 	int callback;
+	bool iterate;
 	struct lua_State *L;
 	struct dump_filter *filter;
+	cache_t *cache;
 };
 
 
 static int _cidr_new(lua_State *L, int index, int family, bool mask);
+static const char *cache_ifname(cache_t *c, int ifindex);
 
 static cidr_t *L_checkcidr (lua_State *L, int index, cidr_t *p)
 {
@@ -358,13 +399,38 @@ static void L_setstr(struct lua_State *L, const char *name, const char *val)
 	lua_setfield(L, -2, name);
 }
 
-static void L_setdev(struct lua_State *L, const char *name,
+static const char * L_ifname(struct dump_state *s, int ifindex, char *buf)
+{
+	const char *name = s->cache ? cache_ifname(s->cache, ifindex) : NULL;
+
+	return name ? name : if_indextoname(ifindex, buf);
+}
+
+/* A cache is flagged busy while its entries are iterated, make sure an error
+ * raised by the callback does not leave it flagged forever */
+static void L_callback(struct dump_state *s)
+{
+	if (!s->cache)
+	{
+		lua_call(s->L, 1, 0);
+		return;
+	}
+
+	if (lua_pcall(s->L, 1, 0, 0))
+	{
+		s->cache->busy--;
+		lua_error(s->L);
+	}
+}
+
+static void L_setdev(struct dump_state *s, const char *name,
                      struct nlattr *attr)
 {
 	char buf[32];
+	const char *dev = L_ifname(s, RTA_INT(attr), buf);
 
-	if (if_indextoname(RTA_INT(attr), buf))
-		L_setstr(L, name, buf);
+	if (dev)
+		L_setstr(s->L, name, dev);
 }
 
 static int L_checkbits(lua_State *L, int index, cidr_t *p)
@@ -1074,554 +1140,1981 @@ static int cidr_tostring (lua_State *L)
 }
 
 /*
- * route functions
+ * packed cidr list functions
  */
 
-static bool diff_prefix(int family, void *addr, int bits, bool exact, cidr_t *p)
+typedef struct {
+	size_t count;
+	cidr_t entries[];
+} cidrlist_t;
+
+static cidr_t *L_tocidr(lua_State *L, int index)
 {
-	uint8_t i, b, r, *a;
-	uint32_t m;
+	cidr_t *p = lua_touserdata(L, index);
 
-	if (!p->family)
-		return false;
+	if (!p || !lua_getmetatable(L, index))
+		return NULL;
 
-	if (!addr || p->family != family || p->bits > bits)
-		return true;
+	luaL_getmetatable(L, LUCI_IP_CIDR);
 
-	if (family == AF_INET)
-	{
-		m = p->bits ? htonl(~((1 << (AF_BITS(AF_INET) - p->bits)) - 1)) : 0;
+	if (!lua_rawequal(L, -1, -2))
+		p = NULL;
 
-		if ((((struct in_addr *)addr)->s_addr & m) != (p->addr.v4.s_addr & m))
-			return true;
-	}
-	else
-	{
-		for (i = 0, a = addr, r = p->bits; i < AF_BYTES(p->family); i++)
-		{
-			b = r ? (0xFF << (8 - ((r > 8) ? 8 : r))) : 0;
+	lua_pop(L, 2);
 
-			if ((a[i] & b) != (p->addr.u8[i] & b))
-				return true;
+	return p;
+}
 
-			r -= ((r > 8) ? 8 : r);
-		}
-	}
+static cidrlist_t *L_newcidrlist(lua_State *L, size_t count)
+{
+	cidrlist_t *list = lua_newuserdata(L, sizeof(*list) + count * sizeof(cidr_t));
 
-	return (exact && p->bits != bits);
+	if (!list)
+		return NULL;
+
+	list->count = 0;
+	luaL_getmetatable(L, LUCI_IP_CIDRLIST);
+	lua_setmetatable(L, -2);
+
+	return list;
 }
 
-static int cb_dump_route(struct nl_msg *msg, void *arg)
+/* Parse the array at index into a new packed list, record the indexes of
+ * unparsable entries in the table at invalid if nonzero */
+static cidrlist_t *L_parsecidrlist(lua_State *L, int index, int family,
+                                   int invalid)
 {
-	struct dump_state *s = arg;
-	struct dump_filter *f = s->filter;
-	struct nlmsghdr *hdr = nlmsg_hdr(msg);
-	struct rtmsg *rt = NLMSG_DATA(hdr);
-	struct nlattr *tb[RTA_MAX+1];
-	struct in6_addr *src, *dst, *gw, *from, def = { };
-	int iif, oif, bitlen;
-	uint32_t table;
-
-	if (hdr->nlmsg_type != RTM_NEWROUTE ||
-	    (rt->rtm_family != AF_INET && rt->rtm_family != AF_INET6))
-		return NL_SKIP;
+	size_t i, n = lua_objlen(L, index);
+	int ninvalid = 0;
+	cidrlist_t *list;
+	cidr_t *p, *c;
+	bool ok;
 
-	nlmsg_parse(hdr, sizeof(*rt), tb, RTA_MAX, NULL);
+	if (!(list = L_newcidrlist(L, n)))
+		return NULL;
 
-	iif   = tb[RTA_IIF]     ? RTA_INT(tb[RTA_IIF])      : 0;
-	oif   = tb[RTA_OIF]     ? RTA_INT(tb[RTA_OIF])      : 0;
-	table = tb[RTA_TABLE]   ? RTA_U32(tb[RTA_TABLE])    : rt->rtm_table;
-	from  = tb[RTA_SRC]     ? RTA_DATA(tb[RTA_SRC])     : NULL;
-	src   = tb[RTA_PREFSRC] ? RTA_DATA(tb[RTA_PREFSRC]) : NULL;
-	dst   = tb[RTA_DST]     ? RTA_DATA(tb[RTA_DST])     : &def;
-	gw    = tb[RTA_GATEWAY] ? RTA_DATA(tb[RTA_GATEWAY]) : NULL;
+	for (i = 1; i <= n; i++)
+	{
+		lua_rawgeti(L, index, i);
 
-	bitlen = AF_BITS(rt->rtm_family);
+		p = &list->entries[list->count];
 
-	if (!f->get) {
-		if ((f->type   && rt->rtm_type     != f->type)   ||
-		    (f->family && rt->rtm_family   != f->family) ||
-		    (f->proto  && rt->rtm_protocol != f->proto)  ||
-		    (f->scope  && rt->rtm_scope    != f->scope)  ||
-		    (f->iif    && iif              != f->iif)    ||
-		    (f->oif    && oif              != f->oif)    ||
-		    (f->table  && table            != f->table)  ||
-		    diff_prefix(rt->rtm_family, from, rt->rtm_src_len,
-		                f->from_exact, &f->from)         ||
-		    diff_prefix(rt->rtm_family, dst,  rt->rtm_dst_len,
-		                f->dst_exact, &f->dst)           ||
-		    diff_prefix(rt->rtm_family, gw,   bitlen,
-		                false, &f->gw)                   ||
-		    diff_prefix(rt->rtm_family, src,  bitlen,
-		                false, &f->src))
-			goto out;
-	}
+		memset(p, 0, sizeof(*p));
 
-	if (s->callback)
-		lua_pushvalue(s->L, 2);
+		ok = false;
 
-	lua_newtable(s->L);
+		if (lua_type(L, -1) == LUA_TSTRING)
+		{
+			ok = parse_cidr(lua_tostring(L, -1), p);
+		}
+		else if ((c = L_tocidr(L, -1)) != NULL)
+		{
+			*p = *c;
+			ok = true;
+		}
 
-	L_setint(s->L, "type", rt->rtm_type);
-	L_setint(s->L, "family", (rt->rtm_family == AF_INET) ? 4 : 6);
+		if (ok && (!family || p->family == family))
+		{
+			list->count++;
+		}
+		else if (invalid)
+		{
+			lua_pushinteger(L, i);
+			lua_rawseti(L, invalid, ++ninvalid);
+		}
 
-	L_setaddr(s->L, "dest", rt->rtm_family, dst, rt->rtm_dst_len);
+		lua_pop(L, 1);
+	}
 
-	if (gw)
-		L_setaddr(s->L, "gw", rt->rtm_family, gw, -1);
+	return list;
+}
 
-	if (from)
-		L_setaddr(s->L, "from", rt->rtm_family, from, rt->rtm_src_len);
+static cidrlist_t *L_checkcidrlist(lua_State *L, int index)
+{
+	cidrlist_t *list;
 
-	if (iif)
-		L_setdev(s->L, "iif", tb[RTA_IIF]);
+	if (lua_type(L, index) == LUA_TUSERDATA)
+		return luaL_checkudata(L, index, LUCI_IP_CIDRLIST);
 
-	if (oif)
-		L_setdev(s->L, "dev", tb[RTA_OIF]);
+	luaL_checktype(L, index, LUA_TTABLE);
 
-	L_setint(s->L, "table", table);
-	L_setint(s->L, "proto", rt->rtm_protocol);
-	L_setint(s->L, "scope", rt->rtm_scope);
+	if (!(list = L_parsecidrlist(L, index, 0, 0)))
+		luaL_error(L, "Out of memory");
 
-	if (src)
-		L_setaddr(s->L, "src", rt->rtm_family, src, -1);
+	lua_replace(L, index);
 
-	if (tb[RTA_PRIORITY])
-		L_setint(s->L, "metric", RTA_U32(tb[RTA_PRIORITY]));
+	return list;
+}
 
-	if (rt->rtm_family == AF_INET6 && tb[RTA_CACHEINFO])
-	{
-		struct rta_cacheinfo *ci = RTA_DATA(tb[RTA_CACHEINFO]);
+static int _cidrlist_cmp(const void *a, const void *b)
+{
+	const cidr_t *p1 = a, *p2 = b;
+	int rv;
 
-		if (ci->rta_expires)
-		{
-			if (ci->rta_expires)
-				L_setint(s->L, "expires", ci->rta_expires / hz);
+	if (p1->family != p2->family)
+		return (p1->family - p2->family);
 
-			if (ci->rta_error != 0)
-				L_setint(s->L, "error", ci->rta_error);
-		}
-	}
+	rv = memcmp(&p1->addr.v6, &p2->addr.v6, AF_BYTES(p1->family));
 
-	s->index++;
+	if (rv)
+		return rv;
 
-	if (s->callback)
-		lua_call(s->L, 1, 0);
-	else if (hdr->nlmsg_flags & NLM_F_MULTI)
-		lua_rawseti(s->L, -2, s->index);
+	if (p1->bits != p2->bits)
+		return (p1->bits - p2->bits);
 
-out:
-	s->pending = !!(hdr->nlmsg_flags & NLM_F_MULTI);
-	return NL_SKIP;
+	return (p1->scope > p2->scope) - (p1->scope < p2->scope);
 }
 
-static int
-cb_done(struct nl_msg *msg, void *arg)
+static int cidrlist_parse(lua_State *L)
 {
-	struct dump_state *s = arg;
-	s->pending = 0;
-	return NL_STOP;
-}
+	int family = luaL_optint(L, 2, 0);
 
-static int
-cb_error(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
-{
-	struct dump_state *s = arg;
-	s->pending = 0;
-	return NL_STOP;
-}
+	luaL_checktype(L, 1, LUA_TTABLE);
 
-static int _error(lua_State *L, int code, const char *msg)
-{
-	lua_pushnil(L);
-	lua_pushnumber(L, code ? code : errno);
-	lua_pushstring(L, msg ? msg : strerror(errno));
+	if (family == 4)
+		family = AF_INET;
+	else if (family == 6)
+		family = AF_INET6;
+	else
+		family = 0;
 
-	return 3;
-}
+	lua_newtable(L);
 
-static int _route_dump(lua_State *L, struct dump_filter *filter)
-{
-	int flags = NLM_F_REQUEST;
-	struct dump_state s = {
-		.L = L,
-		.pending = 1,
-		.index = 0,
-		.callback = lua_isfunction(L, 2),
-		.filter = filter
-	};
+	if (!L_parsecidrlist(L, 1, family, lua_gettop(L)))
+		return 0;
 
-	if (!hz)
-		hz = sysconf(_SC_CLK_TCK);
+	lua_insert(L, -2);
 
-	if (!sock)
+	if (lua_objlen(L, -1) == 0)
 	{
-		sock = nl_socket_alloc();
-		if (!sock)
-			return _error(L, -1, "Out of memory");
-
-		if (nl_connect(sock, NETLINK_ROUTE))
-			return _error(L, 0, NULL);
+		lua_pop(L, 1);
+		return 1;
 	}
 
-	struct nl_msg *msg;
-	struct nl_cb *cb = nl_cb_alloc(NL_CB_DEFAULT);
-	struct rtmsg rtm = {
-		.rtm_family = filter->family,
-		.rtm_dst_len = filter->dst.bits,
-		.rtm_src_len = filter->src.bits
-	};
-
-	if (!filter->get)
-		flags |= NLM_F_DUMP;
-
-	msg = nlmsg_alloc_simple(RTM_GETROUTE, flags);
-	if (!msg)
-		goto out;
+	return 2;
+}
 
-	nlmsg_append(msg, &rtm, sizeof(rtm), 0);
+static int cidrlist_format(lua_State *L)
+{
+	cidrlist_t *list = L_checkcidrlist(L, 1);
+	size_t i;
 
-	if (filter->get) {
-		nla_put(msg, RTA_DST, AF_BYTES(filter->dst.family),
-		        &filter->dst.addr.v6);
+	lua_createtable(L, list->count, 0);
 
-		if (filter->src.family)
-			nla_put(msg, RTA_SRC, AF_BYTES(filter->src.family),
-			        &filter->src.addr.v6);
+	for (i = 0; i < list->count; i++)
+	{
+		format_cidr(L, &list->entries[i]);
+		lua_rawseti(L, -2, i + 1);
 	}
 
-	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, cb_dump_route, &s);
-	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, cb_done, &s);
-	nl_cb_err(cb, NL_CB_CUSTOM, cb_error, &s);
+	return 1;
+}
 
-	nl_send_auto_complete(sock, msg);
+static int cidrlist_sort(lua_State *L)
+{
+	cidrlist_t *list = L_checkcidrlist(L, 1);
 
-	if (!filter->get && !s.callback)
-		lua_newtable(L);
+	qsort(list->entries, list->count, sizeof(cidr_t), _cidrlist_cmp);
 
-	while (s.pending > 0)
-		nl_recvmsgs(sock, cb);
+	lua_pushvalue(L, 1);
+	return 1;
+}
 
-	nlmsg_free(msg);
+static int cidrlist_dedupe(lua_State *L)
+{
+	cidrlist_t *list = L_checkcidrlist(L, 1);
+	size_t i, n;
 
-out:
-	nl_cb_put(cb);
+	qsort(list->entries, list->count, sizeof(cidr_t), _cidrlist_cmp);
 
-	if (s.callback)
-		return 0;
+	for (i = 1, n = !!list->count; i < list->count; i++)
+		if (_cidrlist_cmp(&list->entries[n - 1], &list->entries[i]))
+			list->entries[n++] = list->entries[i];
 
-	if (!filter->get)
-		return 1;
+	list->count = n;
 
-	return (s.index > 0);
+	lua_pushvalue(L, 1);
+	return 1;
 }
 
-static int route_get(lua_State *L)
+static int cidrlist_get(lua_State *L)
 {
-	struct dump_filter filter = { .get = true };
-	const char *dest = luaL_checkstring(L, 1);
-	const char *from = luaL_optstring(L, 2, NULL);
-
-	if (!parse_cidr(dest, &filter.dst))
-		return _error(L, -1, "Invalid destination");
-
-	if (from && !parse_cidr(from, &filter.src))
-		return _error(L, -1, "Invalid source");
+	cidrlist_t *list = luaL_checkudata(L, 1, LUCI_IP_CIDRLIST);
+	size_t i = luaL_checkinteger(L, 2);
+	cidr_t *p;
 
-	if (filter.src.family != 0 &&
-	    filter.src.family != filter.dst.family)
-		return _error(L, -1, "Different source/destination family");
+	if (i < 1 || i > list->count)
+		return 0;
 
-	filter.family = filter.dst.family;
+	if (!(p = lua_newuserdata(L, sizeof(*p))))
+		return 0;
 
-	return _route_dump(L, &filter);
+	*p = list->entries[i - 1];
+	luaL_getmetatable(L, LUCI_IP_CIDR);
+	lua_setmetatable(L, -2);
+	return 1;
 }
 
-static int route_dump(lua_State *L)
+static int cidrlist_count(lua_State *L)
 {
-	const char *s;
-	cidr_t p = { };
-	struct dump_filter filter = { };
+	cidrlist_t *list = luaL_checkudata(L, 1, LUCI_IP_CIDRLIST);
 
-	if (lua_type(L, 1) == LUA_TTABLE)
+	lua_pushinteger(L, list->count);
+	return 1;
+}
+
+/*
+ * prefix set functions
+ */
+
+struct pset_node {
+	struct pset_node *child[2];
+	cidr_t prefix;
+	bool used;
+};
+
+typedef struct {
+	struct pset_node *root[3];
+	size_t count;
+} pset_t;
+
+static struct pset_node **pset_root(pset_t *set, cidr_t *p)
+{
+	switch (p->family)
+	{
+	case AF_INET:   return &set->root[0];
+	case AF_INET6:  return &set->root[1];
+	case AF_PACKET: return &set->root[2];
+	default:        return NULL;
+	}
+}
+
+static int pset_bit(cidr_t *p, int bit)
+{
+	return (p->addr.u8[bit / 8] >> (7 - (bit % 8))) & 1;
+}
+
+/* Length of the common leading bits of both addresses, up to max bits */
+static int pset_common(cidr_t *a, cidr_t *b, int max)
+{
+	int i, bits = 0;
+	uint8_t x;
+
+	for (i = 0; bits < max; i++, bits += 8)
+	{
+		x = a->addr.u8[i] ^ b->addr.u8[i];
+
+		if (x)
+		{
+			while (!(x & 0x80))
+				x <<= 1, bits++;
+
+			break;
+		}
+	}
+
+	return (bits < max) ? bits : max;
+}
+
+static struct pset_node *pset_node_new(cidr_t *p, int bits, bool used)
+{
+	struct pset_node *n = calloc(1, sizeof(*n));
+
+	if (!n)
+		return NULL;
+
+	n->prefix = *p;
+	n->prefix.bits = AF_BITS(p->family);
+	n->prefix.scope = 0;
+	_apply_mask(&n->prefix, bits, false);
+	n->prefix.bits = bits;
+	n->used = used;
+
+	return n;
+}
+
+static int pset_insert(pset_t *set, cidr_t *p)
+{
+	struct pset_node **pp = pset_root(set, p), *n, *leaf, *glue;
+	int common;
+
+	if (!pp)
+		return -1;
+
+	while ((n = *pp) != NULL)
+	{
+		common = pset_common(&n->prefix, p,
+			(n->prefix.bits < p->bits) ? n->prefix.bits : p->bits);
+
+		if (common < n->prefix.bits)
+		{
+			/* new prefix is a parent of the existing node */
+			if (common == p->bits)
+			{
+				if (!(leaf = pset_node_new(p, p->bits, true)))
+					return -1;
+
+				leaf->child[pset_bit(&n->prefix, common)] = n;
+			}
+
+			/* both diverge, join them below a glue node */
+			else
+			{
+				if (!(leaf = pset_node_new(p, p->bits, true)))
+					return -1;
+
+				if (!(glue = pset_node_new(p, common, false)))
+				{
+					free(leaf);
+					return -1;
+				}
+
+				glue->child[pset_bit(p, common)] = leaf;
+				glue->child[pset_bit(&n->prefix, common)] = n;
+				leaf = glue;
+			}
+
+			*pp = leaf;
+			set->count++;
+
+			return 1;
+		}
+
+		if (n->prefix.bits == p->bits)
+		{
+			if (n->used)
+				return 0;
+
+			n->used = true;
+			set->count++;
+
+			return 1;
+		}
+
+		pp = &n->child[pset_bit(p, n->prefix.bits)];
+	}
+
+	if (!(*pp = pset_node_new(p, p->bits, true)))
+		return -1;
+
+	set->count++;
+
+	return 1;
+}
+
+static bool pset_delete(pset_t *set, cidr_t *p)
+{
+	struct pset_node **pp = pset_root(set, p), **parent = NULL, *n;
+
+	if (!pp)
+		return false;
+
+	while ((n = *pp) != NULL)
+	{
+		if (n->prefix.bits > p->bits ||
+		    pset_common(&n->prefix, p, n->prefix.bits) < n->prefix.bits)
+			return false;
+
+		if (n->prefix.bits == p->bits)
+			break;
+
+		parent = pp;
+		pp = &n->child[pset_bit(p, n->prefix.bits)];
+	}
+
+	if (!n || !n->used)
+		return false;
+
+	n->used = false;
+	set->count--;
+
+	/* unlink the node unless it is still required as branch point */
+	if (!n->child[0] || !n->child[1])
+	{
+		*pp = n->child[0] ? n->child[0] : n->child[1];
+		free(n);
+
+		/* collapse a parent glue node left with a single child */
+		if (parent && !(n = *parent)->used && (!n->child[0] || !n->child[1]))
+		{
+			*parent = n->child[0] ? n->child[0] : n->child[1];
+			free(n);
+		}
+	}
+
+	return true;
+}
+
+/* Find the most specific prefix containing the given address or range */
+static struct pset_node *pset_lookup(pset_t *set, cidr_t *p)
+{
+	struct pset_node **pp = pset_root(set, p), *n, *best = NULL;
+
+	for (n = pp ? *pp : NULL; n; n = n->child[pset_bit(p, n->prefix.bits)])
+	{
+		if (n->prefix.bits > p->bits ||
+		    pset_common(&n->prefix, p, n->prefix.bits) < n->prefix.bits)
+			break;
+
+		if (n->used)
+			best = n;
+
+		if (n->prefix.bits == AF_BITS(p->family))
+			break;
+	}
+
+	return best;
+}
+
+/* Test whether any stored prefix contains or is contained by the given one */
+static bool pset_overlaps(pset_t *set, cidr_t *p)
+{
+	struct pset_node **pp = pset_root(set, p), *n;
+	int bits;
+
+	for (n = pp ? *pp : NULL; n; n = n->child[pset_bit(p, n->prefix.bits)])
+	{
+		bits = (n->prefix.bits < p->bits) ? n->prefix.bits : p->bits;
+
+		if (pset_common(&n->prefix, p, bits) < bits)
+			return false;
+
+		/* node lies within the range, every subtree holds used nodes */
+		if (n->used || n->prefix.bits >= p->bits)
+			return true;
+	}
+
+	return false;
+}
+
+/* Test whether the subtree fully covers the range of its top node */
+static bool pset_covered(struct pset_node *n)
+{
+	if (n->used)
+		return true;
+
+	return (n->child[0] && n->child[1] &&
+	        n->child[0]->prefix.bits == n->prefix.bits + 1 &&
+	        n->child[1]->prefix.bits == n->prefix.bits + 1 &&
+	        pset_covered(n->child[0]) && pset_covered(n->child[1]));
+}
+
+static void pset_free(struct pset_node *n)
+{
+	if (!n)
+		return;
+
+	pset_free(n->child[0]);
+	pset_free(n->child[1]);
+	free(n);
+}
+
+static void L_pushcidr(lua_State *L, cidr_t *p)
+{
+	cidr_t *cidrp = lua_newuserdata(L, sizeof(*cidrp));
+
+	*cidrp = *p;
+	luaL_getmetatable(L, LUCI_IP_CIDR);
+	lua_setmetatable(L, -2);
+}
+
+enum pset_walk_mode {
+	PSET_ALL,
+	PSET_AGGREGATE,
+	PSET_NESTED
+};
+
+static void L_pset_walk(lua_State *L, struct pset_node *n,
+                        enum pset_walk_mode mode, bool nested, int *index)
+{
+	if (!n)
+		return;
+
+	if ((mode == PSET_ALL && n->used) ||
+	    (mode == PSET_NESTED && n->used && nested))
+	{
+		L_pushcidr(L, &n->prefix);
+		lua_rawseti(L, -2, ++*index);
+	}
+	else if (mode == PSET_AGGREGATE && pset_covered(n))
+	{
+		L_pushcidr(L, &n->prefix);
+		lua_rawseti(L, -2, ++*index);
+		return;
+	}
+
+	L_pset_walk(L, n->child[0], mode, nested || n->used, index);
+	L_pset_walk(L, n->child[1], mode, nested || n->used, index);
+}
+
+static int L_pset_list(lua_State *L, enum pset_walk_mode mode)
+{
+	pset_t *set = luaL_checkudata(L, 1, LUCI_IP_PREFIXSET);
+	int i, index = 0;
+
+	lua_newtable(L);
+
+	for (i = 0; i < 3; i++)
+		L_pset_walk(L, set->root[i], mode, false, &index);
+
+	return 1;
+}
+
+static int L_pset_add(lua_State *L, pset_t *set, int index)
+{
+	int rv = pset_insert(set, L_checkcidr(L, index, NULL));
+
+	if (rv < 0)
+		return luaL_error(L, "Out of memory");
+
+	return rv;
+}
+
+static int pset_new(lua_State *L)
+{
+	pset_t *set = lua_newuserdata(L, sizeof(*set));
+	int i, top;
+
+	if (!set)
+		return 0;
+
+	memset(set, 0, sizeof(*set));
+	luaL_getmetatable(L, LUCI_IP_PREFIXSET);
+	lua_setmetatable(L, -2);
+
+	if (lua_type(L, 1) == LUA_TTABLE)
+	{
+		top = lua_gettop(L);
+
+		for (i = 1; ; i++)
+		{
+			lua_rawgeti(L, 1, i);
+
+			if (lua_isnil(L, -1))
+				break;
+
+			L_pset_add(L, set, top + 1);
+			lua_settop(L, top);
+		}
+
+		lua_settop(L, top);
+	}
+
+	return 1;
+}
+
+static int pset_L_insert(lua_State *L)
+{
+	pset_t *set = luaL_checkudata(L, 1, LUCI_IP_PREFIXSET);
+
+	lua_pushboolean(L, L_pset_add(L, set, 2));
+	return 1;
+}
+
+static int pset_L_delete(lua_State *L)
+{
+	pset_t *set = luaL_checkudata(L, 1, LUCI_IP_PREFIXSET);
+
+	lua_pushboolean(L, pset_delete(set, L_checkcidr(L, 2, NULL)));
+	return 1;
+}
+
+static int pset_L_lookup(lua_State *L)
+{
+	pset_t *set = luaL_checkudata(L, 1, LUCI_IP_PREFIXSET);
+	struct pset_node *n = pset_lookup(set, L_checkcidr(L, 2, NULL));
+
+	if (!n)
+		return 0;
+
+	L_pushcidr(L, &n->prefix);
+	return 1;
+}
+
+static int pset_L_contains(lua_State *L)
+{
+	pset_t *set = luaL_checkudata(L, 1, LUCI_IP_PREFIXSET);
+
+	lua_pushboolean(L, pset_lookup(set, L_checkcidr(L, 2, NULL)) != NULL);
+	return 1;
+}
+
+static int pset_L_contains_any(lua_State *L)
+{
+	pset_t *set = luaL_checkudata(L, 1, LUCI_IP_PREFIXSET);
+	int i, top;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	top = lua_gettop(L);
+
+	for (i = 1; ; i++)
+	{
+		lua_settop(L, top);
+		lua_rawgeti(L, 2, i);
+
+		if (lua_isnil(L, -1))
+			break;
+
+		if (pset_lookup(set, L_checkcidr(L, top + 1, NULL)))
+		{
+			lua_pushboolean(L, true);
+			lua_pushinteger(L, i);
+			return 2;
+		}
+	}
+
+	lua_pushboolean(L, false);
+	return 1;
+}
+
+static int pset_L_overlaps(lua_State *L)
+{
+	pset_t *set = luaL_checkudata(L, 1, LUCI_IP_PREFIXSET);
+
+	if (lua_isnoneornil(L, 2))
+		return L_pset_list(L, PSET_NESTED);
+
+	lua_pushboolean(L, pset_overlaps(set, L_checkcidr(L, 2, NULL)));
+	return 1;
+}
+
+static int pset_L_aggregate(lua_State *L)
+{
+	return L_pset_list(L, PSET_AGGREGATE);
+}
+
+static int pset_L_prefixes(lua_State *L)
+{
+	return L_pset_list(L, PSET_ALL);
+}
+
+static int pset_L_count(lua_State *L)
+{
+	pset_t *set = luaL_checkudata(L, 1, LUCI_IP_PREFIXSET);
+
+	lua_pushinteger(L, set->count);
+	return 1;
+}
+
+static int pset_L_gc(lua_State *L)
+{
+	pset_t *set = luaL_checkudata(L, 1, LUCI_IP_PREFIXSET);
+	int i;
+
+	for (i = 0; i < 3; i++)
+	{
+		pset_free(set->root[i]);
+		set->root[i] = NULL;
+	}
+
+	set->count = 0;
+
+	return 0;
+}
+
+/*
+ * route functions
+ */
+
+static bool diff_prefix(int family, void *addr, int bits, bool exact, cidr_t *p)
+{
+	uint8_t i, b, r, *a;
+	uint32_t m;
+
+	if (!p->family)
+		return false;
+
+	if (!addr || p->family != family || p->bits > bits)
+		return true;
+
+	if (family == AF_INET)
+	{
+		m = p->bits ? htonl(~((1 << (AF_BITS(AF_INET) - p->bits)) - 1)) : 0;
+
+		if ((((struct in_addr *)addr)->s_addr & m) != (p->addr.v4.s_addr & m))
+			return true;
+	}
+	else
+	{
+		for (i = 0, a = addr, r = p->bits; i < AF_BYTES(p->family); i++)
+		{
+			b = r ? (0xFF << (8 - ((r > 8) ? 8 : r))) : 0;
+
+			if ((a[i] & b) != (p->addr.u8[i] & b))
+				return true;
+
+			r -= ((r > 8) ? 8 : r);
+		}
+	}
+
+	return (exact && p->bits != bits);
+}
+
+static int _dump_route(struct nlmsghdr *hdr, struct dump_state *s)
+{
+	struct dump_filter *f = s->filter;
+	struct rtmsg *rt = NLMSG_DATA(hdr);
+	struct nlattr *tb[RTA_MAX+1];
+	struct in6_addr *src, *dst, *gw, *from, def = { };
+	int iif, oif, bitlen;
+	uint32_t table;
+
+	if (hdr->nlmsg_type != RTM_NEWROUTE ||
+	    (rt->rtm_family != AF_INET && rt->rtm_family != AF_INET6))
+		return NL_SKIP;
+
+	nlmsg_parse(hdr, sizeof(*rt), tb, RTA_MAX, NULL);
+
+	iif   = tb[RTA_IIF]     ? RTA_INT(tb[RTA_IIF])      : 0;
+	oif   = tb[RTA_OIF]     ? RTA_INT(tb[RTA_OIF])      : 0;
+	table = tb[RTA_TABLE]   ? RTA_U32(tb[RTA_TABLE])    : rt->rtm_table;
+	from  = tb[RTA_SRC]     ? RTA_DATA(tb[RTA_SRC])     : NULL;
+	src   = tb[RTA_PREFSRC] ? RTA_DATA(tb[RTA_PREFSRC]) : NULL;
+	dst   = tb[RTA_DST]     ? RTA_DATA(tb[RTA_DST])     : &def;
+	gw    = tb[RTA_GATEWAY] ? RTA_DATA(tb[RTA_GATEWAY]) : NULL;
+
+	bitlen = AF_BITS(rt->rtm_family);
+
+	if (!f->get) {
+		if ((f->type   && rt->rtm_type     != f->type)   ||
+		    (f->family && rt->rtm_family   != f->family) ||
+		    (f->proto  && rt->rtm_protocol != f->proto)  ||
+		    (f->scope  && rt->rtm_scope    != f->scope)  ||
+		    (f->iif    && iif              != f->iif)    ||
+		    (f->oif    && oif              != f->oif)    ||
+		    (f->table  && table            != f->table)  ||
+		    diff_prefix(rt->rtm_family, from, rt->rtm_src_len,
+		                f->from_exact, &f->from)         ||
+		    diff_prefix(rt->rtm_family, dst,  rt->rtm_dst_len,
+		                f->dst_exact, &f->dst)           ||
+		    diff_prefix(rt->rtm_family, gw,   bitlen,
+		                false, &f->gw)                   ||
+		    diff_prefix(rt->rtm_family, src,  bitlen,
+		                false, &f->src))
+			goto out;
+
+		if ((f->offset && s->skipped++ < f->offset) ||
+		    (f->limit && s->index >= f->limit))
+			goto out;
+	}
+
+	if (s->callback)
+		lua_pushvalue(s->L, s->callback);
+
+	lua_newtable(s->L);
+
+	L_setint(s->L, "type", rt->rtm_type);
+	L_setint(s->L, "family", (rt->rtm_family == AF_INET) ? 4 : 6);
+
+	L_setaddr(s->L, "dest", rt->rtm_family, dst, rt->rtm_dst_len);
+
+	if (gw)
+		L_setaddr(s->L, "gw", rt->rtm_family, gw, -1);
+
+	if (from)
+		L_setaddr(s->L, "from", rt->rtm_family, from, rt->rtm_src_len);
+
+	if (iif)
+		L_setdev(s, "iif", tb[RTA_IIF]);
+
+	if (oif)
+		L_setdev(s, "dev", tb[RTA_OIF]);
+
+	L_setint(s->L, "table", table);
+	L_setint(s->L, "proto", rt->rtm_protocol);
+	L_setint(s->L, "scope", rt->rtm_scope);
+
+	if (src)
+		L_setaddr(s->L, "src", rt->rtm_family, src, -1);
+
+	if (tb[RTA_PRIORITY])
+		L_setint(s->L, "metric", RTA_U32(tb[RTA_PRIORITY]));
+
+	if (rt->rtm_family == AF_INET6 && tb[RTA_CACHEINFO])
+	{
+		struct rta_cacheinfo *ci = RTA_DATA(tb[RTA_CACHEINFO]);
+
+		if (ci->rta_expires)
+		{
+			if (ci->rta_expires)
+				L_setint(s->L, "expires", ci->rta_expires / hz);
+
+			if (ci->rta_error != 0)
+				L_setint(s->L, "error", ci->rta_error);
+		}
+	}
+
+	s->index++;
+
+	if (s->callback)
+		L_callback(s);
+	else if ((hdr->nlmsg_flags & NLM_F_MULTI) && !s->iterate)
+		lua_rawseti(s->L, -2, s->index);
+
+out:
+	s->pending = !!(hdr->nlmsg_flags & NLM_F_MULTI);
+	return NL_SKIP;
+}
+
+static int cb_dump_route(struct nl_msg *msg, void *arg)
+{
+	return _dump_route(nlmsg_hdr(msg), arg);
+}
+
+static int
+cb_done(struct nl_msg *msg, void *arg)
+{
+	struct dump_state *s = arg;
+	s->pending = 0;
+	return NL_STOP;
+}
+
+static int
+cb_error(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
+{
+	struct dump_state *s = arg;
+	s->pending = 0;
+	return NL_STOP;
+}
+
+static int _error(lua_State *L, int code, const char *msg)
+{
+	lua_pushnil(L);
+	lua_pushnumber(L, code ? code : errno);
+	lua_pushstring(L, msg ? msg : strerror(errno));
+
+	return 3;
+}
+
+static struct nl_sock * nl_sock_open(void)
+{
+	struct nl_sock *sk = nl_socket_alloc();
+	int one = 1;
+
+	if (!sk)
+		return NULL;
+
+	if (nl_connect(sk, NETLINK_ROUTE))
+	{
+		nl_socket_free(sk);
+		return NULL;
+	}
+
+	/* let the kernel apply dump filters if it supports strict checking */
+	strict_chk = !setsockopt(nl_socket_get_fd(sk), SOL_NETLINK,
+	                         NETLINK_GET_STRICT_CHK, &one, sizeof(one));
+
+	return sk;
+}
+
+static bool nl_sock_init(void)
+{
+	if (!sock)
+		sock = nl_sock_open();
+
+	return (sock != NULL);
+}
+
+static struct nl_msg * _route_msg(struct dump_filter *filter)
+{
+	struct nl_msg *msg;
+	struct rtmsg rtm = {
+		.rtm_family = filter->family,
+		.rtm_dst_len = filter->dst.bits,
+		.rtm_src_len = filter->src.bits
+	};
+
+	if (strict_chk)
+	{
+		/* strict checking rejects prefix lengths in dump requests and
+		 * anything but host lengths in get requests */
+		if (filter->get)
+		{
+			rtm.rtm_dst_len = AF_BITS(filter->dst.family);
+			rtm.rtm_src_len = AF_BITS(filter->src.family);
+		}
+		else
+		{
+			rtm.rtm_dst_len = 0;
+			rtm.rtm_src_len = 0;
+			rtm.rtm_type = filter->type;
+			rtm.rtm_protocol = filter->proto;
+			rtm.rtm_table = (filter->table < 256) ? filter->table : RT_TABLE_UNSPEC;
+		}
+	}
+
+	msg = nlmsg_alloc_simple(RTM_GETROUTE,
+		filter->get ? NLM_F_REQUEST : NLM_F_REQUEST | NLM_F_DUMP);
+
+	if (!msg)
+		return NULL;
+
+	nlmsg_append(msg, &rtm, sizeof(rtm), 0);
+
+	if (filter->get) {
+		nla_put(msg, RTA_DST, AF_BYTES(filter->dst.family),
+		        &filter->dst.addr.v6);
+
+		if (filter->src.family)
+			nla_put(msg, RTA_SRC, AF_BYTES(filter->src.family),
+			        &filter->src.addr.v6);
+	}
+	else if (strict_chk) {
+		if (filter->table >= 256)
+			nla_put_u32(msg, RTA_TABLE, filter->table);
+
+		if (filter->oif)
+			nla_put_u32(msg, RTA_OIF, filter->oif);
+	}
+
+	return msg;
+}
+
+static int _route_dump(lua_State *L, struct dump_filter *filter)
+{
+	struct dump_state s = {
+		.L = L,
+		.pending = 1,
+		.index = 0,
+		.callback = lua_isfunction(L, 2) ? 2 : 0,
+		.filter = filter
+	};
+
+	if (!hz)
+		hz = sysconf(_SC_CLK_TCK);
+
+	if (!nl_sock_init())
+		return _error(L, 0, NULL);
+
+	struct nl_msg *msg;
+	struct nl_cb *cb = nl_cb_alloc(NL_CB_DEFAULT);
+
+	msg = _route_msg(filter);
+	if (!msg)
+		goto out;
+
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, cb_dump_route, &s);
+	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, cb_done, &s);
+	nl_cb_err(cb, NL_CB_CUSTOM, cb_error, &s);
+
+	nl_send_auto_complete(sock, msg);
+
+	if (!filter->get && !s.callback)
+		lua_newtable(L);
+
+	while (s.pending > 0)
+		nl_recvmsgs(sock, cb);
+
+	nlmsg_free(msg);
+
+out:
+	nl_cb_put(cb);
+
+	if (s.callback)
+		return 0;
+
+	if (!filter->get)
+		return 1;
+
+	return (s.index > 0);
+}
+
+static int route_get(lua_State *L)
+{
+	struct dump_filter filter = { .get = true };
+	const char *dest = luaL_checkstring(L, 1);
+	const char *from = luaL_optstring(L, 2, NULL);
+
+	if (!parse_cidr(dest, &filter.dst))
+		return _error(L, -1, "Invalid destination");
+
+	if (from && !parse_cidr(from, &filter.src))
+		return _error(L, -1, "Invalid source");
+
+	if (filter.src.family != 0 &&
+	    filter.src.family != filter.dst.family)
+		return _error(L, -1, "Different source/destination family");
+
+	filter.family = filter.dst.family;
+
+	return _route_dump(L, &filter);
+}
+
+static void L_route_filter(lua_State *L, int index, struct dump_filter *filter)
+{
+	const char *s;
+	cidr_t p = { };
+
+	if (lua_type(L, index) != LUA_TTABLE)
+		return;
+
+	filter->family = L_getint(L, index, "family");
+
+	if (filter->family == 4)
+		filter->family = AF_INET;
+	else if (filter->family == 6)
+		filter->family = AF_INET6;
+	else
+		filter->family = 0;
+
+	if ((s = L_getstr(L, index, "iif")) != NULL)
+		filter->iif = if_nametoindex(s);
+
+	if ((s = L_getstr(L, index, "oif")) != NULL)
+		filter->oif = if_nametoindex(s);
+
+	filter->type = L_getint(L, index, "type");
+	filter->scope = L_getint(L, index, "scope");
+	filter->proto = L_getint(L, index, "proto");
+	filter->table = L_getint(L, index, "table");
+
+	if ((s = L_getstr(L, index, "gw")) != NULL && parse_cidr(s, &p))
+		filter->gw = p;
+
+	if ((s = L_getstr(L, index, "from")) != NULL && parse_cidr(s, &p))
+		filter->from = p;
+
+	if ((s = L_getstr(L, index, "src")) != NULL && parse_cidr(s, &p))
+		filter->src = p;
+
+	if ((s = L_getstr(L, index, "dest")) != NULL && parse_cidr(s, &p))
+		filter->dst = p;
+
+	if ((s = L_getstr(L, index, "from_exact")) != NULL && parse_cidr(s, &p))
+		filter->from = p, filter->from_exact = true;
+
+	if ((s = L_getstr(L, index, "dest_exact")) != NULL && parse_cidr(s, &p))
+		filter->dst = p, filter->dst_exact = true;
+
+	filter->offset = L_getint(L, index, "offset");
+	filter->limit = L_getint(L, index, "limit");
+}
+
+static int route_dump(lua_State *L)
+{
+	struct dump_filter filter = { };
+
+	L_route_filter(L, 1, &filter);
+
+	return _route_dump(L, &filter);
+}
+
+typedef struct {
+	struct nl_sock *sock;
+	struct dump_filter filter;
+	struct dump_state state;
+	int pos, len;
+	char buf[32768];
+} route_iter_t;
+
+static int route_iter_close(route_iter_t *it)
+{
+	if (it->sock)
+		nl_socket_free(it->sock);
+
+	it->sock = NULL;
+
+	return 0;
+}
+
+static int route_iter_next(lua_State *L)
+{
+	route_iter_t *it = luaL_checkudata(L, lua_upvalueindex(1), LUCI_IP_ROUTEITER);
+	struct nlmsghdr *hdr;
+	int top = lua_gettop(L);
+
+	it->state.L = L;
+
+	while (it->sock)
+	{
+		if (it->filter.limit && it->state.index >= it->filter.limit)
+			return route_iter_close(it);
+
+		if (it->len <= 0)
+		{
+			it->pos = 0;
+			it->len = recv(nl_socket_get_fd(it->sock), it->buf, sizeof(it->buf), 0);
+
+			if (it->len < 0 && errno == EINTR)
+				continue;
+
+			if (it->len <= 0)
+				return route_iter_close(it);
+		}
+
+		hdr = (struct nlmsghdr *)(it->buf + it->pos);
+
+		if (!NLMSG_OK(hdr, it->len))
+		{
+			it->len = 0;
+			continue;
+		}
+
+		it->pos += NLMSG_ALIGN(hdr->nlmsg_len);
+		it->len -= NLMSG_ALIGN(hdr->nlmsg_len);
+
+		if (hdr->nlmsg_type == NLMSG_DONE || hdr->nlmsg_type == NLMSG_ERROR)
+			return route_iter_close(it);
+
+		_dump_route(hdr, &it->state);
+
+		if (lua_gettop(L) > top)
+			return 1;
+	}
+
+	return 0;
+}
+
+static int route_iter_gc(lua_State *L)
+{
+	return route_iter_close(luaL_checkudata(L, 1, LUCI_IP_ROUTEITER));
+}
+
+static int route_iter(lua_State *L)
+{
+	struct nl_msg *msg;
+	route_iter_t *it;
+
+	if (!hz)
+		hz = sysconf(_SC_CLK_TCK);
+
+	if (!(it = lua_newuserdata(L, sizeof(*it))))
+		return _error(L, -1, "Out of memory");
+
+	memset(it, 0, sizeof(*it));
+	luaL_getmetatable(L, LUCI_IP_ROUTEITER);
+	lua_setmetatable(L, -2);
+
+	L_route_filter(L, 1, &it->filter);
+
+	it->state.filter = &it->filter;
+	it->state.iterate = true;
+
+	/* each iterator uses its own socket to keep its dump in progress
+	 * while other requests are issued */
+	it->sock = nl_sock_open();
+
+	if (!it->sock)
+		return _error(L, 0, NULL);
+
+	msg = _route_msg(&it->filter);
+
+	if (!msg)
+		return _error(L, -1, "Out of memory");
+
+	nl_send_auto_complete(it->sock, msg);
+	nlmsg_free(msg);
+
+	lua_pushcclosure(L, route_iter_next, 1);
+
+	return 1;
+}
+
+
+static bool diff_macaddr(struct ether_addr *mac1, struct ether_addr *mac2)
+{
+	struct ether_addr empty = { };
+
+	if (!memcmp(mac2, &empty, sizeof(empty)))
+		return false;
+
+	if (!mac1 || memcmp(mac1, mac2, sizeof(empty)))
+		return true;
+
+	return false;
+}
+
+static int _dump_neigh(struct nlmsghdr *hdr, struct dump_state *s)
+{
+	char buf[32];
+	struct ether_addr *mac;
+	struct in6_addr *dst;
+	struct dump_filter *f = s->filter;
+	struct ndmsg *nd = NLMSG_DATA(hdr);
+	struct nlattr *tb[NDA_MAX+1];
+	int bitlen;
+
+	if (hdr->nlmsg_type != RTM_NEWNEIGH ||
+	    (nd->ndm_family != AF_INET && nd->ndm_family != AF_INET6))
+		return NL_SKIP;
+
+	nlmsg_parse(hdr, sizeof(*nd), tb, NDA_MAX, NULL);
+
+	mac = tb[NDA_LLADDR] ? RTA_DATA(tb[NDA_LLADDR]) : NULL;
+	dst = tb[NDA_DST]    ? RTA_DATA(tb[NDA_DST])    : NULL;
+
+	bitlen = AF_BITS(nd->ndm_family);
+
+	if ((f->family && nd->ndm_family  != f->family) ||
+	    (f->iif    && nd->ndm_ifindex != f->iif) ||
+		(f->type   && !(f->type & nd->ndm_state)) ||
+	    diff_prefix(nd->ndm_family, dst, bitlen, false, &f->dst) ||
+	    diff_macaddr(mac, &f->mac))
+		goto out;
+
+	if (s->callback)
+		lua_pushvalue(s->L, s->callback);
+
+	lua_newtable(s->L);
+
+	L_setint(s->L, "family", (nd->ndm_family == AF_INET) ? 4 : 6);
+	L_setstr(s->L, "dev", L_ifname(s, nd->ndm_ifindex, buf));
+
+	L_setbool(s->L, "router", (nd->ndm_flags & NTF_ROUTER));
+	L_setbool(s->L, "proxy", (nd->ndm_flags & NTF_PROXY));
+
+	L_setbool(s->L, "incomplete", (nd->ndm_state & NUD_INCOMPLETE));
+	L_setbool(s->L, "reachable", (nd->ndm_state & NUD_REACHABLE));
+	L_setbool(s->L, "stale", (nd->ndm_state & NUD_STALE));
+	L_setbool(s->L, "delay", (nd->ndm_state & NUD_DELAY));
+	L_setbool(s->L, "probe", (nd->ndm_state & NUD_PROBE));
+	L_setbool(s->L, "failed", (nd->ndm_state & NUD_FAILED));
+	L_setbool(s->L, "noarp", (nd->ndm_state & NUD_NOARP));
+	L_setbool(s->L, "permanent", (nd->ndm_state & NUD_PERMANENT));
+
+	if (dst)
+		L_setaddr(s->L, "dest", nd->ndm_family, dst, -1);
+
+	if (mac)
+		L_setaddr(s->L, "mac", AF_PACKET, mac, -1);
+
+	s->index++;
+
+	if (s->callback)
+		L_callback(s);
+	else if (hdr->nlmsg_flags & NLM_F_MULTI)
+		lua_rawseti(s->L, -2, s->index);
+
+out:
+	s->pending = !!(hdr->nlmsg_flags & NLM_F_MULTI);
+	return NL_SKIP;
+}
+
+static int cb_dump_neigh(struct nl_msg *msg, void *arg)
+{
+	return _dump_neigh(nlmsg_hdr(msg), arg);
+}
+
+static void L_neigh_filter(lua_State *L, int index, struct dump_filter *filter)
+{
+	cidr_t p = { };
+	const char *s;
+	struct ether_addr *mac;
+
+	if (lua_type(L, index) != LUA_TTABLE)
+		return;
+
+	filter->family = L_getint(L, index, "family");
+
+	if (filter->family == 4)
+		filter->family = AF_INET;
+	else if (filter->family == 6)
+		filter->family = AF_INET6;
+	else
+		filter->family = 0;
+
+	if ((s = L_getstr(L, index, "dev")) != NULL)
+		filter->iif = if_nametoindex(s);
+
+	if ((s = L_getstr(L, index, "dest")) != NULL && parse_cidr(s, &p))
+		filter->dst = p;
+
+	if ((s = L_getstr(L, index, "mac")) != NULL &&
+	    (mac = ether_aton(s)) != NULL)
+		filter->mac = *mac;
+}
+
+static int neighbor_dump(lua_State *L)
+{
+	struct dump_filter filter = { .type = 0xFF & ~NUD_NOARP };
+	struct dump_state st = {
+		.callback = lua_isfunction(L, 2) ? 2 : 0,
+		.pending = 1,
+		.filter = &filter,
+		.L = L
+	};
+
+	L_neigh_filter(L, 1, &filter);
+
+	if (!nl_sock_init())
+		return _error(L, 0, NULL);
+
+	struct nl_msg *msg;
+	struct nl_cb *cb = nl_cb_alloc(NL_CB_DEFAULT);
+	struct ndmsg ndm = {
+		.ndm_family = filter.family
+	};
+
+	msg = nlmsg_alloc_simple(RTM_GETNEIGH, NLM_F_REQUEST | NLM_F_DUMP);
+	if (!msg)
+		goto out;
+
+	nlmsg_append(msg, &ndm, sizeof(ndm), 0);
+
+	if (strict_chk && filter.iif)
+		nla_put_u32(msg, NDA_IFINDEX, filter.iif);
+
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, cb_dump_neigh, &st);
+	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, cb_done, &st);
+	nl_cb_err(cb, NL_CB_CUSTOM, cb_error, &st);
+
+	nl_send_auto_complete(sock, msg);
+
+	if (!st.callback)
+		lua_newtable(L);
+
+	while (st.pending > 0)
+		nl_recvmsgs(sock, cb);
+
+	nlmsg_free(msg);
+
+out:
+	nl_cb_put(cb);
+	return (st.callback == 0);
+}
+
+
+static int _dump_link(struct nlmsghdr *hdr, struct dump_state *s)
+{
+	char buf[48];
+	struct ifinfomsg *ifm = NLMSG_DATA(hdr);
+	struct nlattr *tb[IFLA_MAX+1];
+
+	if (hdr->nlmsg_type != RTM_NEWLINK)
+		return NL_SKIP;
+
+	nlmsg_parse(hdr, sizeof(*ifm), tb, IFLA_MAX, NULL);
+
+	L_setbool(s->L, "up", (ifm->ifi_flags & IFF_RUNNING));
+	L_setint(s->L, "type", ifm->ifi_type);
+	L_setstr(s->L, "name", L_ifname(s, ifm->ifi_index, buf));
+
+	if (tb[IFLA_MTU])
+		L_setint(s->L, "mtu", RTA_U32(tb[IFLA_MTU]));
+
+	if (tb[IFLA_TXQLEN])
+		L_setint(s->L, "qlen", RTA_U32(tb[IFLA_TXQLEN]));
+
+	if (tb[IFLA_MASTER])
+		L_setdev(s, "master", tb[IFLA_MASTER]);
+
+	if (tb[IFLA_ADDRESS] && nla_len(tb[IFLA_ADDRESS]) == AF_BYTES(AF_PACKET))
+		L_setaddr(s->L, "mac", AF_PACKET, nla_get_string(tb[IFLA_ADDRESS]), -1);
+
+	s->pending = 0;
+	return NL_SKIP;
+}
+
+static int cb_dump_link(struct nl_msg *msg, void *arg)
+{
+	return _dump_link(nlmsg_hdr(msg), arg);
+}
+
+static int link_get(lua_State *L)
+{
+	const char *dev = luaL_checkstring(L, 1);
+	struct dump_state st = {
+		.pending = 1,
+		.L = L
+	};
+
+	if (!nl_sock_init())
+		return _error(L, 0, NULL);
+
+	struct nl_msg *msg = nlmsg_alloc_simple(RTM_GETLINK, NLM_F_REQUEST);
+	struct nl_cb *cb = nl_cb_alloc(NL_CB_DEFAULT);
+	struct ifinfomsg ifm = { .ifi_index = if_nametoindex(dev) };
+
+	if (!msg || !cb)
+		return 0;
+
+	nlmsg_append(msg, &ifm, sizeof(ifm), 0);
+
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, cb_dump_link, &st);
+	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, cb_done, &st);
+	nl_cb_err(cb, NL_CB_CUSTOM, cb_error, &st);
+
+	lua_newtable(L);
+
+	nl_send_auto_complete(sock, msg);
+
+	while (st.pending > 0)
+		nl_recvmsgs(sock, cb);
+
+	nlmsg_free(msg);
+	nl_cb_put(cb);
+
+	return 1;
+}
+
+
+/*
+ * netlink cache
+ */
+
+static uint32_t cache_hash(const uint8_t *key, size_t len)
+{
+	uint32_t h = 2166136261u;
+
+	while (len-- > 0)
+		h = (h ^ *key++) * 16777619u;
+
+	return h;
+}
+
+static void cache_key_put(uint8_t *key, uint8_t *len, const void *data,
+                          size_t size)
+{
+	if (data)
+		memcpy(key + *len, data, size);
+	else
+		memset(key + *len, 0, size);
+
+	*len += size;
+}
+
+/* Build the identity of the object described by the given message, the
+ * returned table is the cache table the object belongs to */
+static struct cache_table * cache_key(cache_t *c, struct nlmsghdr *hdr,
+                                      uint8_t *key, uint8_t *len)
+{
+	struct rtmsg *rt;
+	struct ndmsg *nd;
+	struct ifinfomsg *ifm;
+	struct nlattr *tb[RTA_MAX+1];
+	uint32_t table;
+
+	*len = 0;
+
+	switch (hdr->nlmsg_type)
+	{
+	case RTM_NEWROUTE:
+	case RTM_DELROUTE:
+		rt = NLMSG_DATA(hdr);
+
+		if (rt->rtm_family != AF_INET && rt->rtm_family != AF_INET6)
+			return NULL;
+
+		nlmsg_parse(hdr, sizeof(*rt), tb, RTA_MAX, NULL);
+
+		table = tb[RTA_TABLE] ? RTA_U32(tb[RTA_TABLE]) : rt->rtm_table;
+
+		cache_key_put(key, len, &rt->rtm_family, 1);
+		cache_key_put(key, len, &rt->rtm_dst_len, 1);
+		cache_key_put(key, len, &rt->rtm_src_len, 1);
+		cache_key_put(key, len, &rt->rtm_tos, 1);
+		cache_key_put(key, len, &table, 4);
+		cache_key_put(key, len,
+			tb[RTA_PRIORITY] ? RTA_DATA(tb[RTA_PRIORITY]) : NULL, 4);
+		cache_key_put(key, len,
+			tb[RTA_DST] ? RTA_DATA(tb[RTA_DST]) : NULL, AF_BYTES(rt->rtm_family));
+		cache_key_put(key, len,
+			tb[RTA_SRC] ? RTA_DATA(tb[RTA_SRC]) : NULL, AF_BYTES(rt->rtm_family));
+
+		/* IPv6 multipath routes are notified as one message per nexthop */
+		if (rt->rtm_family == AF_INET6)
+		{
+			cache_key_put(key, len,
+				tb[RTA_OIF] ? RTA_DATA(tb[RTA_OIF]) : NULL, 4);
+			cache_key_put(key, len,
+				tb[RTA_GATEWAY] ? RTA_DATA(tb[RTA_GATEWAY]) : NULL, 16);
+		}
+
+		return &c->routes;
+
+	case RTM_NEWNEIGH:
+	case RTM_DELNEIGH:
+		nd = NLMSG_DATA(hdr);
+
+		if (nd->ndm_family != AF_INET && nd->ndm_family != AF_INET6)
+			return NULL;
+
+		nlmsg_parse(hdr, sizeof(*nd), tb, NDA_MAX, NULL);
+
+		cache_key_put(key, len, &nd->ndm_family, 1);
+		cache_key_put(key, len, &nd->ndm_ifindex, 4);
+		cache_key_put(key, len,
+			tb[NDA_DST] ? RTA_DATA(tb[NDA_DST]) : NULL, AF_BYTES(nd->ndm_family));
+
+		return &c->neighs;
+
+	case RTM_NEWLINK:
+	case RTM_DELLINK:
+		ifm = NLMSG_DATA(hdr);
+
+		/* ignore AF_BRIDGE port notifications for the same ifindex */
+		if (ifm->ifi_family != AF_UNSPEC)
+			return NULL;
+
+		cache_key_put(key, len, &ifm->ifi_index, 4);
+
+		return &c->links;
+	}
+
+	return NULL;
+}
+
+static struct cache_entry * cache_find(struct cache_table *t,
+                                       const uint8_t *key, uint8_t len,
+                                       uint32_t hash)
+{
+	struct cache_entry *e;
+
+	if (!t->size)
+		return NULL;
+
+	for (e = t->buckets[hash % t->size]; e; e = e->hnext)
+		if (e->hash == hash && e->keylen == len && !memcmp(e->key, key, len))
+			return e;
+
+	return NULL;
+}
+
+static void cache_unlink(struct cache_table *t, struct cache_entry *e)
+{
+	struct cache_entry **pp;
+
+	for (pp = &t->buckets[e->hash % t->size]; *pp; pp = &(*pp)->hnext)
+	{
+		if (*pp == e)
+		{
+			*pp = e->hnext;
+			break;
+		}
+	}
+
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		t->head = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		t->tail = e->prev;
+
+	t->count--;
+	free(e->hdr);
+	free(e);
+}
+
+static bool cache_grow(struct cache_table *t)
+{
+	struct cache_entry **buckets, *e;
+	size_t size = t->size ? t->size * 2 : 64;
+
+	buckets = calloc(size, sizeof(*buckets));
+
+	if (!buckets)
+		return false;
+
+	for (e = t->head; e; e = e->next)
+	{
+		e->hnext = buckets[e->hash % size];
+		buckets[e->hash % size] = e;
+	}
+
+	free(t->buckets);
+
+	t->buckets = buckets;
+	t->size = size;
+
+	return true;
+}
+
+static void cache_clear(struct cache_table *t)
+{
+	struct cache_entry *e, *next;
+
+	for (e = t->head; e; e = next)
 	{
-		filter.family = L_getint(L, 1, "family");
+		next = e->next;
+		free(e->hdr);
+		free(e);
+	}
+
+	free(t->buckets);
+	memset(t, 0, sizeof(*t));
+}
+
+/* Apply a single new or delete notification to the cache */
+static void cache_apply(cache_t *c, struct nlmsghdr *hdr)
+{
+	struct cache_table *t;
+	struct cache_entry *e;
+	struct ifinfomsg *ifm;
+	struct nlmsghdr *copy;
+	uint8_t key[sizeof(e->key)], len;
+	uint32_t hash;
+
+	t = cache_key(c, hdr, key, &len);
+
+	if (!t)
+		return;
+
+	hash = cache_hash(key, len);
+	e = cache_find(t, key, len, hash);
+
+	if (t == &c->links)
+	{
+		ifm = NLMSG_DATA(hdr);
+
+		/* the kernel flushes IPv4 routes of downed or removed links
+		 * without sending notifications, refetch them */
+		if (hdr->nlmsg_type == RTM_DELLINK ||
+		    (e && ((((struct ifinfomsg *)NLMSG_DATA(e->hdr))->ifi_flags ^
+		            ifm->ifi_flags) & IFF_UP)))
+			c->resync = true;
+	}
+
+	if (hdr->nlmsg_type == RTM_DELROUTE ||
+	    hdr->nlmsg_type == RTM_DELNEIGH ||
+	    hdr->nlmsg_type == RTM_DELLINK)
+	{
+		if (e)
+		{
+			cache_unlink(t, e);
+			c->generation++;
+		}
 
-		if (filter.family == 4)
-			filter.family = AF_INET;
-		else if (filter.family == 6)
-			filter.family = AF_INET6;
-		else
-			filter.family = 0;
+		return;
+	}
 
-		if ((s = L_getstr(L, 1, "iif")) != NULL)
-			filter.iif = if_nametoindex(s);
+	copy = malloc(hdr->nlmsg_len);
 
-		if ((s = L_getstr(L, 1, "oif")) != NULL)
-			filter.oif = if_nametoindex(s);
+	if (!copy)
+		return;
 
-		filter.type = L_getint(L, 1, "type");
-		filter.scope = L_getint(L, 1, "scope");
-		filter.proto = L_getint(L, 1, "proto");
-		filter.table = L_getint(L, 1, "table");
+	memcpy(copy, hdr, hdr->nlmsg_len);
 
-		if ((s = L_getstr(L, 1, "gw")) != NULL && parse_cidr(s, &p))
-			filter.gw = p;
+	/* flag stored messages as multipart so that they're emitted like
+	 * replies to a dump request */
+	copy->nlmsg_flags |= NLM_F_MULTI;
 
-		if ((s = L_getstr(L, 1, "from")) != NULL && parse_cidr(s, &p))
-			filter.from = p;
+	if (e)
+	{
+		free(e->hdr);
+		e->hdr = copy;
+		c->generation++;
 
-		if ((s = L_getstr(L, 1, "src")) != NULL && parse_cidr(s, &p))
-			filter.src = p;
+		return;
+	}
 
-		if ((s = L_getstr(L, 1, "dest")) != NULL && parse_cidr(s, &p))
-			filter.dst = p;
+	if (t->count >= t->size * 2 && !cache_grow(t))
+		goto err;
 
-		if ((s = L_getstr(L, 1, "from_exact")) != NULL && parse_cidr(s, &p))
-			filter.from = p, filter.from_exact = true;
+	e = calloc(1, sizeof(*e));
 
-		if ((s = L_getstr(L, 1, "dest_exact")) != NULL && parse_cidr(s, &p))
-			filter.dst = p, filter.dst_exact = true;
-	}
+	if (!e)
+		goto err;
 
-	return _route_dump(L, &filter);
-}
+	e->hash = hash;
+	e->keylen = len;
+	e->hdr = copy;
+	memcpy(e->key, key, len);
 
+	e->hnext = t->buckets[hash % t->size];
+	t->buckets[hash % t->size] = e;
 
-static bool diff_macaddr(struct ether_addr *mac1, struct ether_addr *mac2)
-{
-	struct ether_addr empty = { };
+	e->prev = t->tail;
 
-	if (!memcmp(mac2, &empty, sizeof(empty)))
-		return false;
+	if (t->tail)
+		t->tail->next = e;
+	else
+		t->head = e;
 
-	if (!mac1 || memcmp(mac1, mac2, sizeof(empty)))
-		return true;
+	t->tail = e;
+	t->count++;
+	c->generation++;
 
-	return false;
+	return;
+
+err:
+	free(copy);
 }
 
-static int cb_dump_neigh(struct nl_msg *msg, void *arg)
+static int cb_cache_store(struct nl_msg *msg, void *arg)
 {
-	char buf[32];
-	struct ether_addr *mac;
-	struct in6_addr *dst;
 	struct dump_state *s = arg;
-	struct dump_filter *f = s->filter;
 	struct nlmsghdr *hdr = nlmsg_hdr(msg);
-	struct ndmsg *nd = NLMSG_DATA(hdr);
-	struct nlattr *tb[NDA_MAX+1];
-	int bitlen;
 
-	if (hdr->nlmsg_type != RTM_NEWNEIGH ||
-	    (nd->ndm_family != AF_INET && nd->ndm_family != AF_INET6))
-		return NL_SKIP;
+	cache_apply(s->cache, hdr);
 
-	nlmsg_parse(hdr, sizeof(*nd), tb, NDA_MAX, NULL);
+	s->pending = !!(hdr->nlmsg_flags & NLM_F_MULTI);
+	return NL_SKIP;
+}
 
-	mac = tb[NDA_LLADDR] ? RTA_DATA(tb[NDA_LLADDR]) : NULL;
-	dst = tb[NDA_DST]    ? RTA_DATA(tb[NDA_DST])    : NULL;
+static bool cache_dump(cache_t *c, int type, size_t hdrlen)
+{
+	struct dump_state st = {
+		.pending = 1,
+		.cache = c
+	};
 
-	bitlen = AF_BITS(nd->ndm_family);
+	union {
+		struct rtmsg rt;
+		struct ndmsg nd;
+		struct ifinfomsg ifi;
+	} req = { };
 
-	if ((f->family && nd->ndm_family  != f->family) ||
-	    (f->iif    && nd->ndm_ifindex != f->iif) ||
-		(f->type   && !(f->type & nd->ndm_state)) ||
-	    diff_prefix(nd->ndm_family, dst, bitlen, false, &f->dst) ||
-	    diff_macaddr(mac, &f->mac))
+	struct nl_msg *msg = nlmsg_alloc_simple(type, NLM_F_REQUEST | NLM_F_DUMP);
+	struct nl_cb *cb = nl_cb_alloc(NL_CB_DEFAULT);
+
+	if (!msg || !cb)
 		goto out;
 
-	if (s->callback)
-		lua_pushvalue(s->L, 2);
+	nlmsg_append(msg, &req, hdrlen, 0);
 
-	lua_newtable(s->L);
+	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, cb_cache_store, &st);
+	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, cb_done, &st);
+	nl_cb_err(cb, NL_CB_CUSTOM, cb_error, &st);
 
-	L_setint(s->L, "family", (nd->ndm_family == AF_INET) ? 4 : 6);
-	L_setstr(s->L, "dev", if_indextoname(nd->ndm_ifindex, buf));
+	nl_send_auto_complete(sock, msg);
 
-	L_setbool(s->L, "router", (nd->ndm_flags & NTF_ROUTER));
-	L_setbool(s->L, "proxy", (nd->ndm_flags & NTF_PROXY));
+	while (st.pending > 0)
+		if (nl_recvmsgs(sock, cb) < 0)
+			break;
 
-	L_setbool(s->L, "incomplete", (nd->ndm_state & NUD_INCOMPLETE));
-	L_setbool(s->L, "reachable", (nd->ndm_state & NUD_REACHABLE));
-	L_setbool(s->L, "stale", (nd->ndm_state & NUD_STALE));
-	L_setbool(s->L, "delay", (nd->ndm_state & NUD_DELAY));
-	L_setbool(s->L, "probe", (nd->ndm_state & NUD_PROBE));
-	L_setbool(s->L, "failed", (nd->ndm_state & NUD_FAILED));
-	L_setbool(s->L, "noarp", (nd->ndm_state & NUD_NOARP));
-	L_setbool(s->L, "permanent", (nd->ndm_state & NUD_PERMANENT));
+out:
+	if (msg)
+		nlmsg_free(msg);
 
-	if (dst)
-		L_setaddr(s->L, "dest", nd->ndm_family, dst, -1);
+	if (cb)
+		nl_cb_put(cb);
 
-	if (mac)
-		L_setaddr(s->L, "mac", AF_PACKET, mac, -1);
+	return (msg && cb && st.pending == 0);
+}
 
-	s->index++;
+static bool cache_fill(cache_t *c)
+{
+	cache_clear(&c->routes);
+	cache_clear(&c->neighs);
+	cache_clear(&c->links);
 
-	if (s->callback)
-		lua_call(s->L, 1, 0);
-	else if (hdr->nlmsg_flags & NLM_F_MULTI)
-		lua_rawseti(s->L, -2, s->index);
+	c->resync = false;
+	c->generation++;
 
-out:
-	s->pending = !!(hdr->nlmsg_flags & NLM_F_MULTI);
-	return NL_SKIP;
+	return (cache_dump(c, RTM_GETLINK, sizeof(struct ifinfomsg)) &&
+	        cache_dump(c, RTM_GETROUTE, sizeof(struct rtmsg)) &&
+	        cache_dump(c, RTM_GETNEIGH, sizeof(struct ndmsg)));
 }
 
-static int neighbor_dump(lua_State *L)
+/* Consume all pending change notifications, refetch everything if the
+ * socket receive queue overflowed and notifications got lost */
+static void cache_update(cache_t *c)
 {
-	cidr_t p = { };
-	const char *s;
-	struct ether_addr *mac;
-	struct dump_filter filter = { .type = 0xFF & ~NUD_NOARP };
-	struct dump_state st = {
-		.callback = lua_isfunction(L, 2),
-		.pending = 1,
-		.filter = &filter,
-		.L = L
-	};
+	char buf[32768];
+	struct nlmsghdr *hdr;
+	int fd, len;
 
-	if (lua_type(L, 1) == LUA_TTABLE)
+	/* do not modify entries while they're being iterated */
+	if (c->busy)
+		return;
+
+	fd = nl_socket_get_fd(c->sock);
+
+	while (true)
 	{
-		filter.family = L_getint(L, 1, "family");
+		len = recv(fd, buf, sizeof(buf), MSG_DONTWAIT);
 
-		if (filter.family == 4)
-			filter.family = AF_INET;
-		else if (filter.family == 6)
-			filter.family = AF_INET6;
-		else
-			filter.family = 0;
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (errno == ENOBUFS)
+			{
+				c->resync = true;
+				continue;
+			}
 
-		if ((s = L_getstr(L, 1, "dev")) != NULL)
-			filter.iif = if_nametoindex(s);
+			if (c->resync && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+			    cache_fill(c))
+				continue;
 
-		if ((s = L_getstr(L, 1, "dest")) != NULL && parse_cidr(s, &p))
-			filter.dst = p;
+			break;
+		}
 
-		if ((s = L_getstr(L, 1, "mac")) != NULL &&
-		    (mac = ether_aton(s)) != NULL)
-			filter.mac = *mac;
+		for (hdr = (struct nlmsghdr *)buf;
+		     NLMSG_OK(hdr, len);
+		     hdr = NLMSG_NEXT(hdr, len))
+			cache_apply(c, hdr);
 	}
+}
 
-	if (!sock)
-	{
-		sock = nl_socket_alloc();
-		if (!sock)
-			return _error(L, -1, "Out of memory");
+static const char *cache_ifname(cache_t *c, int ifindex)
+{
+	struct nlattr *tb[IFLA_MAX+1];
+	struct cache_entry *e;
+	uint8_t key[sizeof(ifindex)];
 
-		if (nl_connect(sock, NETLINK_ROUTE))
-			return _error(L, 0, NULL);
-	}
+	memcpy(key, &ifindex, sizeof(key));
+	e = cache_find(&c->links, key, sizeof(key), cache_hash(key, sizeof(key)));
 
-	struct nl_msg *msg;
-	struct nl_cb *cb = nl_cb_alloc(NL_CB_DEFAULT);
-	struct ndmsg ndm = {
-		.ndm_family = filter.family
+	if (!e)
+		return NULL;
+
+	nlmsg_parse(e->hdr, sizeof(struct ifinfomsg), tb, IFLA_MAX, NULL);
+
+	return tb[IFLA_IFNAME] ? nla_get_string(tb[IFLA_IFNAME]) : NULL;
+}
+
+static int cache_new(lua_State *L)
+{
+	const int groups[] = {
+		RTNLGRP_LINK, RTNLGRP_NEIGH, RTNLGRP_IPV4_ROUTE, RTNLGRP_IPV6_ROUTE
 	};
 
-	msg = nlmsg_alloc_simple(RTM_GETNEIGH, NLM_F_REQUEST | NLM_F_DUMP);
-	if (!msg)
-		goto out;
+	int fd, rcvbuf = 1024 * 1024;
+	size_t i;
+	cache_t *c;
 
-	nlmsg_append(msg, &ndm, sizeof(ndm), 0);
+	if (!hz)
+		hz = sysconf(_SC_CLK_TCK);
 
-	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, cb_dump_neigh, &st);
-	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, cb_done, &st);
-	nl_cb_err(cb, NL_CB_CUSTOM, cb_error, &st);
+	if (!nl_sock_init())
+		return _error(L, -1, "Unable to connect netlink socket");
 
-	nl_send_auto_complete(sock, msg);
+	if (!(c = lua_newuserdata(L, sizeof(*c))))
+		return _error(L, -1, "Out of memory");
+
+	memset(c, 0, sizeof(*c));
+	luaL_getmetatable(L, LUCI_IP_CACHE);
+	lua_setmetatable(L, -2);
+
+	c->sock = nl_socket_alloc();
+
+	if (!c->sock)
+		return _error(L, -1, "Out of memory");
+
+	if (nl_connect(c->sock, NETLINK_ROUTE))
+		return _error(L, -1, "Unable to connect netlink socket");
+
+	fd = nl_socket_get_fd(c->sock);
+
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	/* subscribe before dumping, so that no change can be missed */
+	for (i = 0; i < sizeof(groups) / sizeof(groups[0]); i++)
+		if (setsockopt(fd, SOL_NETLINK, NETLINK_ADD_MEMBERSHIP,
+		               &groups[i], sizeof(groups[i])))
+			return _error(L, 0, NULL);
+
+	if (!cache_fill(c))
+		return _error(L, -1, "Unable to dump kernel tables");
+
+	return 1;
+}
+
+static int cache_routes(lua_State *L)
+{
+	cache_t *c = luaL_checkudata(L, 1, LUCI_IP_CACHE);
+	struct dump_filter filter = { };
+	struct dump_state st = {
+		.callback = lua_isfunction(L, 3) ? 3 : 0,
+		.filter = &filter,
+		.cache = c,
+		.L = L
+	};
+	struct cache_entry *e;
+
+	L_route_filter(L, 2, &filter);
+	cache_update(c);
 
 	if (!st.callback)
 		lua_newtable(L);
 
-	while (st.pending > 0)
-		nl_recvmsgs(sock, cb);
+	c->busy++;
 
-	nlmsg_free(msg);
+	for (e = c->routes.head; e; e = e->next)
+		_dump_route(e->hdr, &st);
+
+	c->busy--;
 
-out:
-	nl_cb_put(cb);
 	return (st.callback == 0);
 }
 
-
-static int cb_dump_link(struct nl_msg *msg, void *arg)
+static int cache_neighbors(lua_State *L)
 {
-	char buf[48];
-	struct dump_state *s = arg;
-	struct nlmsghdr *hdr = nlmsg_hdr(msg);
-	struct ifinfomsg *ifm = NLMSG_DATA(hdr);
-	struct nlattr *tb[IFLA_MAX+1];
-	int i, len;
-
-	if (hdr->nlmsg_type != RTM_NEWLINK)
-		return NL_SKIP;
-
-	nlmsg_parse(hdr, sizeof(*ifm), tb, IFLA_MAX, NULL);
+	cache_t *c = luaL_checkudata(L, 1, LUCI_IP_CACHE);
+	struct dump_filter filter = { .type = 0xFF & ~NUD_NOARP };
+	struct dump_state st = {
+		.callback = lua_isfunction(L, 3) ? 3 : 0,
+		.filter = &filter,
+		.cache = c,
+		.L = L
+	};
+	struct cache_entry *e;
 
-	L_setbool(s->L, "up", (ifm->ifi_flags & IFF_RUNNING));
-	L_setint(s->L, "type", ifm->ifi_type);
-	L_setstr(s->L, "name", if_indextoname(ifm->ifi_index, buf));
+	L_neigh_filter(L, 2, &filter);
+	cache_update(c);
 
-	if (tb[IFLA_MTU])
-		L_setint(s->L, "mtu", RTA_U32(tb[IFLA_MTU]));
+	if (!st.callback)
+		lua_newtable(L);
 
-	if (tb[IFLA_TXQLEN])
-		L_setint(s->L, "qlen", RTA_U32(tb[IFLA_TXQLEN]));
+	c->busy++;
 
-	if (tb[IFLA_MASTER])
-		L_setdev(s->L, "master", tb[IFLA_MASTER]);
+	for (e = c->neighs.head; e; e = e->next)
+		_dump_neigh(e->hdr, &st);
 
-	if (tb[IFLA_ADDRESS] && nla_len(tb[IFLA_ADDRESS]) == AF_BYTES(AF_PACKET))
-		L_setaddr(s->L, "mac", AF_PACKET, nla_get_string(tb[IFLA_ADDRESS]), -1);
+	c->busy--;
 
-	s->pending = 0;
-	return NL_SKIP;
+	return (st.callback == 0);
 }
 
-static int link_get(lua_State *L)
+static int cache_link(lua_State *L)
 {
-	const char *dev = luaL_checkstring(L, 1);
+	cache_t *c = luaL_checkudata(L, 1, LUCI_IP_CACHE);
+	const char *dev = luaL_checkstring(L, 2);
+	struct nlattr *tb[IFLA_MAX+1];
 	struct dump_state st = {
-		.pending = 1,
+		.cache = c,
 		.L = L
 	};
+	struct cache_entry *e;
 
-	if (!sock)
+	cache_update(c);
+	lua_newtable(L);
+
+	for (e = c->links.head; e; e = e->next)
 	{
-		sock = nl_socket_alloc();
-		if (!sock)
-			return _error(L, -1, "Out of memory");
+		nlmsg_parse(e->hdr, sizeof(struct ifinfomsg), tb, IFLA_MAX, NULL);
 
-		if (nl_connect(sock, NETLINK_ROUTE))
-			return _error(L, 0, NULL);
+		if (tb[IFLA_IFNAME] && !strcmp(nla_get_string(tb[IFLA_IFNAME]), dev))
+		{
+			_dump_link(e->hdr, &st);
+			break;
+		}
 	}
 
-	struct nl_msg *msg = nlmsg_alloc_simple(RTM_GETLINK, NLM_F_REQUEST);
-	struct nl_cb *cb = nl_cb_alloc(NL_CB_DEFAULT);
-	struct ifinfomsg ifm = { .ifi_index = if_nametoindex(dev) };
+	return 1;
+}
 
-	if (!msg || !cb)
-		return 0;
+static int cache_generation(lua_State *L)
+{
+	cache_t *c = luaL_checkudata(L, 1, LUCI_IP_CACHE);
 
-	nlmsg_append(msg, &ifm, sizeof(ifm), 0);
+	cache_update(c);
+	lua_pushnumber(L, c->generation);
 
-	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, cb_dump_link, &st);
-	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, cb_done, &st);
-	nl_cb_err(cb, NL_CB_CUSTOM, cb_error, &st);
+	return 1;
+}
 
-	lua_newtable(L);
+static int cache_gc(lua_State *L)
+{
+	cache_t *c = luaL_checkudata(L, 1, LUCI_IP_CACHE);
 
-	nl_send_auto_complete(sock, msg);
+	cache_clear(&c->routes);
+	cache_clear(&c->neighs);
+	cache_clear(&c->links);
 
-	while (st.pending > 0)
-		nl_recvmsgs(sock, cb);
+	if (c->sock)
+		nl_socket_free(c->sock);
 
-	nlmsg_free(msg);
-	nl_cb_put(cb);
+	c->sock = NULL;
 
-	return 1;
+	return 0;
 }
 
 
@@ -1635,13 +3128,23 @@ static const luaL_reg ip_methods[] = {
 	{ "checkip6",			cidr_checkip6     },
 	{ "checkmac",			cidr_checkmac     },
 
+	{ "parse_many",		cidrlist_parse    },
+	{ "format_many",	cidrlist_format   },
+	{ "sort",			cidrlist_sort     },
+	{ "dedupe",			cidrlist_dedupe   },
+
 	{ "route",			route_get         },
 	{ "routes",			route_dump        },
+	{ "routeiter",		route_iter        },
 
 	{ "neighbors",		neighbor_dump     },
 
 	{ "link",			link_get          },
 
+	{ "cache",			cache_new         },
+
+	{ "prefixset",		pset_new          },
+
 	{ }
 };
 
@@ -1685,6 +3188,51 @@ static const luaL_reg ip_cidr_methods[] = {
 	{ }
 };
 
+static const luaL_reg ip_cidrlist_methods[] = {
+	{ "format",			cidrlist_format   },
+	{ "sort",			cidrlist_sort     },
+	{ "dedupe",			cidrlist_dedupe   },
+	{ "get",			cidrlist_get      },
+	{ "count",			cidrlist_count    },
+
+	{ "__len",			cidrlist_count    },
+
+	{ }
+};
+
+static const luaL_reg ip_prefixset_methods[] = {
+	{ "insert",			pset_L_insert       },
+	{ "delete",			pset_L_delete       },
+	{ "lookup",			pset_L_lookup       },
+	{ "contains",		pset_L_contains     },
+	{ "contains_any",	pset_L_contains_any },
+	{ "overlaps",		pset_L_overlaps     },
+	{ "aggregate",		pset_L_aggregate    },
+	{ "prefixes",		pset_L_prefixes     },
+	{ "count",			pset_L_count        },
+
+	{ "__gc",			pset_L_gc           },
+
+	{ }
+};
+
+static const luaL_reg ip_routeiter_methods[] = {
+	{ "__gc",			route_iter_gc     },
+
+	{ }
+};
+
+static const luaL_reg ip_cache_methods[] = {
+	{ "routes",			cache_routes      },
+	{ "neighbors",		cache_neighbors   },
+	{ "link",			cache_link        },
+	{ "generation",		cache_generation  },
+
+	{ "__gc",			cache_gc          },
+
+	{ }
+};
+
 int luaopen_luci_ip(lua_State *L)
 {
 	luaL_register(L, LUCI_IP, ip_methods);
@@ -1695,5 +3243,27 @@ int luaopen_luci_ip(lua_State *L)
 	lua_setfield(L, -2, "__index");
 	lua_pop(L, 1);
 
+	luaL_newmetatable(L, LUCI_IP_CIDRLIST);
+	luaL_register(L, NULL, ip_cidrlist_methods);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, LUCI_IP_PREFIXSET);
+	luaL_register(L, NULL, ip_prefixset_methods);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, LUCI_IP_ROUTEITER);
+	luaL_register(L, NULL, ip_routeiter_methods);
+	lua_pop(L, 1);
+
+	luaL_newmetatable(L, LUCI_IP_CACHE);
+	luaL_register(L, NULL, ip_cache_methods);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
 	return 1;
 }
@@ -0,0 +1,24 @@
+--- Incremental Encoder / Decoder Object.
+-- Created by nixio.bin.codec().
+-- @cstyle	instance
+module "nixio.Codec"
+
+--- Process a chunk of data.
+-- Input bytes that do not complete a group are kept for the next call.
+-- @class function
+-- @name Codec.update
+-- @usage Base64 padding is only accepted at the end of the stream.
+-- @param buffer	Chunk of data
+-- @return converted data (may be empty)
+
+--- Finish processing and reset the codec.
+-- The Base64 encoder outputs the remaining bytes including padding, the
+-- decoders fail if an incomplete group remains.
+-- @class function
+-- @name Codec.final
+-- @return remaining converted data
+
+--- Discard any pending input and reset the codec.
+-- @class function
+-- @name Codec.reset
+-- @return true
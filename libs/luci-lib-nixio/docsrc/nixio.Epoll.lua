@@ -0,0 +1,54 @@
+--- (Linux) Epoll Object.
+-- Event flags are bitfields generated with nixio.poll_flags() or any
+-- combination of the EPOLL* constants of the C library.
+-- @cstyle	instance
+module "nixio.Epoll"
+
+--- Register an I/O descriptor.
+-- The entry table is stored in the epoll object and returned by wait()
+-- whenever the descriptor becomes ready, you can use other fields on your
+-- demand.
+-- @class function
+-- @name Epoll.add
+-- @param fd		I/O Descriptor [Socket Object, File Object]
+-- @param events	events to wait for (bitfield generated with poll_flags)
+-- @param entry	Table to use as entry (optional)
+-- @return entry table containing <ul>
+-- <li> fd = I/O Descriptor</li>
+-- <li> events = registered events</li>
+-- </ul>
+
+--- Change the events to wait for on a registered I/O descriptor.
+-- @class function
+-- @name Epoll.mod
+-- @param fd		I/O Descriptor [Socket Object, File Object]
+-- @param events	events to wait for (bitfield generated with poll_flags)
+-- @return entry table
+
+--- Unregister an I/O descriptor.
+-- @class function
+-- @name Epoll.del
+-- @usage Descriptors have to be unregistered before they are closed.
+-- @param fd		I/O Descriptor [Socket Object, File Object]
+-- @return true
+
+--- Wait for events on the registered I/O descriptors.
+-- @class function
+-- @name Epoll.wait
+-- @usage This function is not signal-protected and may fail with EINTR.
+-- @usage Returns false if the call timed out.
+-- @param timeout	Timeout in milliseconds, -1 to wait indefinitely
+-- @param maxevents	Maximum number of events to return
+-- (optional, default: number of registered descriptors)
+-- @return number of ready I/O descriptors
+-- @return Table of ready entries with the revents-field set
+
+--- Get the file descriptor number of the epoll instance.
+-- @class function
+-- @name Epoll.fileno
+-- @return file descriptor number
+
+--- Close the epoll instance.
+-- @class function
+-- @name Epoll.close
+-- @return true
@@ -105,6 +105,31 @@ module "nixio.Socket"
 -- @return host		IP-Address of the sender
 -- @return port		Port of the sender
 
+--- Receive multiple datagrams on the socket with a single system call.
+-- This blocks (unless the socket is non-blocking) until at least one datagram
+-- is available and then returns all datagrams already queued, up to count.
+-- @class function
+-- @name Socket.recvmmsg
+-- @usage This function is only available on Linux.
+-- @usage Datagrams longer than maxlen are silently truncated.
+-- @param count		Maximum number of datagrams to receive (at most 1024).
+-- @param maxlen	Maximum length of a single datagram (optional,
+-- default <em>nixio.const.buffersize</em>, at most 65536).
+-- @return Table of received payloads
+-- @return Table of sender addresses in the same order, each a table
+-- containing "address" and "port" (inet) or "address" (unix)
+
+--- Send multiple datagrams on the socket with a single system call.
+-- @class function
+-- @name Socket.sendmmsg
+-- @usage This function is only available on Linux.
+-- @usage Not all datagrams may be sent at once, check the return value
+-- and retry the remainder of the list if necessary.
+-- @param list	Table of datagrams (at most 1024 are sent per call). Each
+-- entry is either a string for connected sockets or a table containing
+-- "data", "address" and "port" (inet) or "data" and "address" (unix).
+-- @return number of datagrams sent
+
 --- Receive a message on the socket.
 -- This function is identical to recvfrom except that it does not return 
 -- the sender's source address. See the recvfrom description for more details.
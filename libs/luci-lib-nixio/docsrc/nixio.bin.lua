@@ -16,6 +16,9 @@ module "nixio.bin"
 --- Calculate the CRC32 value of a buffer. 
 -- @class function
 -- @name crc32
+-- @usage Data arriving in chunks can be processed incrementally by passing
+-- the previous result as initial value:
+-- <code>crc32(b, crc32(a)) == crc32(a .. b)</code>
 -- @param buffer	Buffer
 -- @param initial	Initial CRC32 value (optional)
 -- @return crc32 value
@@ -31,3 +34,12 @@ module "nixio.bin"
 -- @name b64decode
 -- @param buffer	Base64 Encoded data
 -- @return binary data
+
+--- Create an incremental encoder or decoder.
+-- Codec objects carry incomplete input groups over to the next chunk
+-- so large payloads can be processed in fixed memory.
+-- @class function
+-- @name codec
+-- @param type	["hexlify", "unhexlify", "b64encode", "b64decode"]
+-- @see nixio.Codec
+-- @return Codec Object
@@ -189,6 +189,15 @@ module "nixio"
 -- @return number of ready IO descriptors
 -- @return the fds-table with revents-fields set
 
+--- (Linux) Create an epoll instance.
+-- Unlike poll() descriptors are registered once with the returned object
+-- and waiting only returns the descriptors that are ready.
+-- @class function
+-- @name nixio.epoll
+-- @see nixio.Epoll
+-- @see nixio.poll_flags
+-- @return Epoll Object
+
 --- (POSIX) Clone the current process.
 -- @class function
 -- @name nixio.fork
@@ -380,6 +389,31 @@ module "nixio"
 -- @see nixio.splice_flags
 -- @return bytes sent
 
+--- (Linux) Transfer data between two I/O descriptors.
+-- Depending on the descriptor types the data is moved with sendfile(),
+-- with splice() directly or through an internal pipe, or with a read() and
+-- write() loop. The whole transfer runs in C, partial writes and
+-- non-blocking descriptors are handled internally.
+-- @class function
+-- @name nixio.transfer
+-- @usage If the kernel refuses the zero-copy methods before any data was
+-- moved, the next method is tried when using "auto".
+-- @usage On failure the amount of data transferred so far is returned as
+-- fourth value.
+-- @param src		Input I/O descriptor
+-- @param dst		Output I/O descriptor
+-- @param length	Amount of data to transfer (in Bytes), 0 or nil to
+-- transfer until end of file
+-- @param opts		Table containing any of the following fields (optional): <ul>
+-- <li>offset = Offset to read from, the file position is not changed</li>
+-- <li>method = ["sendfile", "splice", "copy", <strong>"auto"</strong>]</li>
+-- <li>timeout = Timeout in milliseconds when waiting for non-blocking
+-- descriptors (default: -1)</li>
+-- <li>progress = Function called with the amount of data transferred after
+-- each chunk, returning false aborts the transfer</li>
+-- </ul>
+-- @return bytes transferred
+
 --- (Linux) Generate a flag bitfield for a call to splice.
 -- @class function
 -- @name nixio.splice_flags
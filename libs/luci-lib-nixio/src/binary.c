@@ -18,6 +18,8 @@
 
 #include "nixio.h"
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 static unsigned char nixio__b64encode_tbl[] =
 	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
@@ -90,20 +92,197 @@ static const uint32_t nixio__crc32_tbl[] = {
 	0x2d02ef8dU
 };
 
+/* slicing-by-8 tables, derived from nixio__crc32_tbl when the module is opened */
+static uint32_t nixio__crc32_slice[8][256];
+static int nixio__crc32_ready = 0;
+
+static void nixio__crc32_init(void) {
+	if (nixio__crc32_ready) {
+		return;
+	}
+
+	nixio__crc32_ready = 1;
+
+	for (int i = 0; i < 256; i++) {
+		nixio__crc32_slice[0][i] = nixio__crc32_tbl[i];
+	}
+
+	for (int k = 1; k < 8; k++) {
+		for (int i = 0; i < 256; i++) {
+			uint32_t v = nixio__crc32_slice[k-1][i];
+			nixio__crc32_slice[k][i] = (v >> 8) ^ nixio__crc32_tbl[v & 0xffU];
+		}
+	}
+}
+
+static uint32_t nixio__crc32_sw(uint32_t value, const uint8_t *p, size_t len) {
+	const uint32_t (*t)[256] = nixio__crc32_slice;
+
+	/* byte order independent loads, the compiler merges them on LE targets */
+	while (len >= 8) {
+		uint32_t one = value ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24));
+		uint32_t two = p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32_t)p[7] << 24);
+
+		value = t[7][ one        & 0xffU] ^ t[6][(one >>  8) & 0xffU] ^
+		        t[5][(one >> 16) & 0xffU] ^ t[4][ one >> 24         ] ^
+		        t[3][ two        & 0xffU] ^ t[2][(two >>  8) & 0xffU] ^
+		        t[1][(two >> 16) & 0xffU] ^ t[0][ two >> 24         ];
+
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--) {
+		value = nixio__crc32_tbl[(value ^ *p++) & 0xffU] ^ (value >> 8);
+	}
+
+	return value;
+}
+
+#if defined(__aarch64__) && defined(__linux__)
+#include <sys/auxv.h>
+#include <arm_acle.h>
+
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+
+/* ARMv8 CRC32 instructions implement the same polynomial */
+__attribute__((target("+crc")))
+static uint32_t nixio__crc32_hw(uint32_t value, const uint8_t *p, size_t len) {
+	while (len && ((uintptr_t)p & 7)) {
+		value = __crc32b(value, *p++);
+		len--;
+	}
+
+	while (len >= 8) {
+		value = __crc32d(value, *(const uint64_t *)p);
+		p += 8;
+		len -= 8;
+	}
+
+	while (len--) {
+		value = __crc32b(value, *p++);
+	}
+
+	return value;
+}
+
+static uint32_t (*nixio__crc32)(uint32_t, const uint8_t *, size_t) = nixio__crc32_sw;
+
+static void nixio__crc32_select(void) {
+	if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+		nixio__crc32 = nixio__crc32_hw;
+	}
+}
+#else
+#define nixio__crc32 nixio__crc32_sw
+#define nixio__crc32_select()
+#endif
+
 static int nixio_bin_crc32(lua_State *L) {
 	size_t len;
-	const char *buffer = luaL_checklstring(L, 1, &len);
+	const uint8_t *buffer = (const uint8_t*)luaL_checklstring(L, 1, &len);
 	uint32_t value = luaL_optinteger(L, 2, 0);
 
-	value = ~value;
-	for (size_t i=0; i<len; i++) {
-		value = nixio__crc32_tbl[(value ^ buffer[i]) & 0xffU ] ^ (value >> 8);
-	}
+	value = nixio__crc32(~value, buffer, len);
 
 	lua_pushinteger(L, (int)(value ^ 0xffffffffU));
 	return 1;
 }
 
+/* reverse lookup tables, 0xff marks invalid input characters */
+static uint8_t nixio__hex2bin[256];
+static uint8_t nixio__b64decode_map[256];
+
+static void nixio__codec_init(void) {
+	memset(nixio__hex2bin, 0xff, sizeof(nixio__hex2bin));
+	memset(nixio__b64decode_map, 0xff, sizeof(nixio__b64decode_map));
+
+	for (int i = 0; i < 10; i++) {
+		nixio__hex2bin['0' + i] = i;
+	}
+
+	for (int i = 0; i < 6; i++) {
+		nixio__hex2bin['a' + i] = 10 + i;
+		nixio__hex2bin['A' + i] = 10 + i;
+	}
+
+	for (int i = 0; i < (int)sizeof(nixio__b64decode_tbl); i++) {
+		nixio__b64decode_map[43 + i] = nixio__b64decode_tbl[i];
+	}
+}
+
+static void nixio__hex_encode(uint8_t *o, const uint8_t *data, size_t len) {
+	for (size_t i = 0; i < len; i++) {
+		*o++ = nixio__bin2hex[data[i] >> 4];
+		*o++ = nixio__bin2hex[data[i] & 0x0f];
+	}
+}
+
+/* decode len / 2 bytes, returns -1 on invalid input */
+static int nixio__hex_decode(uint8_t *o, const uint8_t *data, size_t len) {
+	for (size_t i = 0; i + 1 < len; i += 2) {
+		uint8_t hi = nixio__hex2bin[data[i]];
+		uint8_t lo = nixio__hex2bin[data[i+1]];
+
+		if ((hi | lo) == 0xff) {
+			return -1;
+		}
+
+		*o++ = (hi << 4) | lo;
+	}
+
+	return 0;
+}
+
+/* encode full three byte groups */
+static void nixio__b64_encode(uint8_t *o, const uint8_t *data, size_t len) {
+	for (size_t i = 0; i + 2 < len; i += 3) {
+		uint32_t cv = (data[i] << 16) | (data[i+1] << 8) | data[i+2];
+		o[0] = nixio__b64encode_tbl[(cv >> 18) & 0x3f];
+		o[1] = nixio__b64encode_tbl[(cv >> 12) & 0x3f];
+		o[2] = nixio__b64encode_tbl[(cv >> 6)  & 0x3f];
+		o[3] = nixio__b64encode_tbl[ cv        & 0x3f];
+		o += 4;
+	}
+}
+
+/* encode a final group of one or two bytes including padding */
+static void nixio__b64_encode_tail(uint8_t *o, const uint8_t *data, size_t pad) {
+	uint32_t cv = data[0] << 16;
+	o[3] = '=';
+	o[2] = '=';
+	if (pad == 2) {
+		cv |= data[1] << 8;
+		o[2] = nixio__b64encode_tbl[(cv >> 6) & 0x3f];
+	}
+	o[1] = nixio__b64encode_tbl[(cv >> 12) & 0x3f];
+	o[0] = nixio__b64encode_tbl[(cv >> 18) & 0x3f];
+}
+
+/* decode full four character groups, returns -1 on invalid input */
+static int nixio__b64_decode(uint8_t *o, const uint8_t *data, size_t len) {
+	for (size_t i = 0; i + 3 < len; i += 4) {
+		uint8_t a = nixio__b64decode_map[data[i]];
+		uint8_t b = nixio__b64decode_map[data[i+1]];
+		uint8_t c = nixio__b64decode_map[data[i+2]];
+		uint8_t d = nixio__b64decode_map[data[i+3]];
+
+		if ((a | b | c | d) == 0xff) {
+			return -1;
+		}
+
+		uint32_t cv = (a << 18) | (b << 12) | (c << 6) | d;
+		o[0] = (uint8_t)((cv >> 16) & 0xff);
+		o[1] = (uint8_t)((cv >>  8) & 0xff);
+		o[2] = (uint8_t)( cv        & 0xff);
+		o += 3;
+	}
+
+	return 0;
+}
+
 static int nixio_bin_hexlify(lua_State *L) {
 	size_t len, lenout;
 	luaL_checktype(L, 1, LUA_TSTRING);
@@ -117,17 +296,14 @@ static int nixio_bin_hexlify(lua_State *L) {
 	lenout = len * 2;
 	luaL_argcheck(L, lenout > len, 1, "size overflow");
 
-	char *out = malloc(lenout);
+	uint8_t *out = malloc(lenout);
 	if (!out) {
 		return luaL_error(L, NIXIO_OOM);
 	}
 
-	for (size_t i=0; i < len; i++) {
-		out[2*i]   = nixio__bin2hex[(data[i] & 0xf0) >> 4];
-		out[2*i+1] = nixio__bin2hex[(data[i] & 0x0f)];
-	}
+	nixio__hex_encode(out, data, len);
 
-	lua_pushlstring(L, out, lenout);
+	lua_pushlstring(L, (char*)out, lenout);
 	free(out);
 
 	return 1;
@@ -147,47 +323,25 @@ static int nixio_bin_unhexlify(lua_State *L) {
 	}
 
 	lenout = len / 2;
-	char *out = malloc(lenout);
+	uint8_t *out = malloc(lenout);
 	if (!out) {
 		return luaL_error(L, NIXIO_OOM);
 	}
 
-	for (size_t i=0; i < lenout; i++) {
-		char c = data[2*i];
-		if (c >= '0' && c <= '9') {
-			out[i] = (c - '0') << 4;
-		} else if (c >= 'a' && c <= 'f') {
-			out[i] = (c - 'a' + 10) << 4;
-		} else if (data[2*i] >= 'A' && c <= 'F') {
-			out[i] = (c - 'A' + 10) << 4;
-		} else {
-			free(out);
-			errno = EINVAL;
-			return nixio__perror(L);
-		}
-
-		c = data[2*i+1];
-		if (c >= '0' && c <= '9') {
-			out[i] += c - '0';
-		} else if (c >= 'a' && c <= 'f') {
-			out[i] += c - 'a' + 10;
-		} else if (c >= 'A' && c <= 'F') {
-			out[i] += c - 'A' + 10;
-		} else {
-			free(out);
-			errno = EINVAL;
-			return nixio__perror(L);
-		}
+	if (nixio__hex_decode(out, (const uint8_t*)data, len)) {
+		free(out);
+		errno = EINVAL;
+		return nixio__perror(L);
 	}
 
-	lua_pushlstring(L, out, lenout);
+	lua_pushlstring(L, (char*)out, lenout);
 	free(out);
 
 	return 1;
 }
 
 static int nixio_bin_b64encode(lua_State *L) {
-	size_t len, lenout, pad, i;
+	size_t len, lenout, pad;
 	const uint8_t *data = (const uint8_t*)luaL_checklstring(L, 1, &len);
 
 	lenout = len / 3;
@@ -204,40 +358,24 @@ static int nixio_bin_b64encode(lua_State *L) {
 
 	luaL_argcheck(L, lenout > len, 1, "size overflow");
 
-	char *out = malloc(lenout);
+	uint8_t *out = malloc(lenout);
 	if (!out) {
 		return luaL_error(L, NIXIO_OOM);
 	}
 
-	uint8_t *o = (uint8_t*)out;
-	for (i = 0; i < len; i += 3) {
-		uint32_t cv = (data[i] << 16) | (data[i+1] << 8) | data[i+2];
-		*(o+3) = nixio__b64encode_tbl[ cv        & 0x3f];
-		*(o+2) = nixio__b64encode_tbl[(cv >> 6)  & 0x3f];
-		*(o+1) = nixio__b64encode_tbl[(cv >> 12) & 0x3f];
-		*o     = nixio__b64encode_tbl[(cv >> 18) & 0x3f];
-		o += 4;
-	}
+	nixio__b64_encode(out, data, len - pad);
 
 	if (pad) {
-		uint32_t cv = data[len-pad] << 16;
-		*(o-1) = '=';
-		*(o-2) = '=';
-		if (pad == 2) {
-			cv |= data[len-pad+1] << 8;
-			*(o-2) = nixio__b64encode_tbl[(cv >> 6) & 0x3f];
-		}
-		*(o-3) = nixio__b64encode_tbl[(cv >> 12) & 0x3f];
-		*(o-4) = nixio__b64encode_tbl[(cv >> 18) & 0x3f];
+		nixio__b64_encode_tail(out + lenout - 4, data + len - pad, pad);
 	}
 
-	lua_pushlstring(L, out, lenout);
+	lua_pushlstring(L, (char*)out, lenout);
 	free(out);
 	return 1;
 }
 
 static int nixio_bin_b64decode(lua_State *L) {
-	size_t len, lenout, i;
+	size_t len, lenout;
 	const char *dt = luaL_checklstring(L, 1, &len);
 
 	if (len == 0) {
@@ -255,27 +393,10 @@ static int nixio_bin_b64decode(lua_State *L) {
 		return luaL_error(L, NIXIO_OOM);
 	}
 
-	unsigned char *o = out;
-	for (i = 0; i < len; i += 4) {
-		uint32_t cv = 0;
-		for (int j = 0; j < 4; j++) {
-			unsigned char c = dt[i + j] - 43;
-			if (c > 79 || (c = nixio__b64decode_tbl[c]) == 0xff) {
-				free(out);
-				errno = EINVAL;
-				return nixio__perror(L);
-			}
-
-			cv |= c;
-			if (j != 3) {
-				cv <<= 6;
-			}
-		}
-
-		*(o+2) = (unsigned char)(cv & 0xff);
-		*(o+1) = (unsigned char)((cv >>  8) & 0xff);
-		*o     = (unsigned char)((cv >> 16) & 0xff);
-		o += 3;
+	if (nixio__b64_decode(out, (const uint8_t*)dt, len)) {
+		free(out);
+		errno = EINVAL;
+		return nixio__perror(L);
 	}
 
 	if (dt[len-1] == '=') {
@@ -291,6 +412,207 @@ static int nixio_bin_b64decode(lua_State *L) {
 	return 1;
 }
 
+
+/* incremental codec objects */
+enum {
+	NIXIO_CODEC_HEXLIFY,
+	NIXIO_CODEC_UNHEXLIFY,
+	NIXIO_CODEC_B64ENCODE,
+	NIXIO_CODEC_B64DECODE
+};
+
+/* input group size and output size per group */
+static const int nixio__codec_group[][2] = {
+	[NIXIO_CODEC_HEXLIFY]   = { 1, 2 },
+	[NIXIO_CODEC_UNHEXLIFY] = { 2, 1 },
+	[NIXIO_CODEC_B64ENCODE] = { 3, 4 },
+	[NIXIO_CODEC_B64DECODE] = { 4, 3 }
+};
+
+typedef struct nixio_codec {
+	int type;
+	int finished;
+	size_t ncarry;
+	uint8_t carry[4];
+} nixio_codec;
+
+/* process complete groups, returns output length or -1 on invalid input */
+static ssize_t nixio__codec_run(nixio_codec *c, uint8_t *o,
+                                const uint8_t *data, size_t len) {
+	size_t outlen = len / nixio__codec_group[c->type][0] *
+	                nixio__codec_group[c->type][1];
+
+	switch (c->type) {
+	case NIXIO_CODEC_HEXLIFY:
+		nixio__hex_encode(o, data, len);
+		return outlen;
+
+	case NIXIO_CODEC_UNHEXLIFY:
+		return nixio__hex_decode(o, data, len) ? -1 : (ssize_t)outlen;
+
+	case NIXIO_CODEC_B64ENCODE:
+		nixio__b64_encode(o, data, len);
+		return outlen;
+
+	default:
+		if (len == 0) {
+			return 0;
+		}
+
+		/* padding is only valid in the last group of the stream */
+		if (c->finished || nixio__b64_decode(o, data, len)) {
+			return -1;
+		}
+
+		for (size_t i = 0; i + 4 < len; i += 4) {
+			if (data[i+2] == '=' || data[i+3] == '=') {
+				return -1;
+			}
+		}
+
+		if (data[len-1] == '=') {
+			c->finished = 1;
+			outlen--;
+		}
+
+		if (data[len-2] == '=') {
+			c->finished = 1;
+			outlen--;
+		}
+
+		return outlen;
+	}
+}
+
+static nixio_codec* nixio__checkcodec(lua_State *L) {
+	return (nixio_codec*)luaL_checkudata(L, 1, NIXIO_BIN_CODEC_META);
+}
+
+static int nixio_bin_codec(lua_State *L) {
+	static const char *const types[] = {
+		"hexlify", "unhexlify", "b64encode", "b64decode", NULL
+	};
+
+	int type = luaL_checkoption(L, 1, NULL, types);
+	nixio_codec *c = lua_newuserdata(L, sizeof(nixio_codec));
+
+	memset(c, 0, sizeof(*c));
+	c->type = type;
+
+	luaL_getmetatable(L, NIXIO_BIN_CODEC_META);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+static int nixio_bin_codec_update(lua_State *L) {
+	nixio_codec *c = nixio__checkcodec(L);
+	size_t len, n, lenout, group = nixio__codec_group[c->type][0];
+	const uint8_t *data = (const uint8_t*)luaL_checklstring(L, 2, &len);
+	ssize_t rv;
+
+	lenout = (c->ncarry + len) / group * nixio__codec_group[c->type][1];
+
+	uint8_t *out = malloc(lenout + 1);
+	uint8_t *o = out;
+	if (!out) {
+		return luaL_error(L, NIXIO_OOM);
+	}
+
+	/* complete the group left over from the previous chunk */
+	if (c->ncarry) {
+		n = group - c->ncarry;
+
+		if (n > len) {
+			n = len;
+		}
+
+		memcpy(c->carry + c->ncarry, data, n);
+		c->ncarry += n;
+		data += n;
+		len -= n;
+
+		if (c->ncarry == group) {
+			if ((rv = nixio__codec_run(c, o, c->carry, group)) < 0) {
+				goto inval;
+			}
+
+			o += rv;
+			c->ncarry = 0;
+		}
+	}
+
+	n = len - len % group;
+
+	if ((rv = nixio__codec_run(c, o, data, n)) < 0) {
+		goto inval;
+	}
+
+	o += rv;
+
+	memcpy(c->carry + c->ncarry, data + n, len - n);
+	c->ncarry += len - n;
+
+	lua_pushlstring(L, (char*)out, o - out);
+	free(out);
+	return 1;
+
+inval:
+	free(out);
+	errno = EINVAL;
+	return nixio__perror(L);
+}
+
+static int nixio_bin_codec_final(lua_State *L) {
+	nixio_codec *c = nixio__checkcodec(L);
+	uint8_t out[4];
+	size_t lenout = 0;
+
+	if (c->ncarry) {
+		if (c->type != NIXIO_CODEC_B64ENCODE) {
+			c->ncarry = 0;
+			c->finished = 0;
+			errno = EINVAL;
+			return nixio__perror(L);
+		}
+
+		nixio__b64_encode_tail(out, c->carry, c->ncarry);
+		lenout = 4;
+	}
+
+	c->ncarry = 0;
+	c->finished = 0;
+
+	lua_pushlstring(L, (char*)out, lenout);
+	return 1;
+}
+
+static int nixio_bin_codec_reset(lua_State *L) {
+	nixio_codec *c = nixio__checkcodec(L);
+	c->ncarry = 0;
+	c->finished = 0;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int nixio_bin_codec__tostring(lua_State *L) {
+	static const char *const names[] = {
+		"hexlify", "unhexlify", "b64encode", "b64decode"
+	};
+
+	lua_pushfstring(L, "nixio codec %s", names[nixio__checkcodec(L)->type]);
+	return 1;
+}
+
+/* codec methods */
+static const luaL_Reg M[] = {
+	{"update",		nixio_bin_codec_update},
+	{"final",		nixio_bin_codec_final},
+	{"reset",		nixio_bin_codec_reset},
+	{"__tostring",	nixio_bin_codec__tostring},
+	{NULL,			NULL}
+};
+
 /* module table */
 static const luaL_Reg R[] = {
 	{"hexlify",		nixio_bin_hexlify},
@@ -298,11 +620,22 @@ static const luaL_Reg R[] = {
 	{"crc32",		nixio_bin_crc32},
 	{"b64encode",	nixio_bin_b64encode},
 	{"b64decode",	nixio_bin_b64decode},
+	{"codec",		nixio_bin_codec},
 	{NULL,			NULL}
 };
 
 
 void nixio_open_bin(lua_State *L) {
+	nixio__crc32_init();
+	nixio__crc32_select();
+	nixio__codec_init();
+
+	luaL_newmetatable(L, NIXIO_BIN_CODEC_META);
+	luaL_register(L, NULL, M);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
 	lua_newtable(L);
 	luaL_register(L, NULL, R);
 	lua_setfield(L, -2, "bin");
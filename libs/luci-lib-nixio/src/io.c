@@ -16,6 +16,10 @@
  *  limitations under the License.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include "nixio.h"
 #include <errno.h>
 #include <string.h>
@@ -206,6 +210,221 @@ static int nixio_sock_recvfrom(lua_State *L) {
 	return nixio_sock__recvfrom(L, 1);
 }
 
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+
+#define NIXIO_MMSG_MAX 1024
+#define NIXIO_MMSG_BUFMAX (1024 * 1024)
+
+/**
+ * recvmmsg(count, maxlen)
+ */
+static int nixio_sock_recvmmsg(lua_State *L) {
+	nixio_sock *sock = nixio__checksock(L);
+	lua_Integer count = luaL_checkinteger(L, 2);
+	lua_Integer maxlen = luaL_optinteger(L, 3, NIXIO_BUFFERSIZE);
+	struct sockaddr_storage *addrs;
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	char *buffer;
+	int i, readc;
+
+	if (count < 1) {
+		return luaL_argerror(L, 2, "out of range");
+	}
+
+	if (maxlen < 1 || maxlen > 65536) {
+		return luaL_argerror(L, 3, "out of range");
+	}
+
+	/* bound both the message count and the total receive buffer size */
+	count = (count > NIXIO_MMSG_MAX) ? NIXIO_MMSG_MAX : count;
+	count = (count * maxlen > NIXIO_MMSG_BUFMAX) ? NIXIO_MMSG_BUFMAX / maxlen : count;
+
+	msgs = calloc(count, sizeof(*msgs) + sizeof(*iovs) + sizeof(*addrs) + maxlen);
+	if (!msgs) {
+		return luaL_error(L, NIXIO_OOM);
+	}
+
+	iovs = (struct iovec *)(msgs + count);
+	addrs = (struct sockaddr_storage *)(iovs + count);
+	buffer = (char *)(addrs + count);
+
+	for (i = 0; i < count; i++) {
+		iovs[i].iov_base = buffer + i * maxlen;
+		iovs[i].iov_len = maxlen;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_name = &addrs[i];
+		msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+	}
+
+	do {
+		readc = recvmmsg(sock->fd, msgs, count, MSG_WAITFORONE, NULL);
+	} while (readc == -1 && errno == EINTR);
+
+	if (readc < 0) {
+		free(msgs);
+		return nixio__perror_s(L);
+	}
+
+	lua_createtable(L, readc, 0);
+	lua_createtable(L, readc, 0);
+
+	for (i = 0; i < readc; i++) {
+		struct sockaddr *addr = (struct sockaddr *)&addrs[i];
+		socklen_t alen = msgs[i].msg_hdr.msg_namelen;
+		nixio_addr naddr;
+
+		lua_pushlstring(L, iovs[i].iov_base, msgs[i].msg_len);
+		lua_rawseti(L, -3, i + 1);
+
+		lua_createtable(L, 0, 2);
+
+		if ((addr->sa_family == AF_INET || addr->sa_family == AF_INET6) &&
+		    !nixio__addr_parse(&naddr, addr)) {
+			lua_pushstring(L, naddr.host);
+			lua_setfield(L, -2, "address");
+			lua_pushinteger(L, naddr.port);
+			lua_setfield(L, -2, "port");
+		} else if (addr->sa_family == AF_UNIX && alen > sizeof(sa_family_t)) {
+			struct sockaddr_un *addr_un = (struct sockaddr_un *)addr;
+
+			/* see nixio_sock__recvfrom() */
+			if (addr_un->sun_path[0])
+				--alen;
+
+			lua_pushlstring(L, addr_un->sun_path, alen - sizeof(sa_family_t));
+			lua_setfield(L, -2, "address");
+		}
+
+		lua_rawseti(L, -2, i + 1);
+	}
+
+	free(msgs);
+	return 2;
+}
+
+/**
+ * sendmmsg({data, {data = data, address = address, port = port}, ...})
+ */
+static int nixio_sock_sendmmsg(lua_State *L) {
+	nixio_sock *sock = nixio__checksock(L);
+	struct sockaddr_storage *addrs;
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	unsigned int count;
+	int i, sent;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	count = lua_objlen(L, 2);
+
+	if (count == 0) {
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+
+	count = (count > NIXIO_MMSG_MAX) ? NIXIO_MMSG_MAX : count;
+
+	msgs = calloc(count, sizeof(*msgs) + sizeof(*iovs) + sizeof(*addrs));
+	if (!msgs) {
+		return luaL_error(L, NIXIO_OOM);
+	}
+
+	iovs = (struct iovec *)(msgs + count);
+	addrs = (struct sockaddr_storage *)(iovs + count);
+
+	/* only accept real strings, these stay referenced by the list table
+	 * during the call while converted numbers would not */
+	for (i = 0; i < count; i++) {
+		size_t len;
+		const char *data;
+
+		lua_rawgeti(L, 2, i + 1);
+
+		if (lua_istable(L, -1)) {
+			lua_getfield(L, -1, "data");
+			data = (lua_type(L, -1) == LUA_TSTRING)
+				? lua_tolstring(L, -1, &len) : NULL;
+			lua_pop(L, 1);
+
+			lua_getfield(L, -1, "address");
+			if (!lua_isnil(L, -1)) {
+				struct sockaddr *addr = (struct sockaddr *)&addrs[i];
+				size_t alen;
+				const char *address = lua_tolstring(L, -1, &alen);
+
+				if (!address) {
+					free(msgs);
+					return luaL_argerror(L, 2, "invalid address in datastructure");
+				}
+
+				if (sock->domain == AF_INET || sock->domain == AF_INET6) {
+					nixio_addr naddr;
+					memset(&naddr, 0, sizeof(naddr));
+					strncpy(naddr.host, address, sizeof(naddr.host) - 1);
+					naddr.family = sock->domain;
+
+					lua_getfield(L, -2, "port");
+					naddr.port = (uint16_t)lua_tointeger(L, -1);
+					lua_pop(L, 1);
+
+					if (nixio__addr_write(&naddr, addr)) {
+						free(msgs);
+						return nixio__perror_s(L);
+					}
+
+					msgs[i].msg_hdr.msg_namelen = (sock->domain == AF_INET)
+						? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+				} else if (sock->domain == AF_UNIX) {
+					struct sockaddr_un *addr_un = (struct sockaddr_un *)addr;
+
+					if (alen > sizeof(addr_un->sun_path)) {
+						free(msgs);
+						return luaL_argerror(L, 2, "address out of range");
+					}
+
+					addr_un->sun_family = AF_UNIX;
+					memcpy(addr_un->sun_path, address, alen);
+					msgs[i].msg_hdr.msg_namelen = sizeof(sa_family_t) + alen;
+				}
+
+				msgs[i].msg_hdr.msg_name = addr;
+			}
+			lua_pop(L, 1);
+		} else {
+			data = (lua_type(L, -1) == LUA_TSTRING)
+				? lua_tolstring(L, -1, &len) : NULL;
+		}
+
+		lua_pop(L, 1);
+
+		if (!data) {
+			free(msgs);
+			return luaL_argerror(L, 2, "invalid datastructure");
+		}
+
+		iovs[i].iov_base = (void *)data;
+		iovs[i].iov_len = len;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	do {
+		sent = sendmmsg(sock->fd, msgs, count, 0);
+	} while (sent == -1 && errno == EINTR);
+
+	free(msgs);
+
+	if (sent < 0) {
+		return nixio__perror_s(L);
+	}
+
+	lua_pushinteger(L, sent);
+	return 1;
+}
+
+#endif /* __linux__ && MSG_WAITFORONE */
+
 
 /* module table */
 static const luaL_Reg M[] = {
@@ -213,6 +432,10 @@ static const luaL_Reg M[] = {
 	{"sendto",	nixio_sock_sendto},
 	{"recv",	nixio_sock_recv},
 	{"recvfrom",nixio_sock_recvfrom},
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+	{"recvmmsg",nixio_sock_recvmmsg},
+	{"sendmmsg",nixio_sock_sendmmsg},
+#endif
 	{"write",	nixio_sock_send},
 	{"read",	nixio_sock_recv},
 	{NULL,			NULL}
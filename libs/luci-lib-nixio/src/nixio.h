@@ -7,6 +7,8 @@
 #define NIXIO_FILE_META "nixio.file"
 #define NIXIO_GLOB_META "nixio.glob"
 #define NIXIO_DIR_META "nixio.dir"
+#define NIXIO_EPOLL_META "nixio.epoll"
+#define NIXIO_BIN_CODEC_META "nixio.bin.codec"
 #define _FILE_OFFSET_BITS 64
 
 #define NIXIO_PUSH_CONSTANT(x) \
@@ -21,8 +21,13 @@
 #include <errno.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <sys/time.h>
 
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
 
 static int nixio_gettimeofday(lua_State *L) {
 	struct timeval tv;
@@ -196,15 +201,278 @@ static int nixio_poll(lua_State *L) {
 	return 2;
 }
 
+#ifdef __linux__
+
+#define NIXIO_EPOLL_MAXEVENTS 4096
+
+typedef struct nixio_epoll {
+	int fd;
+	int count;
+	int maxevents;
+	struct epoll_event *events;
+} nixio_epoll;
+
+static nixio_epoll* nixio__checkepoll(lua_State *L) {
+	nixio_epoll *ep = (nixio_epoll*)luaL_checkudata(L, 1, NIXIO_EPOLL_META);
+	luaL_argcheck(L, ep->fd != -1, 1, "invalid epoll object");
+	return ep;
+}
+
+/**
+ * epoll_create()
+ */
+static int nixio_epoll_create(lua_State *L) {
+	nixio_epoll *ep = lua_newuserdata(L, sizeof(nixio_epoll));
+	ep->count = 0;
+	ep->maxevents = 0;
+	ep->events = NULL;
+	ep->fd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (ep->fd == -1) {
+		return nixio__perror(L);
+	}
+
+	luaL_getmetatable(L, NIXIO_EPOLL_META);
+	lua_setmetatable(L, -2);
+
+	/* registered entries indexed by descriptor number */
+	lua_newtable(L);
+	lua_setfenv(L, -2);
+
+	return 1;
+}
+
+/**
+ * epoll:add(fd, events, entry)
+ */
+static int nixio_epoll_add(lua_State *L) {
+	nixio_epoll *ep = nixio__checkepoll(L);
+	int fd = nixio__checkfd(L, 2);
+	struct epoll_event ev = {
+		.events = (uint32_t)luaL_checkinteger(L, 3),
+		.data.fd = fd
+	};
+
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+		lua_pushvalue(L, 4);
+	} else {
+		lua_createtable(L, 0, 3);
+	}
+
+	if (epoll_ctl(ep->fd, EPOLL_CTL_ADD, fd, &ev)) {
+		return nixio__perror(L);
+	}
+
+	ep->count++;
+
+	lua_pushvalue(L, 2);
+	lua_setfield(L, -2, "fd");
+	lua_pushinteger(L, ev.events);
+	lua_setfield(L, -2, "events");
+
+	lua_getfenv(L, 1);
+	lua_pushvalue(L, -2);
+	lua_rawseti(L, -2, fd);
+	lua_pop(L, 1);
+
+	return 1;
+}
+
+/**
+ * epoll:mod(fd, events)
+ */
+static int nixio_epoll_mod(lua_State *L) {
+	nixio_epoll *ep = nixio__checkepoll(L);
+	int fd = nixio__checkfd(L, 2);
+	struct epoll_event ev = {
+		.events = (uint32_t)luaL_checkinteger(L, 3),
+		.data.fd = fd
+	};
+
+	if (epoll_ctl(ep->fd, EPOLL_CTL_MOD, fd, &ev)) {
+		return nixio__perror(L);
+	}
+
+	lua_getfenv(L, 1);
+	lua_rawgeti(L, -1, fd);
+	if (lua_istable(L, -1)) {
+		lua_pushinteger(L, ev.events);
+		lua_setfield(L, -2, "events");
+	}
+	lua_pop(L, 2);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/**
+ * epoll:del(fd)
+ */
+static int nixio_epoll_del(lua_State *L) {
+	nixio_epoll *ep = nixio__checkepoll(L);
+	int fd = nixio__checkfd(L, 2);
+	struct epoll_event ev = { 0 };
+
+	/* a closed descriptor already left the set, drop its entry anyway */
+	if (epoll_ctl(ep->fd, EPOLL_CTL_DEL, fd, &ev) &&
+	    errno != EBADF && errno != ENOENT) {
+		return nixio__perror(L);
+	}
+
+	lua_getfenv(L, 1);
+	lua_rawgeti(L, -1, fd);
+	if (!lua_isnil(L, -1)) {
+		ep->count--;
+	}
+	lua_pop(L, 1);
+	lua_pushnil(L);
+	lua_rawseti(L, -2, fd);
+	lua_pop(L, 1);
+
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+/**
+ * epoll:wait(timeout, maxevents)
+ */
+static int nixio_epoll_wait(lua_State *L) {
+	nixio_epoll *ep = nixio__checkepoll(L);
+	int timeout = luaL_optint(L, 2, 0);
+	int maxevents = luaL_optint(L, 3, ep->count);
+	int i, status;
+
+	if (maxevents < 1) {
+		maxevents = 1;
+	} else if (maxevents > NIXIO_EPOLL_MAXEVENTS) {
+		maxevents = NIXIO_EPOLL_MAXEVENTS;
+	}
+
+	if (maxevents > ep->maxevents) {
+		struct epoll_event *events =
+			realloc(ep->events, maxevents * sizeof(struct epoll_event));
+
+		if (!events) {
+			return luaL_error(L, NIXIO_OOM);
+		}
+
+		ep->events = events;
+		ep->maxevents = maxevents;
+	}
+
+	status = epoll_wait(ep->fd, ep->events, maxevents, timeout);
+
+	if (status == 0) {
+		lua_pushboolean(L, 0);
+		return 1;
+	} else if (status < 0) {
+		return nixio__perror(L);
+	}
+
+	lua_pushinteger(L, status);
+	lua_createtable(L, status, 0);
+	lua_getfenv(L, 1);
+
+	for (i = 0; i < status; i++) {
+		lua_rawgeti(L, -1, ep->events[i].data.fd);
+
+		if (lua_istable(L, -1)) {
+			lua_pushinteger(L, ep->events[i].events);
+			lua_setfield(L, -2, "revents");
+		}
+
+		lua_rawseti(L, -3, i + 1);
+	}
+
+	lua_pop(L, 1);
+
+	return 2;
+}
+
+static int nixio_epoll_fileno(lua_State *L) {
+	lua_pushinteger(L, nixio__checkepoll(L)->fd);
+	return 1;
+}
+
+static int nixio_epoll_close(lua_State *L) {
+	nixio_epoll *ep = nixio__checkepoll(L);
+	int epfd = ep->fd;
+	int res;
+	ep->fd = -1;
+
+	free(ep->events);
+	ep->events = NULL;
+	ep->maxevents = 0;
+	ep->count = 0;
+
+	lua_newtable(L);
+	lua_setfenv(L, 1);
+
+	do {
+		res = close(epfd);
+	} while (res == -1 && errno == EINTR);
+
+	return nixio__pstatus(L, !res);
+}
+
+static int nixio_epoll__gc(lua_State *L) {
+	nixio_epoll *ep = (nixio_epoll*)luaL_checkudata(L, 1, NIXIO_EPOLL_META);
+	int res;
+
+	free(ep->events);
+	ep->events = NULL;
+
+	if (ep->fd != -1) {
+		do {
+			res = close(ep->fd);
+		} while (res == -1 && errno == EINTR);
+		ep->fd = -1;
+	}
+
+	return 0;
+}
+
+static int nixio_epoll__tostring(lua_State *L) {
+	lua_pushfstring(L, "nixio epoll %d", nixio__checkepoll(L)->fd);
+	return 1;
+}
+
+/* epoll methods */
+static const luaL_Reg M[] = {
+	{"add",			nixio_epoll_add},
+	{"mod",			nixio_epoll_mod},
+	{"del",			nixio_epoll_del},
+	{"wait",		nixio_epoll_wait},
+	{"fileno",		nixio_epoll_fileno},
+	{"close",		nixio_epoll_close},
+	{"__gc",		nixio_epoll__gc},
+	{"__tostring",	nixio_epoll__tostring},
+	{NULL,			NULL}
+};
+
+#endif /* __linux__ */
+
 /* module table */
 static const luaL_Reg R[] = {
 	{"gettimeofday", nixio_gettimeofday},
 	{"nanosleep",	nixio_nanosleep},
 	{"poll",		nixio_poll},
 	{"poll_flags",	nixio_poll_flags},
+#ifdef __linux__
+	{"epoll",		nixio_epoll_create},
+#endif
 	{NULL,			NULL}
 };
 
 void nixio_open_poll(lua_State *L) {
 	luaL_register(L, NULL, R);
+
+#ifdef __linux__
+	luaL_newmetatable(L, NIXIO_EPOLL_META);
+	luaL_register(L, NULL, M);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_setfield(L, -2, "meta_epoll");
+#endif
 }
@@ -26,6 +26,7 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/param.h>
+#include <stdlib.h>
 
 
 #ifndef __WINNT__
@@ -118,6 +119,338 @@ static int nixio_splice_flags(lua_State *L) {
 	return 1;
 }
 
+#ifdef __linux__
+
+#define NIXIO_TRANSFER_CHUNK (1024 * 1024)
+
+enum {
+	NIXIO_TRANSFER_SENDFILE,
+	NIXIO_TRANSFER_SPLICE,
+	NIXIO_TRANSFER_COPY,
+	NIXIO_TRANSFER_AUTO
+};
+
+typedef struct nixio_transfer {
+	int src;
+	int dst;
+	int method;
+	int timeout;
+	int use_offset;
+	off_t offset;
+	int pipe[2];
+	size_t pipesize;
+	size_t inpipe;
+	char *buf;
+	size_t buflen;
+	size_t bufoff;
+} nixio_transfer;
+
+/* wait until a non-blocking descriptor becomes ready again */
+static int nixio__transfer_wait(nixio_transfer *x, int fd1, short ev1,
+                                int fd2, short ev2) {
+	struct pollfd pfd[2] = {
+		{ .fd = fd1, .events = ev1 },
+		{ .fd = fd2, .events = ev2 }
+	};
+	int rv;
+
+	do {
+		rv = poll(pfd, (fd2 == -1) ? 1 : 2, x->timeout);
+	} while (rv == -1 && errno == EINTR);
+
+	if (rv == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+
+	return (rv < 0) ? -1 : 0;
+}
+
+static ssize_t nixio__transfer_sendfile(nixio_transfer *x, size_t len) {
+	ssize_t n;
+
+	while (1) {
+		n = sendfile(x->dst, x->src, x->use_offset ? &x->offset : NULL, len);
+
+		if (n >= 0) {
+			return n;
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno != EAGAIN ||
+		           nixio__transfer_wait(x, x->dst, POLLOUT, -1, 0)) {
+			return -1;
+		}
+	}
+}
+
+static ssize_t nixio__transfer_splice(nixio_transfer *x, size_t len) {
+	loff_t off = x->offset;
+	ssize_t n;
+
+	/* one side is a pipe already, move the data directly */
+	if (x->pipe[0] == -1) {
+		while (1) {
+			n = splice(x->src, x->use_offset ? &off : NULL, x->dst, NULL,
+			           len, SPLICE_F_MOVE | SPLICE_F_MORE);
+
+			if (n >= 0) {
+				x->offset = off;
+				return n;
+			} else if (errno == EINTR) {
+				continue;
+			} else if (errno != EAGAIN ||
+			           nixio__transfer_wait(x, x->src, POLLIN, x->dst, POLLOUT)) {
+				return -1;
+			}
+		}
+	}
+
+	/* refill the internal pipe once it has been drained */
+	while (!x->inpipe) {
+		n = splice(x->src, x->use_offset ? &off : NULL, x->pipe[1], NULL,
+		           MIN(len, x->pipesize), SPLICE_F_MOVE | SPLICE_F_MORE);
+
+		if (n > 0) {
+			x->offset = off;
+			x->inpipe = n;
+		} else if (n == 0) {
+			return 0;
+		} else if (errno != EINTR && (errno != EAGAIN ||
+		           nixio__transfer_wait(x, x->src, POLLIN, -1, 0))) {
+			return -1;
+		}
+	}
+
+	while (1) {
+		n = splice(x->pipe[0], NULL, x->dst, NULL, x->inpipe,
+		           SPLICE_F_MOVE | SPLICE_F_MORE);
+
+		if (n >= 0) {
+			x->inpipe -= n;
+			return n;
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno != EAGAIN ||
+		           nixio__transfer_wait(x, x->dst, POLLOUT, -1, 0)) {
+			return -1;
+		}
+	}
+}
+
+static ssize_t nixio__transfer_copy(nixio_transfer *x, size_t len) {
+	ssize_t n;
+
+	while (x->bufoff == x->buflen) {
+		len = MIN(len, NIXIO_TRANSFER_CHUNK / 16);
+
+		if (x->use_offset) {
+			n = pread(x->src, x->buf, len, x->offset);
+		} else {
+			n = read(x->src, x->buf, len);
+		}
+
+		if (n > 0) {
+			x->offset += n;
+			x->buflen = n;
+			x->bufoff = 0;
+		} else if (n == 0) {
+			return 0;
+		} else if (errno != EINTR && (errno != EAGAIN ||
+		           nixio__transfer_wait(x, x->src, POLLIN, -1, 0))) {
+			return -1;
+		}
+	}
+
+	while (1) {
+		n = write(x->dst, x->buf + x->bufoff, x->buflen - x->bufoff);
+
+		if (n >= 0) {
+			x->bufoff += n;
+			return n;
+		} else if (errno == EINTR) {
+			continue;
+		} else if (errno != EAGAIN ||
+		           nixio__transfer_wait(x, x->dst, POLLOUT, -1, 0)) {
+			return -1;
+		}
+	}
+}
+
+/* prepare the given method, returns -1 if it can not be used */
+static int nixio__transfer_setup(nixio_transfer *x, int method) {
+	struct stat sin, sout;
+
+	if (fstat(x->src, &sin) || fstat(x->dst, &sout)) {
+		return -1;
+	}
+
+	if (method == NIXIO_TRANSFER_SENDFILE && !S_ISREG(sin.st_mode)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (method == NIXIO_TRANSFER_SPLICE &&
+	    !S_ISFIFO(sin.st_mode) && !S_ISFIFO(sout.st_mode)) {
+		if (pipe2(x->pipe, O_CLOEXEC)) {
+			return -1;
+		}
+
+		fcntl(x->pipe[1], F_SETPIPE_SZ, NIXIO_TRANSFER_CHUNK);
+		x->pipesize = fcntl(x->pipe[1], F_GETPIPE_SZ);
+
+		if ((ssize_t)x->pipesize <= 0) {
+			x->pipesize = 65536;
+		}
+	}
+
+	if (method == NIXIO_TRANSFER_COPY &&
+	    !(x->buf = malloc(NIXIO_TRANSFER_CHUNK / 16))) {
+		return -1;
+	}
+
+	x->method = method;
+	return 0;
+}
+
+static void nixio__transfer_cleanup(nixio_transfer *x) {
+	if (x->pipe[0] != -1) {
+		close(x->pipe[0]);
+		close(x->pipe[1]);
+		x->pipe[0] = x->pipe[1] = -1;
+	}
+
+	free(x->buf);
+	x->buf = NULL;
+	x->buflen = x->bufoff = x->inpipe = 0;
+}
+
+/**
+ * transfer(src, dst, length, {offset = n, method = m, timeout = ms,
+ *                             progress = function(transferred) ... end})
+ */
+static int nixio_transfer_fds(lua_State *L) {
+	static const char *const methods[] = {
+		"sendfile", "splice", "copy", "auto", NULL
+	};
+
+	nixio_transfer x = {
+		.src = nixio__checkfd(L, 1),
+		.dst = nixio__checkfd(L, 2),
+		.timeout = -1,
+		.pipe = { -1, -1 }
+	};
+
+	uint64_t length = (uint64_t)nixio__optnumber(L, 3, 0);
+	uint64_t total = 0;
+	int method = NIXIO_TRANSFER_AUTO;
+	int progress = 0;
+	ssize_t n;
+
+	if (!lua_isnoneornil(L, 4)) {
+		luaL_checktype(L, 4, LUA_TTABLE);
+
+		lua_getfield(L, 4, "offset");
+		if (!lua_isnil(L, -1)) {
+			x.offset = (off_t)nixio__checknumber(L, -1);
+			x.use_offset = 1;
+		}
+
+		lua_getfield(L, 4, "timeout");
+		x.timeout = luaL_optint(L, -1, -1);
+
+		lua_getfield(L, 4, "method");
+		method = luaL_checkoption(L, -1, "auto", methods);
+
+		lua_getfield(L, 4, "progress");
+		if (lua_isfunction(L, -1)) {
+			progress = lua_gettop(L);
+		}
+	}
+
+	if (method == NIXIO_TRANSFER_AUTO) {
+		if (nixio__transfer_setup(&x, NIXIO_TRANSFER_SENDFILE) &&
+		    nixio__transfer_setup(&x, NIXIO_TRANSFER_SPLICE) &&
+		    nixio__transfer_setup(&x, NIXIO_TRANSFER_COPY)) {
+			goto err;
+		}
+	} else if (nixio__transfer_setup(&x, method)) {
+		goto err;
+	}
+
+	while (!length || total < length) {
+		size_t len = (length && length - total < NIXIO_TRANSFER_CHUNK)
+			? (size_t)(length - total) : NIXIO_TRANSFER_CHUNK;
+
+		switch (x.method) {
+		case NIXIO_TRANSFER_SENDFILE:
+			n = nixio__transfer_sendfile(&x, len);
+			break;
+
+		case NIXIO_TRANSFER_SPLICE:
+			n = nixio__transfer_splice(&x, len);
+			break;
+
+		default:
+			n = nixio__transfer_copy(&x, len);
+			break;
+		}
+
+		if (n < 0) {
+			/* the kernel refused the zero-copy path, fall back */
+			if (method == NIXIO_TRANSFER_AUTO && total == 0 && !x.inpipe &&
+			    x.method != NIXIO_TRANSFER_COPY &&
+			    (errno == EINVAL || errno == ENOSYS)) {
+				nixio__transfer_cleanup(&x);
+
+				if (nixio__transfer_setup(&x, x.method + 1) &&
+				    nixio__transfer_setup(&x, NIXIO_TRANSFER_COPY)) {
+					goto err;
+				}
+
+				continue;
+			}
+
+			goto err;
+		} else if (n == 0) {
+			break;
+		}
+
+		total += n;
+
+		if (progress) {
+			lua_pushvalue(L, progress);
+			nixio__pushnumber(L, total);
+
+			if (lua_pcall(L, 1, 1, 0)) {
+				nixio__transfer_cleanup(&x);
+				return lua_error(L);
+			}
+
+			if (lua_isboolean(L, -1) && !lua_toboolean(L, -1)) {
+				lua_pop(L, 1);
+				errno = ECANCELED;
+				goto err;
+			}
+
+			lua_pop(L, 1);
+		}
+	}
+
+	nixio__transfer_cleanup(&x);
+	nixio__pushnumber(L, total);
+	return 1;
+
+err:
+	n = errno;
+	nixio__transfer_cleanup(&x);
+	errno = n;
+	nixio__perror(L);
+	nixio__pushnumber(L, total);
+	return 4;
+}
+
+#endif /* __linux__ */
+
 #endif /* SPLICE_F_MOVE */
 #endif /* _GNU_SOURCE */
 
@@ -166,6 +499,9 @@ static const luaL_Reg R[] = {
 #ifdef SPLICE_F_MOVE
 	{"splice",			nixio_splice},
 	{"splice_flags",	nixio_splice_flags},
+#ifdef __linux__
+	{"transfer",		nixio_transfer_fds},
+#endif
 #endif
 #endif
 	{"sendfile",		nixio_sendfile},
@@ -237,7 +237,9 @@ ifndef Package/$(PKG_NAME)/postinst
 define Package/$(PKG_NAME)/postinst
 [ -n "$${IPKG_INSTROOT}" ] || { \
 	rm -f /tmp/luci-indexcache.*
+	rm -f /tmp/luci-menucache.*
 	rm -rf /tmp/luci-modulecache/
+	rm -rf /tmp/luci-tplcache/
 	/etc/init.d/rpcd reload 2>/dev/null
 	exit 0
 }
@@ -260,10 +262,7 @@ endif
 
 ifeq ($(LUCI_MINIFY_JS),1)
   define JsMin
-	$(FIND) $(1) -type f -name '*.js' | while read src; do \
-		if jsmin < "$$$$src" > "$$$$src.o"; \
-		then mv "$$$$src.o" "$$$$src"; fi; \
-	done
+	$(FIND) $(1) -type f -name '*.js' | jsmin --batch || true
   endef
 else
   define JsMin
@@ -347,9 +346,8 @@ define LuciTranslation
 	echo "uci set luci.languages.$(subst -,_,$(1))='$(LUCI_LANG.$(2))'; uci commit luci" \
 		> $$(1)/etc/uci-defaults/luci-i18n-$(LUCI_BASENAME)-$(1)
 	$$(INSTALL_DIR) $$(1)$(LUCI_LIBRARYDIR)/i18n
-	$(foreach po,$(wildcard ${CURDIR}/po/$(2)/*.po), \
-		po2lmo $(po) \
-			$$(1)$(LUCI_LIBRARYDIR)/i18n/$(basename $(notdir $(po))).$(1).lmo;)
+	po2lmo --batch $(foreach po,$(wildcard ${CURDIR}/po/$(2)/*.po), \
+		$(po) $$(1)$(LUCI_LIBRARYDIR)/i18n/$(basename $(notdir $(po))).$(1).lmo)
   endef
 
   LUCI_BUILD_PACKAGES += luci-i18n-$(LUCI_BASENAME)-$(1)
@@ -24,21 +24,57 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE.
 */
 
+
+/* Batch mode, buffered I/O and the worker pool were added for the LuCI build,
+   the minification itself is unchanged and produces the same output as the
+   original stdin/stdout implementation.
+*/
+
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
-static int the_a;
-static int the_b;
-static int look_ahead = EOF;
-static int the_x = EOF;
-static int the_y = EOF;
+struct jsmin {
+    const unsigned char *in;
+    const unsigned char *end;
+    unsigned char *out;
+    size_t outlen;
+    size_t outsize;
+    const char *error;
+    jmp_buf fail;
+    int the_a;
+    int the_b;
+    int look_ahead;
+    int the_x;
+    int the_y;
+};
 
 
-static void error(char* string) {
-    fputs("JSMIN Error: ", stderr);
-    fputs(string, stderr);
-    fputc('\n', stderr);
-    exit(1);
+static void error(struct jsmin *j, const char *string) {
+    j->error = string;
+    longjmp(j->fail, 1);
+}
+
+static void emit(struct jsmin *j, int codeunit) {
+    if (j->outlen == j->outsize) {
+        size_t size = j->outsize ? j->outsize * 2 : 4096;
+        unsigned char *out = realloc(j->out, size);
+        if (out == NULL) {
+            error(j, "Out of memory.");
+        }
+        j->out = out;
+        j->outsize = size;
+    }
+    j->out[j->outlen++] = (unsigned char)codeunit;
 }
 
 /* is_alphanum -- return true if the character is a letter, digit, underscore,
@@ -58,16 +94,16 @@ static int is_alphanum(int codeunit) {
 }
 
 
-/* get -- return the next character from stdin. Watch out for lookahead. If
-        the character is a control character, translate it to a space or
+/* get -- return the next character from the input. Watch out for lookahead.
+        If the character is a control character, translate it to a space or
         linefeed.
 */
 
-static int get() {
-    int codeunit = look_ahead;
-    look_ahead = EOF;
-    if (codeunit == EOF) {
-        codeunit = getc(stdin);
+static int get(struct jsmin *j) {
+    int codeunit = j->look_ahead;
+    j->look_ahead = EOF;
+    if (codeunit == EOF && j->in < j->end) {
+        codeunit = *j->in++;
     }
     if (codeunit >= ' ' || codeunit == '\n' || codeunit == EOF) {
         return codeunit;
@@ -82,9 +118,9 @@ static int get() {
 /* peek -- get the next character without advancing.
 */
 
-static int peek() {
-    look_ahead = get();
-    return look_ahead;
+static int peek(struct jsmin *j) {
+    j->look_ahead = get(j);
+    return j->look_ahead;
 }
 
 
@@ -92,37 +128,37 @@ static int peek() {
         if a '/' is followed by a '/' or '*'.
 */
 
-static int next() {
-    int codeunit = get();
+static int next(struct jsmin *j) {
+    int codeunit = get(j);
     if  (codeunit == '/') {
-        switch (peek()) {
+        switch (peek(j)) {
         case '/':
             for (;;) {
-                codeunit = get();
+                codeunit = get(j);
                 if (codeunit <= '\n') {
                     break;
                 }
             }
             break;
         case '*':
-            get();
+            get(j);
             while (codeunit != ' ') {
-                switch (get()) {
+                switch (get(j)) {
                 case '*':
-                    if (peek() == '/') {
-                        get();
+                    if (peek(j) == '/') {
+                        get(j);
                         codeunit = ' ';
                     }
                     break;
                 case EOF:
-                    error("Unterminated comment.");
+                    error(j, "Unterminated comment.");
                 }
             }
             break;
         }
     }
-    the_y = the_x;
-    the_x = codeunit;
+    j->the_y = j->the_x;
+    j->the_x = codeunit;
     return codeunit;
 }
 
@@ -136,87 +172,87 @@ static int next() {
    '(' or ',' or '='.
 */
 
-static void action(int determined) {
+static void action(struct jsmin *j, int determined) {
     switch (determined) {
     case 1:
-        putc(the_a, stdout);
+        emit(j, j->the_a);
         if (
-            (the_y == '\n' || the_y == ' ')
-            && (the_a == '+' || the_a == '-' || the_a == '*' || the_a == '/')
-            && (the_b == '+' || the_b == '-' || the_b == '*' || the_b == '/')
+            (j->the_y == '\n' || j->the_y == ' ')
+            && (j->the_a == '+' || j->the_a == '-' || j->the_a == '*' || j->the_a == '/')
+            && (j->the_b == '+' || j->the_b == '-' || j->the_b == '*' || j->the_b == '/')
         ) {
-            putc(the_y, stdout);
+            emit(j, j->the_y);
         }
     case 2:
-        the_a = the_b;
-        if (the_a == '\'' || the_a == '"' || the_a == '`') {
+        j->the_a = j->the_b;
+        if (j->the_a == '\'' || j->the_a == '"' || j->the_a == '`') {
             for (;;) {
-                putc(the_a, stdout);
-                the_a = get();
-                if (the_a == the_b) {
+                emit(j, j->the_a);
+                j->the_a = get(j);
+                if (j->the_a == j->the_b) {
                     break;
                 }
-                if (the_a == '\\') {
-                    putc(the_a, stdout);
-                    the_a = get();
+                if (j->the_a == '\\') {
+                    emit(j, j->the_a);
+                    j->the_a = get(j);
                 }
-                if (the_a == EOF) {
-                    error("Unterminated string literal.");
+                if (j->the_a == EOF) {
+                    error(j, "Unterminated string literal.");
                 }
             }
         }
     case 3:
-        the_b = next();
-        if (the_b == '/' && (
-            the_a == '(' || the_a == ',' || the_a == '=' || the_a == ':'
-            || the_a == '[' || the_a == '!' || the_a == '&' || the_a == '|'
-            || the_a == '?' || the_a == '+' || the_a == '-' || the_a == '~'
-            || the_a == '*' || the_a == '/' || the_a == '{' || the_a == '}'
-            || the_a == ';'
+        j->the_b = next(j);
+        if (j->the_b == '/' && (
+            j->the_a == '(' || j->the_a == ',' || j->the_a == '=' || j->the_a == ':'
+            || j->the_a == '[' || j->the_a == '!' || j->the_a == '&' || j->the_a == '|'
+            || j->the_a == '?' || j->the_a == '+' || j->the_a == '-' || j->the_a == '~'
+            || j->the_a == '*' || j->the_a == '/' || j->the_a == '{' || j->the_a == '}'
+            || j->the_a == ';'
         )) {
-            putc(the_a, stdout);
-            if (the_a == '/' || the_a == '*') {
-                putc(' ', stdout);
+            emit(j, j->the_a);
+            if (j->the_a == '/' || j->the_a == '*') {
+                emit(j, ' ');
             }
-            putc(the_b, stdout);
+            emit(j, j->the_b);
             for (;;) {
-                the_a = get();
-                if (the_a == '[') {
+                j->the_a = get(j);
+                if (j->the_a == '[') {
                     for (;;) {
-                        putc(the_a, stdout);
-                        the_a = get();
-                        if (the_a == ']') {
+                        emit(j, j->the_a);
+                        j->the_a = get(j);
+                        if (j->the_a == ']') {
                             break;
                         }
-                        if (the_a == '\\') {
-                            putc(the_a, stdout);
-                            the_a = get();
+                        if (j->the_a == '\\') {
+                            emit(j, j->the_a);
+                            j->the_a = get(j);
                         }
-                        if (the_a == EOF) {
-                            error(
+                        if (j->the_a == EOF) {
+                            error(j,
                                 "Unterminated set in Regular Expression literal."
                             );
                         }
                     }
-                } else if (the_a == '/') {
-                    switch (peek()) {
+                } else if (j->the_a == '/') {
+                    switch (peek(j)) {
                     case '/':
                     case '*':
-                        error(
+                        error(j,
                             "Unterminated set in Regular Expression literal."
                         );
                     }
                     break;
-                } else if (the_a =='\\') {
-                    putc(the_a, stdout);
-                    the_a = get();
+                } else if (j->the_a =='\\') {
+                    emit(j, j->the_a);
+                    j->the_a = get(j);
                 }
-                if (the_a == EOF) {
-                    error("Unterminated Regular Expression literal.");
+                if (j->the_a == EOF) {
+                    error(j, "Unterminated Regular Expression literal.");
                 }
-                putc(the_a, stdout);
+                emit(j, j->the_a);
             }
-            the_b = next();
+            j->the_b = next(j);
         }
     }
 }
@@ -225,28 +261,38 @@ static void action(int determined) {
 /* jsmin -- Copy the input to the output, deleting the characters which are
         insignificant to JavaScript. Comments will be removed. Tabs will be
         replaced with spaces. Carriage returns will be replaced with linefeeds.
-        Most spaces and linefeeds will be removed.
+        Most spaces and linefeeds will be removed. Returns 0 on success, on
+        error j->error is set and the output produced so far is retained.
 */
 
-static void jsmin() {
-    if (peek() == 0xEF) {
-        get();
-        get();
-        get();
+static int jsmin(struct jsmin *j, const void *in, size_t len) {
+    j->in = in;
+    j->end = j->in + len;
+    j->error = NULL;
+    j->look_ahead = EOF;
+    j->the_x = EOF;
+    j->the_y = EOF;
+    if (setjmp(j->fail)) {
+        return -1;
+    }
+    if (peek(j) == 0xEF) {
+        get(j);
+        get(j);
+        get(j);
     }
-    the_a = '\n';
-    action(3);
-    while (the_a != EOF) {
-        switch (the_a) {
+    j->the_a = '\n';
+    action(j, 3);
+    while (j->the_a != EOF) {
+        switch (j->the_a) {
         case ' ':
-            action(
-                is_alphanum(the_b)
+            action(j,
+                is_alphanum(j->the_b)
                 ? 1
                 : 2
             );
             break;
         case '\n':
-            switch (the_b) {
+            switch (j->the_b) {
             case '{':
             case '[':
             case '(':
@@ -254,30 +300,30 @@ static void jsmin() {
             case '-':
             case '!':
             case '~':
-                action(1);
+                action(j, 1);
                 break;
             case ' ':
-                action(3);
+                action(j, 3);
                 break;
             default:
-                action(
-                    is_alphanum(the_b)
+                action(j,
+                    is_alphanum(j->the_b)
                     ? 1
                     : 2
                 );
             }
             break;
         default:
-            switch (the_b) {
+            switch (j->the_b) {
             case ' ':
-                action(
-                    is_alphanum(the_a)
+                action(j,
+                    is_alphanum(j->the_a)
                     ? 1
                     : 3
                 );
                 break;
             case '\n':
-                switch (the_a) {
+                switch (j->the_a) {
                 case '}':
                 case ']':
                 case ')':
@@ -286,22 +332,302 @@ static void jsmin() {
                 case '"':
                 case '\'':
                 case '`':
-                    action(1);
+                    action(j, 1);
                     break;
                 default:
-                    action(
-                        is_alphanum(the_a)
+                    action(j,
+                        is_alphanum(j->the_a)
                         ? 1
                         : 3
                     );
                 }
                 break;
             default:
-                action(1);
+                action(j, 1);
                 break;
             }
         }
     }
+    return 0;
+}
+
+
+/* write_all -- write the whole buffer to the given descriptor.
+*/
+
+static int write_all(int fd, const unsigned char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+
+/* Batch mode: every file is minified independently by a pool of worker
+        threads. Outputs are only replaced if minification succeeded, so a
+        file jsmin cannot handle is left as-is, just like the shell loop
+        around the stdin/stdout mode did.
+*/
+
+struct job {
+    const char *path;
+    char *output;
+    unsigned char *data;
+    size_t len;
+    const char *error;
+};
+
+static struct job *jobs;
+static size_t job_count;
+static size_t job_next;
+static const char *suffix;
+static int keep_output;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int minify_file(struct job *job) {
+    struct jsmin j = { 0 };
+    struct stat st;
+    void *map = NULL;
+    char *tmp = NULL;
+    int fd, rv = -1;
+
+    fd = open(job->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        job->error = strerror(errno);
+        goto out;
+    }
+    if (st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            map = NULL;
+            job->error = strerror(errno);
+            goto out;
+        }
+    }
+    if (jsmin(&j, map, map ? (size_t)st.st_size : 0) != 0) {
+        job->error = j.error;
+        goto out;
+    }
+    if (asprintf(&tmp, "%s.jsmin.%d", job->output, (int)getpid()) < 0) {
+        tmp = NULL;
+        job->error = "Out of memory.";
+        goto out;
+    }
+    close(fd);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777);
+    if (fd < 0 || write_all(fd, j.out, j.outlen) != 0 || close(fd) != 0) {
+        job->error = strerror(errno);
+        fd = -1;
+        unlink(tmp);
+        goto out;
+    }
+    fd = -1;
+    if (rename(tmp, job->output) != 0) {
+        job->error = strerror(errno);
+        unlink(tmp);
+        goto out;
+    }
+    if (keep_output) {
+        job->data = j.out;
+        job->len = j.outlen;
+        j.out = NULL;
+    }
+    rv = 0;
+out:
+    if (map) {
+        munmap(map, st.st_size);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    free(tmp);
+    free(j.out);
+    return rv;
+}
+
+static void *worker(void *arg) {
+    (void)arg;
+    for (;;) {
+        size_t i;
+        pthread_mutex_lock(&job_lock);
+        i = job_next++;
+        pthread_mutex_unlock(&job_lock);
+        if (i >= job_count) {
+            return NULL;
+        }
+        minify_file(&jobs[i]);
+    }
+}
+
+static int add_job(const char *path) {
+    static size_t size;
+    if (job_count == size) {
+        size_t n = size ? size * 2 : 64;
+        struct job *tmp = realloc(jobs, n * sizeof(*jobs));
+        if (tmp == NULL) {
+            return -1;
+        }
+        jobs = tmp;
+        size = n;
+    }
+    memset(&jobs[job_count], 0, sizeof(*jobs));
+    jobs[job_count].path = path;
+    if (suffix) {
+        if (asprintf(&jobs[job_count].output, "%s%s", path, suffix) < 0) {
+            return -1;
+        }
+    } else if ((jobs[job_count].output = strdup(path)) == NULL) {
+        return -1;
+    }
+    job_count++;
+    return 0;
+}
+
+static int write_bundle(const char *bundle, const char *manifest) {
+    FILE *bf = fopen(bundle, "w");
+    FILE *mf = manifest ? fopen(manifest, "w") : NULL;
+    size_t i, offset = 0;
+    int rv = 0;
+
+    if (bf == NULL || (manifest && mf == NULL)) {
+        fprintf(stderr, "JSMIN Error: %s: %s\n",
+            bf ? manifest : bundle, strerror(errno));
+        rv = -1;
+        goto out;
+    }
+    for (i = 0; i < job_count; i++) {
+        if (jobs[i].error) {
+            continue;
+        }
+        if (fwrite(jobs[i].data, 1, jobs[i].len, bf) != jobs[i].len) {
+            rv = -1;
+            break;
+        }
+        if (mf) {
+            fprintf(mf, "%zu %zu %s\n", offset, jobs[i].len, jobs[i].path);
+        }
+        offset += jobs[i].len;
+    }
+out:
+    if (bf && fclose(bf) != 0) {
+        rv = -1;
+    }
+    if (mf && fclose(mf) != 0) {
+        rv = -1;
+    }
+    return rv;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "Usage: %s [comment ...] < input > output\n"
+        "       %s --batch [-j jobs] [-s suffix] [-b bundle [-m manifest]] [file ...]\n"
+        "\n"
+        "  -j jobs      Number of worker threads (default: online CPUs)\n"
+        "  -s suffix    Write to file + suffix instead of replacing file\n"
+        "  -b bundle    Also write all outputs concatenated to bundle\n"
+        "  -m manifest  Write \"offset length file\" lines describing the bundle\n"
+        "\n"
+        "Without file arguments, the list of files is read from stdin.\n",
+        name, name);
+    exit(1);
+}
+
+static int batch(int argc, char* argv[]) {
+    const char *bundle = NULL, *manifest = NULL;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t *pool;
+    char *line = NULL;
+    size_t i, linesize = 0;
+    ssize_t len;
+    int opt, rv = 0;
+
+    while ((opt = getopt(argc, argv, "j:s:b:m:")) != -1) {
+        switch (opt) {
+        case 'j':
+            threads = strtol(optarg, NULL, 10);
+            break;
+        case 's':
+            suffix = optarg;
+            break;
+        case 'b':
+            bundle = optarg;
+            break;
+        case 'm':
+            manifest = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (manifest && !bundle) {
+        usage(argv[0]);
+    }
+    keep_output = (bundle != NULL);
+    if (optind < argc) {
+        for (; optind < argc; optind++) {
+            if (add_job(argv[optind]) != 0) {
+                goto oom;
+            }
+        }
+    } else {
+        while ((len = getline(&line, &linesize, stdin)) > 0) {
+            if (line[len - 1] == '\n') {
+                line[--len] = 0;
+            }
+            if (len == 0) {
+                continue;
+            }
+            char *path = strdup(line);
+            if (path == NULL || add_job(path) != 0) {
+                goto oom;
+            }
+        }
+        free(line);
+    }
+    if (threads < 1) {
+        threads = 1;
+    }
+    if ((size_t)threads > job_count) {
+        threads = job_count ? job_count : 1;
+    }
+    pool = calloc(threads, sizeof(*pool));
+    if (pool == NULL) {
+        goto oom;
+    }
+    /* the calling thread takes part, so a single job runs without spawning */
+    for (i = 1; i < (size_t)threads; i++) {
+        if (pthread_create(&pool[i], NULL, worker, NULL) != 0) {
+            break;
+        }
+    }
+    worker(NULL);
+    while (--i > 0) {
+        pthread_join(pool[i], NULL);
+    }
+    free(pool);
+    for (i = 0; i < job_count; i++) {
+        if (jobs[i].error) {
+            fprintf(stderr, "JSMIN Error: %s: %s\n", jobs[i].path, jobs[i].error);
+            rv = 1;
+        }
+    }
+    if (bundle && write_bundle(bundle, manifest) != 0) {
+        rv = 1;
+    }
+    return rv;
+oom:
+    fputs("JSMIN Error: Out of memory.\n", stderr);
+    return 1;
 }
 
 
@@ -310,10 +636,38 @@ static void jsmin() {
 */
 
 extern int main(int argc, char* argv[]) {
-    int i;
+    struct jsmin j = { 0 };
+    unsigned char *buf = NULL;
+    size_t len = 0, size = 0, n;
+    int i, rv;
+
+    if (argc > 1 && !strcmp(argv[1], "--batch")) {
+        argv[1] = argv[0];
+        return batch(argc - 1, argv + 1);
+    }
     for (i = 1; i < argc; i += 1) {
         fprintf(stdout, "// %s\n", argv[i]);
     }
-    jsmin();
+    fflush(stdout);
+    for (;;) {
+        if (len == size) {
+            size = size ? size * 2 : 65536;
+            if ((buf = realloc(buf, size)) == NULL) {
+                fputs("JSMIN Error: Out of memory.\n", stderr);
+                return 1;
+            }
+        }
+        n = fread(buf + len, 1, size - len, stdin);
+        if (n == 0) {
+            break;
+        }
+        len += n;
+    }
+    rv = jsmin(&j, buf, len);
+    write_all(STDOUT_FILENO, j.out, j.outlen);
+    if (rv != 0) {
+        fprintf(stderr, "JSMIN Error: %s\n", j.error);
+        return 1;
+    }
     return 0;
 }
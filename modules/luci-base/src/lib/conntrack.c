@@ -0,0 +1,642 @@
+/*
+ * LuCI conntrack table reader - ucode binding
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define CT_PROC_PATH	"/proc/net/nf_conntrack"
+#define CT_COMMAND		"/usr/sbin/conntrack -L -o extended 2>/dev/null"
+#define CT_PROTOCOLS	"/etc/protocols"
+#define CT_CHUNK		65536
+
+
+struct ct_entry {
+	const char *tuples;
+	uint64_t bytes;
+	uint64_t packets;
+	uint32_t timeout;
+	uint32_t index;
+	int16_t l4;
+	uint8_t family;
+	uint8_t flags;
+	uint8_t srclen;
+	uint8_t dstlen;
+	uint16_t sport;
+	uint16_t dport;
+	uint8_t src[16];
+	uint8_t dst[16];
+};
+
+#define CT_HAS_SPORT	(1 << 0)
+#define CT_HAS_DPORT	(1 << 1)
+
+enum ct_sort_key {
+	CT_SORT_NONE,
+	CT_SORT_BYTES,
+	CT_SORT_PACKETS,
+	CT_SORT_TIMEOUT,
+	CT_SORT_SRC,
+	CT_SORT_DST,
+	CT_SORT_SPORT,
+	CT_SORT_DPORT,
+	CT_SORT_LAYER4,
+};
+
+struct ct_filter {
+	int family;
+	int l4;
+	const char *l4name;
+	int port;
+	size_t addrlen;
+	uint8_t addr[16];
+};
+
+
+/* /etc/protocols is only re-read when it changed */
+static struct {
+	ino_t inode;
+	time_t mtime;
+	char *names[256];
+} ct_protocols;
+
+static const char *
+ct_proto_name(int l4)
+{
+	return (l4 >= 0 && l4 < 256 && ct_protocols.names[l4])
+		? ct_protocols.names[l4] : "unknown";
+}
+
+static void
+ct_load_protocols(void)
+{
+	char line[256], *p, *name;
+	struct stat s;
+	FILE *f;
+	int i, n;
+
+	if (stat(CT_PROTOCOLS, &s))
+		memset(&s, 0, sizeof(s));
+
+	if (s.st_ino == ct_protocols.inode && s.st_mtime == ct_protocols.mtime)
+		return;
+
+	for (i = 0; i < 256; i++) {
+		free(ct_protocols.names[i]);
+		ct_protocols.names[i] = NULL;
+	}
+
+	ct_protocols.inode = s.st_ino;
+	ct_protocols.mtime = s.st_mtime;
+
+	f = fopen(CT_PROTOCOLS, "r");
+
+	if (!f)
+		return;
+
+	while (fgets(line, sizeof(line), f)) {
+		for (p = line; *p && *p != '#' && !isspace((unsigned char)*p); p++)
+			;
+
+		if (p == line || !isspace((unsigned char)*p))
+			continue;
+
+		name = line;
+		*p++ = 0;
+
+		while (isspace((unsigned char)*p))
+			p++;
+
+		if (!isdigit((unsigned char)*p))
+			continue;
+
+		for (n = 0; isdigit((unsigned char)*p) && n < 256; p++)
+			n = n * 10 + (*p - '0');
+
+		if (n >= 256 || !isspace((unsigned char)*p))
+			continue;
+
+		free(ct_protocols.names[n]);
+		ct_protocols.names[n] = strdup(name);
+	}
+
+	fclose(f);
+}
+
+static char *
+ct_read_table(void)
+{
+	size_t len = 0, size = 0;
+	bool is_pipe = false;
+	char *buf = NULL, *tmp;
+	size_t rlen;
+	FILE *f;
+
+	f = fopen(CT_PROC_PATH, "r");
+
+	if (!f) {
+		f = popen(CT_COMMAND, "r");
+		is_pipe = true;
+	}
+
+	if (!f)
+		return NULL;
+
+	while (true) {
+		if (size - len < CT_CHUNK) {
+			tmp = realloc(buf, size + CT_CHUNK + 1);
+
+			if (!tmp) {
+				free(buf);
+				buf = NULL;
+				break;
+			}
+
+			buf = tmp;
+			size += CT_CHUNK;
+		}
+
+		rlen = fread(buf + len, 1, size - len, f);
+
+		if (rlen == 0)
+			break;
+
+		len += rlen;
+	}
+
+	if (buf)
+		buf[len] = 0;
+
+	if (is_pipe)
+		pclose(f);
+	else
+		fclose(f);
+
+	return buf;
+}
+
+/* yields the next space delimited token of the given NUL terminated line */
+static bool
+ct_token(const char **p, const char **tok, size_t *len)
+{
+	const char *s = *p;
+
+	while (*s == ' ')
+		s++;
+
+	if (!*s)
+		return false;
+
+	*tok = s;
+
+	while (*s && *s != ' ')
+		s++;
+
+	*len = s - *tok;
+	*p = s;
+
+	return true;
+}
+
+/* splits a "key=value" token, the key consisting of word characters only */
+static bool
+ct_keyval(const char *tok, size_t len, size_t *klen)
+{
+	size_t i;
+
+	for (i = 0; i < len && (isalnum((unsigned char)tok[i]) || tok[i] == '_'); i++)
+		;
+
+	if (i == 0 || i + 1 >= len || tok[i] != '=')
+		return false;
+
+	*klen = i;
+
+	return true;
+}
+
+static bool
+ct_is_number(const char *tok, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (!isdigit((unsigned char)tok[i]))
+			return false;
+
+	return (len > 0);
+}
+
+/* returns the address length, 4 or 16, or 0 if unparsable */
+static size_t
+ct_parse_addr(const char *tok, size_t len, uint8_t *addr)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	if (len >= sizeof(buf))
+		return 0;
+
+	memcpy(buf, tok, len);
+	buf[len] = 0;
+
+	memset(addr, 0, 16);
+
+	if (inet_pton(AF_INET, buf, addr) == 1)
+		return 4;
+
+	if (inet_pton(AF_INET6, buf, addr) == 1)
+		return 16;
+
+	return 0;
+}
+
+static bool
+ct_parse_line(const char *line, struct ct_entry *e)
+{
+	const char *p = line, *tok, *v;
+	size_t len, klen;
+	int i;
+
+	memset(e, 0, sizeof(*e));
+
+	/* family, l3 number, l4 name and l4 number */
+	for (i = 0; i < 4; i++) {
+		if (!ct_token(&p, &tok, &len))
+			return false;
+
+		switch (i) {
+		case 0:
+			if (len == 4 && !strncmp(tok, "ipv4", 4))
+				e->family = AF_INET;
+			else if (len == 4 && !strncmp(tok, "ipv6", 4))
+				e->family = AF_INET6;
+			else
+				return false;
+
+			break;
+
+		case 1:
+			if (!ct_is_number(tok, len))
+				return false;
+
+			break;
+
+		case 3:
+			if (!ct_is_number(tok, len))
+				return false;
+
+			e->l4 = (len <= 3) ? atoi(tok) : -1;
+			break;
+		}
+	}
+
+	/* optional timeout */
+	e->tuples = p;
+
+	if (ct_token(&p, &tok, &len) && ct_is_number(tok, len)) {
+		e->timeout = strtoul(tok, NULL, 10);
+		e->tuples = p;
+	}
+
+	if (strstr(e->tuples, "TIME_WAIT"))
+		return false;
+
+	for (p = e->tuples; ct_token(&p, &tok, &len); ) {
+		if (!ct_keyval(tok, len, &klen))
+			continue;
+
+		v = tok + klen + 1;
+
+		if (klen == 5 && !strncmp(tok, "bytes", 5))
+			e->bytes += strtoull(v, NULL, 10);
+		else if (klen == 7 && !strncmp(tok, "packets", 7))
+			e->packets += strtoull(v, NULL, 10);
+		else if (klen == 3 && !strncmp(tok, "src", 3) && !e->srclen)
+			e->srclen = ct_parse_addr(v, len - 4, e->src);
+		else if (klen == 3 && !strncmp(tok, "dst", 3) && !e->dstlen)
+			e->dstlen = ct_parse_addr(v, len - 4, e->dst);
+		else if (klen == 5 && !strncmp(tok, "sport", 5) && !(e->flags & CT_HAS_SPORT))
+			e->flags |= CT_HAS_SPORT, e->sport = strtoul(v, NULL, 10);
+		else if (klen == 5 && !strncmp(tok, "dport", 5) && !(e->flags & CT_HAS_DPORT))
+			e->flags |= CT_HAS_DPORT, e->dport = strtoul(v, NULL, 10);
+	}
+
+	return true;
+}
+
+static bool
+ct_match(const struct ct_entry *e, const struct ct_filter *f)
+{
+	if (f->family && e->family != f->family)
+		return false;
+
+	if (f->l4 >= 0 && e->l4 != f->l4)
+		return false;
+
+	if (f->l4name && strcmp(ct_proto_name(e->l4), f->l4name))
+		return false;
+
+	if (f->port >= 0 &&
+	    !((e->flags & CT_HAS_SPORT) && e->sport == f->port) &&
+	    !((e->flags & CT_HAS_DPORT) && e->dport == f->port))
+		return false;
+
+	if (f->addrlen &&
+	    !(e->srclen == f->addrlen && !memcmp(e->src, f->addr, 16)) &&
+	    !(e->dstlen == f->addrlen && !memcmp(e->dst, f->addr, 16)))
+		return false;
+
+	return true;
+}
+
+
+static enum ct_sort_key ct_sort_key;
+static bool ct_sort_desc;
+
+#define ct_cmp(a, b) (((a) > (b)) - ((a) < (b)))
+
+static int
+ct_compare(const void *p1, const void *p2)
+{
+	const struct ct_entry *a = p1, *b = p2;
+	int rv = 0;
+
+	switch (ct_sort_key) {
+	case CT_SORT_BYTES:   rv = ct_cmp(a->bytes, b->bytes);       break;
+	case CT_SORT_PACKETS: rv = ct_cmp(a->packets, b->packets);   break;
+	case CT_SORT_TIMEOUT: rv = ct_cmp(a->timeout, b->timeout);   break;
+	case CT_SORT_SPORT:   rv = ct_cmp(a->sport, b->sport);       break;
+	case CT_SORT_DPORT:   rv = ct_cmp(a->dport, b->dport);       break;
+	case CT_SORT_SRC:
+		rv = ct_cmp(a->srclen, b->srclen);
+		rv = rv ? rv : memcmp(a->src, b->src, 16);
+		break;
+	case CT_SORT_DST:
+		rv = ct_cmp(a->dstlen, b->dstlen);
+		rv = rv ? rv : memcmp(a->dst, b->dst, 16);
+		break;
+	case CT_SORT_LAYER4:
+		rv = strcmp(ct_proto_name(a->l4), ct_proto_name(b->l4));
+		break;
+	case CT_SORT_NONE:
+		break;
+	}
+
+	if (ct_sort_desc)
+		rv = -rv;
+
+	/* keep the table order for equal keys */
+	return rv ? rv : ct_cmp(a->index, b->index);
+}
+
+static enum ct_sort_key
+ct_parse_sort(const char *s, bool *desc)
+{
+	static const char *keys[] = {
+		[CT_SORT_BYTES]   = "bytes",
+		[CT_SORT_PACKETS] = "packets",
+		[CT_SORT_TIMEOUT] = "timeout",
+		[CT_SORT_SRC]     = "src",
+		[CT_SORT_DST]     = "dst",
+		[CT_SORT_SPORT]   = "sport",
+		[CT_SORT_DPORT]   = "dport",
+		[CT_SORT_LAYER4]  = "layer4",
+	};
+	size_t i;
+
+	*desc = (s[0] == '-');
+
+	for (i = CT_SORT_BYTES; i < sizeof(keys) / sizeof(keys[0]); i++)
+		if (!strcmp(s + *desc, keys[i]))
+			return i;
+
+	return CT_SORT_NONE;
+}
+
+static uc_value_t *
+ct_addr_new(const uint8_t *addr, size_t len)
+{
+	char buf[INET6_ADDRSTRLEN];
+
+	inet_ntop((len == 4) ? AF_INET : AF_INET6, addr, buf, sizeof(buf));
+
+	return ucv_string_new(buf);
+}
+
+static uc_value_t *
+ct_entry_new(uc_vm_t *vm, const struct ct_entry *e)
+{
+	uc_value_t *o = ucv_object_new(vm);
+	const char *p, *tok;
+	size_t len, klen;
+	char key[64];
+
+	ucv_object_add(o, "bytes", ucv_uint64_new(e->bytes));
+	ucv_object_add(o, "packets", ucv_uint64_new(e->packets));
+	ucv_object_add(o, "layer3", ucv_string_new(e->family == AF_INET ? "ipv4" : "ipv6"));
+	ucv_object_add(o, "layer4", ucv_string_new(ct_proto_name(e->l4)));
+	ucv_object_add(o, "timeout", ucv_int64_new(e->timeout));
+
+	for (p = e->tuples; ct_token(&p, &tok, &len); ) {
+		if (!ct_keyval(tok, len, &klen) || klen >= sizeof(key))
+			continue;
+
+		memcpy(key, tok, klen);
+		key[klen] = 0;
+
+		if (!strcmp(key, "bytes") || !strcmp(key, "packets"))
+			continue;
+
+		if (!strcmp(key, "src") || !strcmp(key, "dst") ||
+		    !strcmp(key, "sport") || !strcmp(key, "dport")) {
+			if (ucv_object_get(o, key, NULL))
+				continue;
+
+			if (!strcmp(key, "src") && e->srclen)
+				ucv_object_add(o, key, ct_addr_new(e->src, e->srclen));
+			else if (!strcmp(key, "dst") && e->dstlen)
+				ucv_object_add(o, key, ct_addr_new(e->dst, e->dstlen));
+			else if (!strcmp(key, "sport"))
+				ucv_object_add(o, key, ucv_int64_new(e->sport));
+			else if (!strcmp(key, "dport"))
+				ucv_object_add(o, key, ucv_int64_new(e->dport));
+
+			continue;
+		}
+
+		ucv_object_add(o, key,
+			ucv_string_new_length(tok + klen + 1, len - klen - 1));
+	}
+
+	return o;
+}
+
+static bool
+ct_parse_filter(uc_value_t *opts, struct ct_filter *f)
+{
+	uc_value_t *v;
+
+	memset(f, 0, sizeof(*f));
+	f->l4 = -1;
+	f->port = -1;
+
+	if (ucv_type(opts) != UC_OBJECT)
+		return true;
+
+	v = ucv_object_get(opts, "family", NULL);
+
+	if (ucv_type(v) == UC_STRING && *ucv_string_get(v)) {
+		if (!strcmp(ucv_string_get(v), "ipv4"))
+			f->family = AF_INET;
+		else if (!strcmp(ucv_string_get(v), "ipv6"))
+			f->family = AF_INET6;
+		else
+			return false;
+	}
+
+	v = ucv_object_get(opts, "proto", NULL);
+
+	if (ucv_type(v) == UC_INTEGER)
+		f->l4 = ucv_int64_get(v);
+	else if (ucv_type(v) == UC_STRING && *ucv_string_get(v))
+		f->l4name = ucv_string_get(v);
+
+	v = ucv_object_get(opts, "port", NULL);
+
+	if (ucv_type(v) == UC_INTEGER && ucv_int64_get(v) > 0)
+		f->port = ucv_int64_get(v);
+
+	v = ucv_object_get(opts, "address", NULL);
+
+	if (ucv_type(v) == UC_STRING && *ucv_string_get(v)) {
+		f->addrlen = ct_parse_addr(ucv_string_get(v), ucv_string_length(v), f->addr);
+
+		if (!f->addrlen)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * conntrack([opts]) - parse the connection tracking table
+ *
+ * Supported options are "family" ("ipv4" or "ipv6"), "proto" (layer 4
+ * protocol name or number), "address" and "port" (matching either the
+ * source or destination), "sort" (one of bytes, packets, timeout, src, dst,
+ * sport, dport or layer4, prefixed with "-" for descending order), "offset"
+ * and "limit". Returns an object holding the number of matching entries in
+ * "total" and the requested slice of them in "entries", or null if any of
+ * the options is invalid.
+ */
+__hidden uc_value_t *
+uc_luci_conntrack(uc_vm_t *vm, size_t nargs) {
+	uc_value_t *opts = uc_fn_arg(0), *v, *rv, *list;
+	size_t i, n = 0, size = 0, offset = 0, limit = SIZE_MAX;
+	struct ct_entry *entries = NULL, *tmp, e;
+	struct ct_filter filter;
+	char *buf, *line, *eol;
+	uint32_t index = 0;
+
+	if (opts && ucv_type(opts) != UC_OBJECT)
+		return NULL;
+
+	if (!ct_parse_filter(opts, &filter))
+		return NULL;
+
+	ct_sort_key = CT_SORT_NONE;
+	ct_sort_desc = false;
+
+	v = ucv_object_get(opts, "sort", NULL);
+
+	if (ucv_type(v) == UC_STRING && *ucv_string_get(v)) {
+		ct_sort_key = ct_parse_sort(ucv_string_get(v), &ct_sort_desc);
+
+		if (ct_sort_key == CT_SORT_NONE)
+			return NULL;
+	}
+
+	v = ucv_object_get(opts, "offset", NULL);
+
+	if (ucv_type(v) == UC_INTEGER && ucv_int64_get(v) > 0)
+		offset = ucv_int64_get(v);
+
+	v = ucv_object_get(opts, "limit", NULL);
+
+	if (ucv_type(v) == UC_INTEGER && ucv_int64_get(v) > 0)
+		limit = ucv_int64_get(v);
+
+	ct_load_protocols();
+
+	/* a missing or unreadable table yields an empty result */
+	buf = ct_read_table();
+
+	for (line = buf; line && *line; line = eol + 1) {
+		eol = strchr(line, '\n');
+
+		/* lines lacking a newline are incomplete */
+		if (!eol)
+			break;
+
+		*eol = 0;
+
+		if (!ct_parse_line(line, &e) || !ct_match(&e, &filter))
+			continue;
+
+		e.index = index++;
+
+		if (n == size) {
+			tmp = realloc(entries, (size ? size * 2 : 256) * sizeof(*entries));
+
+			if (!tmp) {
+				free(entries);
+				free(buf);
+
+				return NULL;
+			}
+
+			entries = tmp;
+			size = size ? size * 2 : 256;
+		}
+
+		entries[n++] = e;
+	}
+
+	if (ct_sort_key != CT_SORT_NONE && n > 1)
+		qsort(entries, n, sizeof(*entries), ct_compare);
+
+	rv = ucv_object_new(vm);
+	list = ucv_array_new(vm);
+
+	for (i = offset; i < n && i - offset < limit; i++)
+		ucv_array_push(list, ct_entry_new(vm, &entries[i]));
+
+	ucv_object_add(rv, "total", ucv_uint64_new(n));
+	ucv_object_add(rv, "entries", list);
+
+	free(entries);
+	free(buf);
+
+	return rv;
+}
@@ -0,0 +1,314 @@
+/*
+ * LuCI 64 bit non-cryptographic hashing - ucode binding
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Implements the XXH64 algorithm, results are identical to the reference
+ * implementation so digests can be cross-checked with the xxhsum utility.
+ * The LMO format keeps using sfh_hash(), this is meant for cache keys and
+ * content fingerprints of arbitrarily large inputs.
+ */
+
+#include "sys.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define XXH_PRIME64_1	0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3	0x165667B19E3779F9ULL
+#define XXH_PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5	0x27D4EB2F165667C5ULL
+
+struct hash64_state {
+	uint64_t seed;
+	uint64_t total;
+	uint64_t acc[4];
+	uint8_t buf[32];
+	size_t buflen;
+};
+
+static uc_resource_type_t *hash64_type;
+
+
+static inline uint64_t
+rotl64(uint64_t v, int n)
+{
+	return (v << n) | (v >> (64 - n));
+}
+
+static inline uint64_t
+read64(const uint8_t *p)
+{
+	return (uint64_t)p[0]         | ((uint64_t)p[1] << 8)  |
+	       ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+	       ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) |
+	       ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static inline uint32_t
+read32(const uint8_t *p)
+{
+	return (uint32_t)p[0]         | ((uint32_t)p[1] << 8) |
+	       ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t
+hash64_round(uint64_t acc, uint64_t input)
+{
+	acc += input * XXH_PRIME64_2;
+	acc = rotl64(acc, 31);
+
+	return acc * XXH_PRIME64_1;
+}
+
+static inline uint64_t
+hash64_merge(uint64_t acc, uint64_t val)
+{
+	acc ^= hash64_round(0, val);
+
+	return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static void
+hash64_reset(struct hash64_state *st, uint64_t seed)
+{
+	memset(st, 0, sizeof(*st));
+
+	st->seed = seed;
+	st->acc[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+	st->acc[1] = seed + XXH_PRIME64_2;
+	st->acc[2] = seed;
+	st->acc[3] = seed - XXH_PRIME64_1;
+}
+
+static void
+hash64_stripes(struct hash64_state *st, const uint8_t *p, size_t n)
+{
+	uint64_t a0 = st->acc[0], a1 = st->acc[1], a2 = st->acc[2], a3 = st->acc[3];
+
+	for (; n >= 32; p += 32, n -= 32) {
+		a0 = hash64_round(a0, read64(p));
+		a1 = hash64_round(a1, read64(p + 8));
+		a2 = hash64_round(a2, read64(p + 16));
+		a3 = hash64_round(a3, read64(p + 24));
+	}
+
+	st->acc[0] = a0; st->acc[1] = a1; st->acc[2] = a2; st->acc[3] = a3;
+}
+
+static void
+hash64_update(struct hash64_state *st, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	size_t n;
+
+	st->total += len;
+
+	if (st->buflen) {
+		n = sizeof(st->buf) - st->buflen;
+
+		if (n > len)
+			n = len;
+
+		memcpy(st->buf + st->buflen, p, n);
+		st->buflen += n;
+		p += n;
+		len -= n;
+
+		if (st->buflen < sizeof(st->buf))
+			return;
+
+		hash64_stripes(st, st->buf, sizeof(st->buf));
+		st->buflen = 0;
+	}
+
+	n = len & ~(size_t)31;
+	hash64_stripes(st, p, n);
+
+	memcpy(st->buf, p + n, len - n);
+	st->buflen = len - n;
+}
+
+/* Does not modify the state, more data may be appended afterwards */
+static uint64_t
+hash64_digest(const struct hash64_state *st)
+{
+	const uint8_t *p = st->buf, *e = st->buf + st->buflen;
+	uint64_t h;
+
+	if (st->total >= 32) {
+		h = rotl64(st->acc[0], 1) + rotl64(st->acc[1], 7) +
+		    rotl64(st->acc[2], 12) + rotl64(st->acc[3], 18);
+
+		h = hash64_merge(h, st->acc[0]);
+		h = hash64_merge(h, st->acc[1]);
+		h = hash64_merge(h, st->acc[2]);
+		h = hash64_merge(h, st->acc[3]);
+	}
+	else {
+		h = st->seed + XXH_PRIME64_5;
+	}
+
+	h += st->total;
+
+	for (; p + 8 <= e; p += 8) {
+		h ^= hash64_round(0, read64(p));
+		h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+	}
+
+	if (p + 4 <= e) {
+		h ^= (uint64_t)read32(p) * XXH_PRIME64_1;
+		h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+		p += 4;
+	}
+
+	for (; p < e; p++) {
+		h ^= *p * XXH_PRIME64_5;
+		h = rotl64(h, 11) * XXH_PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= XXH_PRIME64_2;
+	h ^= h >> 29;
+	h *= XXH_PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+static bool
+hash64_seed(uc_value_t *arg, uint64_t *seed)
+{
+	if (!arg) {
+		*seed = 0;
+
+		return true;
+	}
+
+	if (ucv_type(arg) != UC_INTEGER)
+		return false;
+
+	*seed = ucv_uint64_get(arg);
+
+	return true;
+}
+
+static uc_value_t *
+hash64_hex(uint64_t h)
+{
+	char buf[sizeof("0123456789abcdef")];
+
+	snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)h);
+
+	return ucv_string_new_length(buf, 16);
+}
+
+
+/*
+ * hash64(data[, seed]) - return the 64 bit XXH64 digest of the given string
+ * as 16 character hex string.
+ */
+uc_value_t *
+uc_luci_hash64(uc_vm_t *vm, size_t nargs) {
+	uc_value_t *data = uc_fn_arg(0);
+	struct hash64_state st;
+	uint64_t seed;
+
+	if (ucv_type(data) != UC_STRING || !hash64_seed(uc_fn_arg(1), &seed))
+		return NULL;
+
+	hash64_reset(&st, seed);
+	hash64_update(&st, ucv_string_get(data), ucv_string_length(data));
+
+	return hash64_hex(hash64_digest(&st));
+}
+
+/*
+ * hash64_state([seed]) - return a streaming hash object, feeding it with
+ * the chunks of an input yields the same digest as hash64() on the whole.
+ */
+uc_value_t *
+uc_luci_hash64_state(uc_vm_t *vm, size_t nargs) {
+	struct hash64_state *st;
+	uint64_t seed;
+
+	if (!hash64_seed(uc_fn_arg(0), &seed))
+		return NULL;
+
+	st = calloc(1, sizeof(*st));
+
+	if (!st)
+		return NULL;
+
+	hash64_reset(st, seed);
+
+	return uc_resource_new(hash64_type, st);
+}
+
+static uc_value_t *
+uc_hash64_update(uc_vm_t *vm, size_t nargs) {
+	struct hash64_state **st = uc_fn_this("luci.core.hash64");
+	uc_value_t *data = uc_fn_arg(0);
+
+	if (!st || !*st || ucv_type(data) != UC_STRING)
+		return NULL;
+
+	hash64_update(*st, ucv_string_get(data), ucv_string_length(data));
+
+	return ucv_get(uc_vector_last(&vm->callframes)->ctx);
+}
+
+static uc_value_t *
+uc_hash64_digest(uc_vm_t *vm, size_t nargs) {
+	struct hash64_state **st = uc_fn_this("luci.core.hash64");
+
+	if (!st || !*st)
+		return NULL;
+
+	return hash64_hex(hash64_digest(*st));
+}
+
+static uc_value_t *
+uc_hash64_reset(uc_vm_t *vm, size_t nargs) {
+	struct hash64_state **st = uc_fn_this("luci.core.hash64");
+	uint64_t seed;
+
+	if (!st || !*st)
+		return NULL;
+
+	if (!nargs)
+		seed = (*st)->seed;
+	else if (!hash64_seed(uc_fn_arg(0), &seed))
+		return NULL;
+
+	hash64_reset(*st, seed);
+
+	return ucv_get(uc_vector_last(&vm->callframes)->ctx);
+}
+
+static const uc_function_list_t hash64_fns[] = {
+	{ "update",		uc_hash64_update },
+	{ "digest",		uc_hash64_digest },
+	{ "reset",		uc_hash64_reset },
+};
+
+void
+luci_hash64_init(uc_vm_t *vm)
+{
+	hash64_type = uc_type_declare(vm, "luci.core.hash64", hash64_fns, free);
+}
@@ -17,6 +17,7 @@
  */
 
 #include "lmo.h"
+#include "sys.h"
 
 #include <pwd.h>
 #include <crypt.h>
@@ -32,6 +33,170 @@
 
 #include <ucode/module.h>
 
+/* translation lookup cache */
+
+#define TR_CACHE_MIN	256
+#define TR_CACHE_MAX	4096
+
+struct tr_cache_entry {
+	uint32_t hash;
+	bool plural;
+	int64_t count;
+	uc_value_t *key;
+	uc_value_t *pkey;
+	uc_value_t *ctx;
+	uc_value_t *val;
+};
+
+static struct {
+	struct tr_cache_entry *entries;
+	size_t size;
+	size_t used;
+	uint64_t hits;
+	uint64_t misses;
+} tr_cache;
+
+static void
+tr_cache_flush(void) {
+	struct tr_cache_entry *e;
+	size_t i;
+
+	for (i = 0; i < tr_cache.size; i++) {
+		e = &tr_cache.entries[i];
+
+		if (!e->key)
+			continue;
+
+		ucv_put(e->key);
+		ucv_put(e->pkey);
+		ucv_put(e->ctx);
+		ucv_put(e->val);
+	}
+
+	free(tr_cache.entries);
+
+	tr_cache.entries = NULL;
+	tr_cache.size = 0;
+	tr_cache.used = 0;
+}
+
+static uint32_t
+tr_cache_hash(uc_value_t *key, uc_value_t *pkey, uc_value_t *ctx, bool plural, int64_t count) {
+	uint32_t h = sfh_hash(ucv_string_get(key), ucv_string_length(key), 0x1b756362);
+
+	if (pkey)
+		h = sfh_hash(ucv_string_get(pkey), ucv_string_length(pkey), h) ^ h;
+
+	if (ctx)
+		h ^= sfh_hash(ucv_string_get(ctx), ucv_string_length(ctx), ~h) | 1;
+
+	if (plural)
+		h ^= (uint32_t)(count ^ (count >> 32)) * 0x9e3779b1U + 1;
+
+	return h;
+}
+
+static bool
+tr_cache_equal(uc_value_t *a, uc_value_t *b) {
+	if (a == b)
+		return true;
+
+	if (!a || !b || ucv_string_length(a) != ucv_string_length(b))
+		return false;
+
+	return !memcmp(ucv_string_get(a), ucv_string_get(b), ucv_string_length(a));
+}
+
+/*
+ * Find the slot for the given lookup, either holding the cached result or
+ * the empty slot to store it in. Results are kept as ucode strings, so a
+ * hit neither hashes nor searches the catalog nor allocates a new string.
+ * Negative results are cached as well, most lookups of a page are for
+ * strings without translation when the active catalog is incomplete.
+ */
+static struct tr_cache_entry *
+tr_cache_slot(uint32_t hash, uc_value_t *key, uc_value_t *pkey, uc_value_t *ctx,
+              bool plural, int64_t count) {
+	struct tr_cache_entry *e;
+	size_t i;
+
+	if (!tr_cache.size) {
+		tr_cache.entries = calloc(TR_CACHE_MIN, sizeof(*tr_cache.entries));
+
+		if (!tr_cache.entries)
+			return NULL;
+
+		tr_cache.size = TR_CACHE_MIN;
+	}
+
+	for (i = hash & (tr_cache.size - 1); ; i = (i + 1) & (tr_cache.size - 1)) {
+		e = &tr_cache.entries[i];
+
+		if (!e->key)
+			return e;
+
+		if (e->hash == hash && e->plural == plural && e->count == count &&
+		    tr_cache_equal(e->key, key) && tr_cache_equal(e->pkey, pkey) &&
+		    tr_cache_equal(e->ctx, ctx))
+			return e;
+	}
+}
+
+static void
+tr_cache_store(struct tr_cache_entry *e, uint32_t hash, uc_value_t *key, uc_value_t *pkey,
+               uc_value_t *ctx, bool plural, int64_t count, uc_value_t *val) {
+	struct tr_cache_entry *entries, *old = tr_cache.entries;
+	size_t i, size = tr_cache.size;
+
+	if (!e)
+		return;
+
+	e->hash = hash;
+	e->plural = plural;
+	e->count = count;
+	e->key = ucv_get(key);
+	e->pkey = ucv_get(pkey);
+	e->ctx = ucv_get(ctx);
+	e->val = ucv_get(val);
+
+	/* keep the load factor below one half, start over once the limit is hit */
+	if (++tr_cache.used * 2 < size)
+		return;
+
+	if (size * 2 > TR_CACHE_MAX || !(entries = calloc(size * 2, sizeof(*entries)))) {
+		tr_cache_flush();
+		return;
+	}
+
+	tr_cache.entries = entries;
+	tr_cache.size = size * 2;
+
+	for (i = 0; i < size; i++) {
+		if (!old[i].key)
+			continue;
+
+		for (e = &entries[old[i].hash & (tr_cache.size - 1)]; e->key;
+		     e = &entries[(e - entries + 1) & (tr_cache.size - 1)])
+			;
+
+		*e = old[i];
+	}
+
+	free(old);
+}
+
+static uc_value_t *
+uc_luci_translate_stats(uc_vm_t *vm, size_t nargs) {
+	uc_value_t *rv = ucv_object_new(vm);
+
+	ucv_object_add(rv, "hits", ucv_uint64_new(tr_cache.hits));
+	ucv_object_add(rv, "misses", ucv_uint64_new(tr_cache.misses));
+	ucv_object_add(rv, "entries", ucv_uint64_new(tr_cache.used));
+
+	return rv;
+}
+
+
 /* translation catalog functions */
 
 static uc_value_t *
@@ -45,6 +210,8 @@ uc_luci_load_catalog(uc_vm_t *vm, size_t nargs) {
 	if (dir && ucv_type(dir) != UC_STRING)
 		return NULL;
 
+	tr_cache_flush();
+
 	return ucv_boolean_new(lmo_load_catalog(
 		lang ? ucv_string_get(lang) : "en",
 		ucv_string_get(dir)) == 0);
@@ -57,6 +224,7 @@ uc_luci_close_catalog(uc_vm_t *vm, size_t nargs) {
 	if (lang && ucv_type(lang) != UC_STRING)
 		return NULL;
 
+	tr_cache_flush();
 	lmo_close_catalog(lang ? ucv_string_get(lang) : "en");
 
 	return ucv_boolean_new(true);
@@ -69,6 +237,8 @@ uc_luci_change_catalog(uc_vm_t *vm, size_t nargs) {
 	if (lang && ucv_type(lang) != UC_STRING)
 		return NULL;
 
+	tr_cache_flush();
+
 	return ucv_boolean_new(lmo_change_catalog(
 		lang ? ucv_string_get(lang) : "en") == 0);
 }
@@ -96,6 +266,9 @@ static uc_value_t *
 uc_luci_translate(uc_vm_t *vm, size_t nargs) {
 	uc_value_t *key = uc_fn_arg(0);
 	uc_value_t *ctx = uc_fn_arg(1);
+	struct tr_cache_entry *e;
+	uc_value_t *rv = NULL;
+	uint32_t hash;
 	int trlen;
 	char *tr;
 
@@ -105,12 +278,25 @@ uc_luci_translate(uc_vm_t *vm, size_t nargs) {
 	if (ctx && ucv_type(ctx) != UC_STRING)
 		return NULL;
 
+	hash = tr_cache_hash(key, NULL, ctx, false, 0);
+	e = tr_cache_slot(hash, key, NULL, ctx, false, 0);
+
+	if (e && e->key) {
+		tr_cache.hits++;
+
+		return ucv_get(e->val);
+	}
+
+	tr_cache.misses++;
+
 	if (lmo_translate_ctxt(ucv_string_get(key), ucv_string_length(key),
 	                       ucv_string_get(ctx), ucv_string_length(ctx),
-	                       &tr, &trlen) != 0)
-		return NULL;
+	                       &tr, &trlen) == 0)
+		rv = ucv_string_new_length(tr, (size_t)trlen);
+
+	tr_cache_store(e, hash, key, NULL, ctx, false, 0, rv);
 
-	return ucv_string_new_length(tr, (size_t)trlen);
+	return rv;
 }
 
 static uc_value_t *
@@ -119,6 +305,10 @@ uc_luci_ntranslate(uc_vm_t *vm, size_t nargs) {
 	uc_value_t *skey = uc_fn_arg(1);
 	uc_value_t *pkey = uc_fn_arg(2);
 	uc_value_t *ctx  = uc_fn_arg(3);
+	int64_t n = ucv_int64_get(cnt);
+	struct tr_cache_entry *e;
+	uc_value_t *rv = NULL;
+	uint32_t hash;
 	int trlen;
 	char *tr;
 
@@ -128,14 +318,27 @@ uc_luci_ntranslate(uc_vm_t *vm, size_t nargs) {
 	if (ctx && ucv_type(ctx) != UC_STRING)
 		return NULL;
 
-	if (lmo_translate_plural_ctxt(ucv_int64_get(cnt),
+	hash = tr_cache_hash(skey, pkey, ctx, true, n);
+	e = tr_cache_slot(hash, skey, pkey, ctx, true, n);
+
+	if (e && e->key) {
+		tr_cache.hits++;
+
+		return ucv_get(e->val);
+	}
+
+	tr_cache.misses++;
+
+	if (lmo_translate_plural_ctxt(n,
 	                              ucv_string_get(skey), ucv_string_length(skey),
 	                              ucv_string_get(pkey), ucv_string_length(pkey),
 	                              ucv_string_get(ctx), ucv_string_length(ctx),
-	                              &tr, &trlen) != 0)
-		return NULL;
+	                              &tr, &trlen) == 0)
+		rv = ucv_string_new_length(tr, (size_t)trlen);
 
-	return ucv_string_new_length(tr, (size_t)trlen);
+	tr_cache_store(e, hash, skey, pkey, ctx, true, n, rv);
+
+	return rv;
 }
 
 static uc_value_t *
@@ -360,7 +563,10 @@ static const uc_function_list_t luci_fns[] = {
 	{ "get_translations",	uc_luci_get_translations },
 	{ "translate",			uc_luci_translate },
 	{ "ntranslate",			uc_luci_ntranslate },
+	{ "translate_stats",	uc_luci_translate_stats },
 	{ "hash",				uc_luci_hash },
+	{ "hash64",			uc_luci_hash64 },
+	{ "hash64_state",		uc_luci_hash64_state },
 
 	{ "getspnam",			uc_luci_getspnam },
 	{ "getpwnam",			uc_luci_getpwnam },
@@ -374,10 +580,14 @@ static const uc_function_list_t luci_fns[] = {
 	{ "uname",				uc_luci_uname },
 	{ "sysinfo",			uc_luci_sysinfo },
 	{ "statvfs",			uc_luci_statvfs },
+	{ "conntrack",			uc_luci_conntrack },
+	{ "process_list",		uc_luci_process_list },
 };
 
 
 void uc_module_init(uc_vm_t *vm, uc_value_t *scope)
 {
+	luci_hash64_init(vm);
+
 	uc_function_list_register(scope, luci_fns);
 }
@@ -0,0 +1,544 @@
+/*
+ * LuCI process list - ucode binding
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "sys.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pwd.h>
+#include <sys/stat.h>
+#include <sys/sysinfo.h>
+
+#define PROC_CMDLINE_MAX	4096
+
+
+struct proc_entry {
+	int pid;
+	int ppid;
+	uid_t uid;
+	char state;
+	long nice;
+	uint64_t ticks;
+	uint64_t start;
+	uint64_t vsz;
+	uint64_t rss;
+	double cpu;
+	double mem;
+	char *user;
+	char *command;
+};
+
+/* cpu time of every process seen by the previous call, ordered by pid */
+struct proc_sample {
+	int pid;
+	uint64_t start;
+	uint64_t ticks;
+};
+
+static struct {
+	uint64_t total;
+	size_t count;
+	struct proc_sample *samples;
+} proc_prev;
+
+enum proc_sort_key {
+	PROC_SORT_NONE,
+	PROC_SORT_PID,
+	PROC_SORT_PPID,
+	PROC_SORT_USER,
+	PROC_SORT_VSZ,
+	PROC_SORT_RSS,
+	PROC_SORT_MEM,
+	PROC_SORT_CPU,
+	PROC_SORT_COMMAND,
+};
+
+static enum proc_sort_key proc_sort_key;
+static bool proc_sort_desc;
+
+
+static ssize_t
+proc_read(const char *path, char *buf, size_t len)
+{
+	ssize_t rlen, total = 0;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0)
+		return -1;
+
+	while ((size_t)total < len - 1) {
+		rlen = read(fd, buf + total, len - 1 - total);
+
+		if (rlen <= 0)
+			break;
+
+		total += rlen;
+	}
+
+	close(fd);
+
+	buf[total] = 0;
+
+	return total;
+}
+
+/* sum of all jiffies spent by all cpus so far */
+static uint64_t
+proc_total_ticks(void)
+{
+	char buf[512], *p, *e;
+	uint64_t total = 0;
+	int i;
+
+	if (proc_read("/proc/stat", buf, sizeof(buf)) <= 0 || strncmp(buf, "cpu ", 4))
+		return 0;
+
+	/* user nice system idle iowait irq softirq steal */
+	for (p = buf + 4, i = 0; i < 8; i++, p = e) {
+		total += strtoull(p, &e, 10);
+
+		if (e == p)
+			break;
+	}
+
+	return total;
+}
+
+static bool
+proc_parse_stat(int pid, struct proc_entry *e)
+{
+	unsigned long long utime, stime, start;
+	char path[32], buf[1024], *p;
+	int ppid;
+	long nice;
+
+	snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+
+	if (proc_read(path, buf, sizeof(buf)) <= 0)
+		return false;
+
+	/* the command name may contain spaces and parentheses */
+	p = strrchr(buf, ')');
+
+	if (!p)
+		return false;
+
+	if (sscanf(p + 2,
+	           "%c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu "
+	           "%*d %*d %*d %ld %*d %*d %llu",
+	           &e->state, &ppid, &utime, &stime, &nice, &start) != 6)
+		return false;
+
+	e->pid = pid;
+	e->ppid = ppid;
+	e->nice = nice;
+	e->ticks = utime + stime;
+	e->start = start;
+
+	return true;
+}
+
+static void
+proc_parse_statm(int pid, struct proc_entry *e, long pagesize)
+{
+	unsigned long long size = 0, resident = 0;
+	char path[32], buf[128];
+
+	snprintf(path, sizeof(path), "/proc/%d/statm", pid);
+
+	if (proc_read(path, buf, sizeof(buf)) > 0)
+		sscanf(buf, "%llu %llu", &size, &resident);
+
+	e->vsz = size * pagesize / 1024;
+	e->rss = resident * pagesize / 1024;
+}
+
+static char *
+proc_command(int pid)
+{
+	char path[32], buf[PROC_CMDLINE_MAX], *p;
+	ssize_t len;
+
+	snprintf(path, sizeof(path), "/proc/%d/cmdline", pid);
+	len = proc_read(path, buf, sizeof(buf));
+
+	/* kernel threads have no command line, show their name like top does */
+	if (len <= 0) {
+		snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+		buf[0] = '[';
+		len = proc_read(path, buf + 1, sizeof(buf) - 2);
+
+		if (len <= 0)
+			return NULL;
+
+		if (buf[len] == '\n')
+			len--;
+
+		buf[len + 1] = ']';
+		buf[len + 2] = 0;
+
+		return strdup(buf);
+	}
+
+	while (len > 0 && buf[len - 1] == 0)
+		len--;
+
+	for (p = buf; p < buf + len; p++)
+		if (*p == 0)
+			*p = ' ';
+
+	buf[len] = 0;
+
+	return strdup(buf);
+}
+
+static const struct proc_sample *
+proc_prev_sample(int pid)
+{
+	size_t lo = 0, hi = proc_prev.count, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+
+		if (proc_prev.samples[mid].pid == pid)
+			return &proc_prev.samples[mid];
+
+		if (proc_prev.samples[mid].pid < pid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return NULL;
+}
+
+/* user names are resolved once per uid and call */
+struct proc_user {
+	uid_t uid;
+	char *name;
+};
+
+static const char *
+proc_user(uid_t uid, struct proc_user *cache, size_t *ncache,
+          char *buf, size_t buflen)
+{
+	struct passwd *pw;
+	size_t i;
+
+	for (i = 0; i < *ncache; i++)
+		if (cache[i].uid == uid)
+			return cache[i].name;
+
+	pw = getpwuid(uid);
+
+	if (pw)
+		snprintf(buf, buflen, "%s", pw->pw_name);
+	else
+		snprintf(buf, buflen, "%u", (unsigned int)uid);
+
+	/* once the cache is full the name is still returned, just not kept */
+	if (*ncache < 64) {
+		cache[*ncache].uid = uid;
+		cache[*ncache].name = strdup(buf);
+
+		if (cache[*ncache].name)
+			return cache[(*ncache)++].name;
+	}
+
+	return buf;
+}
+
+static void
+proc_resolve(struct proc_entry *e, struct proc_user *cache, size_t *ncache)
+{
+	const char *user;
+	char buf[64];
+
+	if (!e->user) {
+		user = proc_user(e->uid, cache, ncache, buf, sizeof(buf));
+		e->user = strdup(user ? user : "");
+	}
+
+	if (!e->command) {
+		e->command = proc_command(e->pid);
+
+		if (!e->command)
+			e->command = strdup("");
+	}
+}
+
+static int
+proc_cmp_pid(const void *p1, const void *p2)
+{
+	const struct proc_entry *a = p1, *b = p2;
+
+	return (a->pid > b->pid) - (a->pid < b->pid);
+}
+
+#define proc_cmp(a, b) (((a) > (b)) - ((a) < (b)))
+
+static int
+proc_compare(const void *p1, const void *p2)
+{
+	const struct proc_entry *a = p1, *b = p2;
+	int rv = 0;
+
+	switch (proc_sort_key) {
+	case PROC_SORT_PID:     rv = proc_cmp(a->pid, b->pid);           break;
+	case PROC_SORT_PPID:    rv = proc_cmp(a->ppid, b->ppid);         break;
+	case PROC_SORT_VSZ:     rv = proc_cmp(a->vsz, b->vsz);           break;
+	case PROC_SORT_RSS:     rv = proc_cmp(a->rss, b->rss);           break;
+	case PROC_SORT_MEM:     rv = proc_cmp(a->mem, b->mem);           break;
+	case PROC_SORT_CPU:     rv = proc_cmp(a->cpu, b->cpu);           break;
+	case PROC_SORT_USER:    rv = strcmp(a->user, b->user);           break;
+	case PROC_SORT_COMMAND: rv = strcmp(a->command, b->command);     break;
+	case PROC_SORT_NONE:    break;
+	}
+
+	if (proc_sort_desc)
+		rv = -rv;
+
+	return rv ? rv : proc_cmp(a->pid, b->pid);
+}
+
+static enum proc_sort_key
+proc_parse_sort(const char *s, bool *desc)
+{
+	static const char *keys[] = {
+		[PROC_SORT_PID]     = "PID",
+		[PROC_SORT_PPID]    = "PPID",
+		[PROC_SORT_USER]    = "USER",
+		[PROC_SORT_VSZ]     = "VSZ",
+		[PROC_SORT_RSS]     = "RSS",
+		[PROC_SORT_MEM]     = "%MEM",
+		[PROC_SORT_CPU]     = "%CPU",
+		[PROC_SORT_COMMAND] = "COMMAND",
+	};
+	size_t i;
+
+	*desc = (s[0] == '-');
+
+	for (i = PROC_SORT_PID; i < sizeof(keys) / sizeof(keys[0]); i++)
+		if (!strcmp(s + *desc, keys[i]))
+			return i;
+
+	return PROC_SORT_NONE;
+}
+
+static uc_value_t *
+proc_entry_new(uc_vm_t *vm, const struct proc_entry *e)
+{
+	uc_value_t *o = ucv_object_new(vm);
+	char stat[4], *s = stat;
+
+	*s++ = e->state;
+
+	if (e->vsz == 0 && e->state != 'Z')
+		*s++ = 'W';
+
+	if (e->nice < 0)
+		*s++ = '<';
+	else if (e->nice > 0)
+		*s++ = 'N';
+
+	*s = 0;
+
+	ucv_object_add(o, "PID", ucv_int64_new(e->pid));
+	ucv_object_add(o, "PPID", ucv_int64_new(e->ppid));
+	ucv_object_add(o, "USER", ucv_string_new(e->user));
+	ucv_object_add(o, "STAT", ucv_string_new(stat));
+	ucv_object_add(o, "VSZ", ucv_uint64_new(e->vsz));
+	ucv_object_add(o, "RSS", ucv_uint64_new(e->rss));
+	ucv_object_add(o, "%MEM", ucv_double_new(e->mem));
+	ucv_object_add(o, "%CPU", ucv_double_new(e->cpu));
+	ucv_object_add(o, "COMMAND", ucv_string_new(e->command));
+
+	return o;
+}
+
+static void
+proc_store_samples(struct proc_entry *list, size_t n, uint64_t total)
+{
+	struct proc_sample *samples;
+	size_t i;
+
+	samples = calloc(n ? n : 1, sizeof(*samples));
+
+	if (!samples)
+		return;
+
+	for (i = 0; i < n; i++) {
+		samples[i].pid = list[i].pid;
+		samples[i].start = list[i].start;
+		samples[i].ticks = list[i].ticks;
+	}
+
+	free(proc_prev.samples);
+
+	proc_prev.samples = samples;
+	proc_prev.count = n;
+	proc_prev.total = total;
+}
+
+/*
+ * process_list([opts]) - list running processes
+ *
+ * The cpu usage is measured against the state seen by the previous call,
+ * processes not seen before report their average usage since their start.
+ * Supported options are "sort" (one of the field names, prefixed with "-"
+ * for descending order) and "limit".
+ */
+__hidden uc_value_t *
+uc_luci_process_list(uc_vm_t *vm, size_t nargs) {
+	uc_value_t *opts = uc_fn_arg(0), *v, *rv;
+	size_t i, n = 0, size = 0, limit = SIZE_MAX;
+	struct proc_entry *list = NULL, *tmp, e;
+	const struct proc_sample *prev;
+	struct proc_user users[64];
+	size_t nusers = 0;
+	uint64_t total, dtotal, uptime;
+	long hz, ncpu, pagesize;
+	struct sysinfo si;
+	struct dirent *de;
+	struct stat s;
+	char path[32];
+	double memtotal;
+	DIR *d;
+
+	if (opts && ucv_type(opts) != UC_OBJECT)
+		return NULL;
+
+	proc_sort_key = PROC_SORT_NONE;
+	proc_sort_desc = false;
+
+	v = ucv_object_get(opts, "sort", NULL);
+
+	if (ucv_type(v) == UC_STRING && *ucv_string_get(v)) {
+		proc_sort_key = proc_parse_sort(ucv_string_get(v), &proc_sort_desc);
+
+		if (proc_sort_key == PROC_SORT_NONE)
+			return NULL;
+	}
+
+	v = ucv_object_get(opts, "limit", NULL);
+
+	if (ucv_type(v) == UC_INTEGER && ucv_int64_get(v) > 0)
+		limit = ucv_int64_get(v);
+
+	d = opendir("/proc");
+
+	if (!d)
+		return NULL;
+
+	hz = sysconf(_SC_CLK_TCK);
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	pagesize = sysconf(_SC_PAGESIZE);
+
+	if (hz <= 0)
+		hz = 100;
+
+	if (ncpu <= 0)
+		ncpu = 1;
+
+	if (sysinfo(&si))
+		memset(&si, 0, sizeof(si));
+
+	memtotal = (double)si.totalram * si.mem_unit / 1024;
+	uptime = (uint64_t)si.uptime * hz;
+	total = proc_total_ticks();
+	dtotal = (proc_prev.total && total > proc_prev.total) ? total - proc_prev.total : 0;
+
+	while ((de = readdir(d)) != NULL) {
+		if (!isdigit((unsigned char)de->d_name[0]))
+			continue;
+
+		memset(&e, 0, sizeof(e));
+
+		if (!proc_parse_stat(atoi(de->d_name), &e))
+			continue;
+
+		snprintf(path, sizeof(path), "/proc/%d", e.pid);
+
+		if (stat(path, &s))
+			continue;
+
+		e.uid = s.st_uid;
+
+		proc_parse_statm(e.pid, &e, pagesize);
+
+		prev = proc_prev_sample(e.pid);
+
+		if (prev && prev->start == e.start && dtotal)
+			e.cpu = (double)(e.ticks - prev->ticks) * 100 / dtotal;
+		else if (uptime > e.start)
+			e.cpu = (double)e.ticks * 100 / ((uptime - e.start) * ncpu);
+
+		e.cpu = (e.cpu > 100) ? 100 : (int)(e.cpu * 10 + 0.5) / 10.0;
+		e.mem = memtotal ? (int)(e.vsz * 1000 / memtotal + 0.5) / 10.0 : 0;
+
+		if (n == size) {
+			tmp = realloc(list, (size ? size * 2 : 128) * sizeof(*list));
+
+			if (!tmp)
+				break;
+
+			list = tmp;
+			size = size ? size * 2 : 128;
+		}
+
+		list[n++] = e;
+	}
+
+	closedir(d);
+
+	qsort(list, n, sizeof(*list), proc_cmp_pid);
+	proc_store_samples(list, n, total);
+
+	/* only sorting by name needs the names of all processes */
+	if (proc_sort_key == PROC_SORT_USER || proc_sort_key == PROC_SORT_COMMAND)
+		for (i = 0; i < n; i++)
+			proc_resolve(&list[i], users, &nusers);
+
+	if (proc_sort_key != PROC_SORT_NONE)
+		qsort(list, n, sizeof(*list), proc_compare);
+
+	rv = ucv_array_new(vm);
+
+	for (i = 0; i < n; i++) {
+		if (i < limit) {
+			proc_resolve(&list[i], users, &nusers);
+			ucv_array_push(rv, proc_entry_new(vm, &list[i]));
+		}
+
+		free(list[i].user);
+		free(list[i].command);
+	}
+
+	for (i = 0; i < nusers; i++)
+		free(users[i].name);
+
+	free(list);
+
+	return rv;
+}
@@ -0,0 +1,33 @@
+/*
+ * LuCI core module helpers - ucode binding
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _LUCI_SYS_H_
+#define _LUCI_SYS_H_
+
+#include <ucode/module.h>
+
+#ifndef __hidden
+#define __hidden __attribute__((visibility("hidden")))
+#endif
+
+__hidden uc_value_t *uc_luci_conntrack(uc_vm_t *vm, size_t nargs);
+__hidden uc_value_t *uc_luci_process_list(uc_vm_t *vm, size_t nargs);
+
+__hidden uc_value_t *uc_luci_hash64(uc_vm_t *vm, size_t nargs);
+__hidden uc_value_t *uc_luci_hash64_state(uc_vm_t *vm, size_t nargs);
+__hidden void luci_hash64_init(uc_vm_t *vm);
+
+#endif
@@ -18,6 +18,23 @@
 
 #include "lib/lmo.h"
 
+#include <pthread.h>
+
+struct po_entry {
+	lmo_entry_t e;
+	char *key;
+};
+
+/* A compiled catalog kept in memory until it is written out */
+struct catalog {
+	const char *path;
+	char *data;
+	size_t offset;
+	size_t size;
+	struct po_entry *entries;
+	int n_entries;
+};
+
 static void die(const char *msg)
 {
 	fprintf(stderr, "Error: %s\n", msg);
@@ -26,22 +43,14 @@ static void die(const char *msg)
 
 static void usage(const char *name)
 {
-	fprintf(stderr, "Usage: %s input.po output.lmo\n", name);
+	fprintf(stderr,
+		"Usage: %s input.po output.lmo\n"
+		"       %s --batch [-j jobs] input.po output.lmo [input.po output.lmo ...]\n"
+		"       %s --merge [-j jobs] output.lmo input.po [input.po ...]\n",
+		name, name, name);
 	exit(1);
 }
 
-static void print(const void *ptr, size_t size, size_t nmemb, FILE *stream)
-{
-	int i;
-
-	if (fwrite(ptr, size, nmemb, stream) == 0)
-		die("Failed to write");
-
-	for (i = 0; i <	((4 - (size % 4)) % 4); i++)
-		if (fputc(0, stream))
-			die("Failed to write");
-}
-
 static int extract_string(const char *src, char *dest, int len)
 {
 	int pos = 0;
@@ -51,7 +60,7 @@ static int extract_string(const char *src, char *dest, int len)
 	if (*src == '#')
 		return -1;
 
-	for( pos = 0; (pos < strlen(src)) && (pos < len); pos++ )
+	for( pos = 0; src[pos] && (pos < len); pos++ )
 	{
 		if( (off == -1) && (src[pos] == '"') )
 		{
@@ -93,8 +102,8 @@ static int extract_string(const char *src, char *dest, int len)
 
 static int cmp_index(const void *a, const void *b)
 {
-	uint32_t x = ((const lmo_entry_t *)a)->key_id;
-	uint32_t y = ((const lmo_entry_t *)b)->key_id;
+	uint32_t x = ((const struct po_entry *)a)->e.key_id;
+	uint32_t y = ((const struct po_entry *)b)->e.key_id;
 
 	if (x < y)
 		return -1;
@@ -104,25 +113,135 @@ static int cmp_index(const void *a, const void *b)
 	return 0;
 }
 
+static void print_key(const char *key, FILE *out)
+{
+	for (; *key; key++)
+		if ((unsigned char)*key < ' ')
+			fprintf(out, "\\%03o", (unsigned char)*key);
+		else
+			fputc(*key, out);
+}
+
+/*
+ * Different keys mapping to the same hash make one of the translations
+ * unreachable, report them after sorting put the entries side by side.
+ */
+static void check_collisions(struct catalog *cat)
+{
+	struct po_entry *a, *b;
+	int i;
+
+	for (i = 1; i < cat->n_entries; i++)
+	{
+		a = &cat->entries[i - 1];
+		b = &cat->entries[i];
+
+		if (a->e.key_id != b->e.key_id || !a->key || !b->key ||
+		    !strcmp(a->key, b->key))
+			continue;
+
+		fprintf(stderr, "Warning: %s: hash collision 0x%08x between \"",
+		        cat->path, b->e.key_id);
+		print_key(a->key, stderr);
+		fprintf(stderr, "\" and \"");
+		print_key(b->key, stderr);
+		fprintf(stderr, "\"\n");
+	}
+}
+
+static void add_entry(struct catalog *cat, uint32_t key_id, uint32_t val_id,
+                      const char *key, const char *val, size_t len)
+{
+	size_t padded = len + ((4 - (len % 4)) % 4);
+	struct po_entry *entry;
+
+	cat->entries = realloc(cat->entries, (cat->n_entries + 1) * sizeof(*entry));
+
+	while (cat->offset + padded > cat->size)
+	{
+		cat->size = cat->size ? cat->size * 2 : 16384;
+		cat->data = realloc(cat->data, cat->size);
+
+		if (!cat->data)
+			die("Out of memory");
+	}
+
+	if (!cat->entries || (key && !(key = strdup(key))))
+		die("Out of memory");
+
+	entry = &cat->entries[cat->n_entries++];
+	entry->e.key_id = key_id;
+	entry->e.val_id = val_id;
+	entry->e.offset = cat->offset;
+	entry->e.length = len;
+	entry->key = (char *)key;
+
+	memcpy(cat->data + cat->offset, val, len);
+	memset(cat->data + cat->offset + len, 0, padded - len);
+	cat->offset += padded;
+}
+
+static void free_catalog(struct catalog *cat)
+{
+	int i;
+
+	for (i = 0; i < cat->n_entries; i++)
+		free(cat->entries[i].key);
+
+	free(cat->entries);
+	free(cat->data);
+
+	cat->entries = NULL;
+	cat->data = NULL;
+	cat->n_entries = 0;
+	cat->offset = cat->size = 0;
+}
+
 static void print_uint32(uint32_t x, FILE *out)
 {
 	uint32_t y = htonl(x);
-	print(&y, sizeof(uint32_t), 1, out);
+
+	if (fwrite(&y, sizeof(y), 1, out) != 1)
+		die("Failed to write");
 }
 
-static void print_index(void *array, int n, FILE *out)
+/* Write the catalog in LMO format, no file is created for empty catalogs */
+static int write_catalog(struct catalog *cat, const char *path)
 {
-	lmo_entry_t *e;
+	FILE *out;
+	int i;
 
-	qsort(array, n, sizeof(*e), cmp_index);
+	if (cat->offset == 0)
+	{
+		unlink(path);
+		return 0;
+	}
 
-	for (e = array; n > 0; n--, e++)
+	if ((out = fopen(path, "w")) == NULL)
 	{
-		print_uint32(e->key_id, out);
-		print_uint32(e->val_id, out);
-		print_uint32(e->offset, out);
-		print_uint32(e->length, out);
+		fprintf(stderr, "Error: Unable to open %s: %s\n", path, strerror(errno));
+		return -1;
 	}
+
+	if (fwrite(cat->data, cat->offset, 1, out) != 1)
+		die("Failed to write");
+
+	for (i = 0; i < cat->n_entries; i++)
+	{
+		print_uint32(cat->entries[i].e.key_id, out);
+		print_uint32(cat->entries[i].e.val_id, out);
+		print_uint32(cat->entries[i].e.offset, out);
+		print_uint32(cat->entries[i].e.length, out);
+	}
+
+	print_uint32(cat->offset, out);
+	fflush(out);
+	fsync(fileno(out));
+
+	if (fclose(out))
+		die("Failed to write");
+
+	return 0;
 }
 
 enum fieldtype {
@@ -143,15 +262,10 @@ struct msg {
 	char **cur;
 };
 
-static void *array = NULL;
-static int n_entries = 0;
-static size_t offset = 0;
-
-static void print_msg(struct msg *msg, FILE *out)
+static void print_msg(struct msg *msg, struct catalog *cat)
 {
 	char key[4096], *field, *p;
 	uint32_t key_id, val_id;
-	lmo_entry_t *entry;
 	size_t len;
 	int esc, i;
 
@@ -175,24 +289,8 @@ static void print_msg(struct msg *msg, FILE *out)
 			len = strlen(msg->val[i]);
 			val_id = sfh_hash(msg->val[i], len, len);
 
-			if (key_id != val_id) {
-				n_entries++;
-				array = realloc(array, n_entries * sizeof(lmo_entry_t));
-
-				if (!array)
-					die("Out of memory");
-
-				entry = (lmo_entry_t *)array + n_entries - 1;
-				entry->key_id = key_id;
-				entry->val_id = msg->plural_num + 1;
-				entry->offset = offset;
-				entry->length = strlen(msg->val[i]);
-
-				len = entry->length + ((4 - (entry->length % 4)) % 4);
-
-				print(msg->val[i], entry->length, 1, out);
-				offset += len;
-			}
+			if (key_id != val_id)
+				add_entry(cat, key_id, msg->plural_num + 1, key, msg->val[i], len);
 		}
 	}
 	else if (msg->val[0]) {
@@ -203,23 +301,7 @@ static void print_msg(struct msg *msg, FILE *out)
 
 					if (!strncasecmp(field, "Plural-Forms: ", 14)) {
 						field += 14;
-
-						n_entries++;
-						array = realloc(array, n_entries * sizeof(lmo_entry_t));
-
-						if (!array)
-							die("Out of memory");
-
-						entry = (lmo_entry_t *)array + n_entries - 1;
-						entry->key_id = 0;
-						entry->val_id = 0;
-						entry->offset = offset;
-						entry->length = strlen(field);
-
-						len = entry->length + ((4 - (entry->length % 4)) % 4);
-
-						print(field, entry->length, 1, out);
-						offset += len;
+						add_entry(cat, 0, 0, NULL, field, strlen(field));
 						break;
 					}
 
@@ -244,16 +326,20 @@ static void print_msg(struct msg *msg, FILE *out)
 	memset(msg, 0, sizeof(*msg));
 }
 
-int main(int argc, char *argv[])
+/* Parse the given .po file into a sorted in-memory catalog */
+static int compile(struct catalog *cat)
 {
 	struct msg msg = { .plural_num = -1 };
 	char line[4096], tmp[4096];
-	FILE *in, *out;
 	ssize_t len;
+	FILE *in;
 	int eof;
 
-	if ((argc != 3) || ((in = fopen(argv[1], "r")) == NULL) || ((out = fopen(argv[2], "w")) == NULL))
-		usage(argv[0]);
+	if ((in = fopen(cat->path, "r")) == NULL)
+	{
+		fprintf(stderr, "Error: Unable to open %s: %s\n", cat->path, strerror(errno));
+		return -1;
+	}
 
 	while (1) {
 		line[0] = 0;
@@ -261,7 +347,7 @@ int main(int argc, char *argv[])
 
 		if (!strncmp(line, "msgctxt \"", 9)) {
 			if (msg.id || msg.val[0])
-				print_msg(&msg, out);
+				print_msg(&msg, cat);
 			else
 				free(msg.ctxt);
 
@@ -271,7 +357,7 @@ int main(int argc, char *argv[])
 		}
 		else if (eof || !strncmp(line, "msgid \"", 7)) {
 			if (msg.id || msg.val[0])
-				print_msg(&msg, out);
+				print_msg(&msg, cat);
 			else
 				free(msg.id);
 
@@ -318,18 +404,225 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	print_index(array, n_entries, out);
+	fclose(in);
+
+	qsort(cat->entries, cat->n_entries, sizeof(*cat->entries), cmp_index);
+	check_collisions(cat);
+
+	return 0;
+}
+
+
+/*
+ * Batch and merge mode compile the inputs in parallel, every worker picks
+ * the next pending catalog until all are done.
+ */
+static struct catalog *jobs;
+static int n_jobs;
+static int next_job;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *worker(void *arg)
+{
+	int i, *failed = arg;
+
+	while (1)
+	{
+		pthread_mutex_lock(&job_lock);
+		i = next_job++;
+		pthread_mutex_unlock(&job_lock);
+
+		if (i >= n_jobs)
+			break;
+
+		if (compile(&jobs[i]))
+			*failed = 1;
+	}
+
+	return NULL;
+}
+
+static int compile_all(long threads)
+{
+	pthread_t *pool;
+	int *failed;
+	long i;
+	int rv = 0;
+
+	if (threads > n_jobs)
+		threads = n_jobs;
+
+	if (threads < 1)
+		threads = 1;
+
+	pool = calloc(threads, sizeof(*pool));
+	failed = calloc(threads, sizeof(*failed));
+
+	if (!pool || !failed)
+		die("Out of memory");
+
+	for (i = 1; i < threads; i++)
+		if (pthread_create(&pool[i], NULL, worker, &failed[i]))
+			break;
+
+	worker(&failed[0]);
+
+	while (--i > 0)
+		pthread_join(pool[i], NULL);
+
+	for (i = 0; i < threads; i++)
+		rv |= failed[i];
+
+	free(pool);
+	free(failed);
+
+	return rv ? -1 : 0;
+}
+
+/*
+ * Combine all catalogs into one archive so that lookups need a single
+ * index search instead of one per module. The first definition of a key
+ * wins, like translations of the same string usually are identical in
+ * all modules, only differing keys sharing a hash are reported.
+ */
+static void merge(struct catalog *dst)
+{
+	struct po_entry *e;
+	int i, j, k;
+
+	for (i = 0; i < n_jobs; i++)
+	{
+		for (j = 0; j < jobs[i].n_entries; j++)
+		{
+			e = &jobs[i].entries[j];
+
+			add_entry(dst, e->e.key_id, e->e.val_id, e->key,
+			          jobs[i].data + e->e.offset, e->e.length);
+		}
+	}
+
+	qsort(dst->entries, dst->n_entries, sizeof(*dst->entries), cmp_index);
+	check_collisions(dst);
+
+	/* qsort() is not stable but offsets grow in input order */
+	for (i = 0, k = 0; i < dst->n_entries; i++)
+	{
+		if (k > 0 && dst->entries[k - 1].e.key_id == dst->entries[i].e.key_id)
+		{
+			if (dst->entries[i].e.offset < dst->entries[k - 1].e.offset)
+			{
+				free(dst->entries[k - 1].key);
+				dst->entries[k - 1] = dst->entries[i];
+			}
+			else
+			{
+				free(dst->entries[i].key);
+			}
+
+			continue;
+		}
+
+		dst->entries[k++] = dst->entries[i];
+	}
+
+	dst->n_entries = k;
+}
+
+static int batch(int argc, char *argv[], int merging)
+{
+	struct catalog merged = { 0 };
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	const char *name = argv[0], *output = NULL;
+	int i, opt, rv = 0;
+
+	while ((opt = getopt(argc, argv, "j:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'j':
+			threads = strtol(optarg, NULL, 10);
+			break;
+
+		default:
+			usage(name);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
 
-	if (offset > 0) {
-		print_uint32(offset, out);
-		fsync(fileno(out));
-		fclose(out);
+	if (merging)
+	{
+		if (argc < 2)
+			usage(name);
+
+		output = *argv++;
+		argc--;
 	}
-	else {
-		fclose(out);
-		unlink(argv[2]);
+	else if (argc % 2)
+	{
+		usage(name);
 	}
 
-	fclose(in);
+	n_jobs = merging ? argc : argc / 2;
+	jobs = calloc(n_jobs ? n_jobs : 1, sizeof(*jobs));
+
+	if (!jobs)
+		die("Out of memory");
+
+	for (i = 0; i < n_jobs; i++)
+		jobs[i].path = merging ? argv[i] : argv[i * 2];
+
+	if (compile_all(threads))
+		return 1;
+
+	if (merging)
+	{
+		merged.path = output;
+		merge(&merged);
+		rv = write_catalog(&merged, output);
+		free_catalog(&merged);
+	}
+	else
+	{
+		for (i = 0; i < n_jobs; i++)
+			if (write_catalog(&jobs[i], argv[i * 2 + 1]))
+				rv = -1;
+	}
+
+	for (i = 0; i < n_jobs; i++)
+		free_catalog(&jobs[i]);
+
+	free(jobs);
+
+	return rv ? 1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct catalog cat = { 0 };
+
+	if (argc > 1 && !strcmp(argv[1], "--batch"))
+	{
+		argv[1] = argv[0];
+		return batch(argc - 1, argv + 1, 0);
+	}
+
+	if (argc > 1 && !strcmp(argv[1], "--merge"))
+	{
+		argv[1] = argv[0];
+		return batch(argc - 1, argv + 1, 1);
+	}
+
+	if (argc != 3)
+		usage(argv[0]);
+
+	cat.path = argv[1];
+
+	if (compile(&cat) || write_catalog(&cat, argv[2]))
+		usage(argv[0]);
+
+	free_catalog(&cat);
+
 	return(0);
 }
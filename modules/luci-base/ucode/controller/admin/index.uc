@@ -152,9 +152,9 @@ return {
 
 	action_menu: function() {
 		const session = dispatcher.is_authenticated({ methods: [ 'cookie:sysauth_https', 'cookie:sysauth_http' ] });
-		const menu = dispatcher.menu_json(session?.acls ?? {}) ?? {};
+		const menu = dispatcher.menu_cache(session?.acls ?? {}) ?? '{}';
 
 		http.prepare_content('application/json; charset=UTF-8');
-		http.write_json(menu);
+		http.write(menu);
 	}
 };
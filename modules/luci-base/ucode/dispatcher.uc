@@ -1,13 +1,13 @@
 // Copyright 2022 Jo-Philipp Wich <jo@mein.io>
 // Licensed to the public under the Apache License 2.0.
 
-import { open, readfile, stat, glob, lsdir, unlink, basename } from 'fs';
+import { open, readfile, stat, glob, lsdir, unlink, rename, basename } from 'fs';
 import { striptags, entityencode } from 'html';
 import { connect } from 'ubus';
 import { cursor } from 'uci';
 import { openlog, syslog, closelog, LOG_INFO, LOG_WARNING, LOG_AUTHPRIV } from 'log';
 
-import { hash, load_catalog, change_catalog, translate, ntranslate, getuid } from 'luci.core';
+import { hash64, hash64_state, load_catalog, change_catalog, translate, ntranslate, getuid } from 'luci.core';
 import { revision as luciversion, branch as luciname } from 'luci.version';
 import { default as LuCIRuntime } from 'luci.runtime';
 import { urldecode, urlencode } from 'luci.http';
@@ -17,8 +17,9 @@ let ubus = connect();
 let uci = cursor();
 
 let indexcache = "/tmp/luci-indexcache";
+let menucache = "/tmp/luci-menucache";
 
-let http, runtime, tree, luabridge;
+let http, runtime, tree, tree_hash, tree_stamp, tree_checked, luabridge;
 
 function error404(msg) {
 	http.status(404, 'Not Found');
@@ -331,19 +332,57 @@ function check_acl_depends(require_groups, groups) {
 }
 
 function hash_filelist(files) {
-	let hashval = 0x1b756362;
+	let state = hash64_state();
 
 	for (let file in files) {
 		let st = stat(file);
 
 		if (st)
-			hashval = hash(sprintf("%x|%x|%x", st.ino, st.mtime, st.size), hashval);
+			state.update(sprintf("%s|%x|%x|%x\n", file, st.ino, st.mtime, st.size));
 	}
 
-	return hashval;
+	return state.digest();
 }
 
-function build_pagetree() {
+function pagetree_files() {
+	return glob('/usr/share/luci/menu.d/*.json', '/usr/lib/lua/luci/controller/*.lua', '/usr/lib/lua/luci/controller/*/*.lua');
+}
+
+function node_weight(node) {
+	let weight = min(node.order ?? 9999, 9999);
+
+	if (node.auth?.login)
+		weight += 10000;
+
+	return weight;
+}
+
+/* Precompute node weights and the order in which children are considered
+ * as firstchild candidates so that resolve_firstchild() can stop at the
+ * first eligible one. */
+function index_pagetree(node) {
+	let order = [], pos = {};
+
+	for (let name, child in node.children) {
+		index_pagetree(child);
+
+		if (child.title && type(child.action) == 'object' &&
+		    (child.action.type == 'firstchild' || !child.firstchild_ineligible)) {
+			pos[name] = length(order);
+			push(order, name);
+		}
+	}
+
+	node.weight = node_weight(node);
+
+	if (length(order))
+		node.firstchild_order = sort(order, (a, b) =>
+			(node.children[a].weight - node.children[b].weight) || (pos[a] - pos[b]));
+
+	return node;
+}
+
+function build_pagetree(files, hashval) {
 	let tree = { action: { type: 'firstchild' } };
 
 	let schema = {
@@ -360,15 +399,14 @@ function build_pagetree() {
 		firstchild_ineligible: 'bool'
 	};
 
-	let files = glob('/usr/share/luci/menu.d/*.json', '/usr/lib/lua/luci/controller/*.lua', '/usr/lib/lua/luci/controller/*/*.lua');
 	let cachefile;
 
 	if (indexcache) {
-		cachefile = sprintf('%s.%08x.json', indexcache, hash_filelist(files));
+		cachefile = sprintf('%s.%s.json', indexcache, hashval);
 
 		let res = read_cachefile(cachefile, read_jsonfile);
 
-		if (res)
+		if (res?.indexed)
 			return res;
 
 		for (let path in glob(indexcache + '.*.json'))
@@ -421,6 +459,9 @@ function build_pagetree() {
 		}
 	}
 
+	index_pagetree(tree);
+	tree.indexed = true;
+
 	if (cachefile) {
 		let fd = open(cachefile, 'w', 0600);
 
@@ -433,9 +474,20 @@ function build_pagetree() {
 	return tree;
 }
 
-function apply_tree_acls(node, acl) {
+/* Identity of the index cache file the current tree was built from or
+ * stored to, null if there is none. */
+function indexcache_stamp(hashval) {
+	let st = indexcache ? stat(sprintf('%s.%s.json', indexcache, hashval)) : null;
+
+	return st ? sprintf('%x|%x|%x', st.inode, st.mtime, st.size) : null;
+}
+
+function apply_tree_acls(node, acl, recheck) {
 	for (let name, spec in node?.children)
-		apply_tree_acls(spec, acl);
+		apply_tree_acls(spec, acl, recheck);
+
+	if (recheck && node?.depends && node !== tree)
+		node.satisfied = check_depends(node);
 
 	if (node?.depends?.acl) {
 		switch (check_acl_depends(node.depends.acl, acl["access-group"])) {
@@ -445,8 +497,31 @@ function apply_tree_acls(node, acl) {
 	}
 }
 
+/* The page tree may have been inherited from the server process, validate
+ * it against the menu files once per request handler. */
+function load_pagetree() {
+	if (!tree_checked) {
+		let files = pagetree_files();
+		let hashval = hash_filelist(files);
+
+		/* package installs and uci-defaults flush the index cache to force
+		 * a rebuild, the tree inherited from the server process is only
+		 * valid while its cache file is still the same one */
+		if (tree == null || hashval !== tree_hash ||
+		    (indexcache && (tree_stamp == null || indexcache_stamp(hashval) !== tree_stamp))) {
+			tree = build_pagetree(files, hashval);
+			tree_hash = hashval;
+			tree_stamp = indexcache_stamp(hashval);
+		}
+
+		tree_checked = true;
+	}
+
+	return tree;
+}
+
 function menu_json(acl) {
-	tree ??= build_pagetree();
+	load_pagetree();
 
 	if (acl)
 		apply_tree_acls(tree, acl);
@@ -454,6 +529,16 @@ function menu_json(acl) {
 	return tree;
 }
 
+function acl_fingerprint(acl) {
+	let groups = acl?.["access-group"] ?? {};
+	let state = hash64_state();
+
+	for (let group in sort(keys(groups)))
+		state.update(sprintf('%s:%J\n', group, sort([ ...groups[group] ])));
+
+	return state.digest();
+}
+
 function ctx_append(ctx, name, node) {
 	ctx.path ??= [];
 	push(ctx.path, name);
@@ -469,17 +554,36 @@ function ctx_append(ctx, name, node) {
 	return ctx;
 }
 
+/* Sessions are looked up once per request, is_authenticated() is invoked
+ * for every node along the resolved path and for each auth method. */
+let session_cache = {};
+
+function session_lookup(sid) {
+	if (!(sid in session_cache)) {
+		let sdat = ubus.call("session", "get", { ubus_rpc_session: sid });
+		let sacl = null;
+
+		/* skip the ACL query for expired or unauthenticated sessions */
+		if (type(sdat?.values?.token) == 'string')
+			sacl = ubus.call("session", "access", { ubus_rpc_session: sid });
+		else
+			sdat = null;
+
+		session_cache[sid] = sdat ? { values: sdat.values, acls: sacl } : false;
+	}
+
+	return session_cache[sid];
+}
+
 function session_retrieve(sid, allowed_users) {
-	let sdat = ubus.call("session", "get", { ubus_rpc_session: sid });
-	let sacl = ubus.call("session", "access", { ubus_rpc_session: sid });
+	let sdat = session_lookup(sid);
 
-	if (type(sdat?.values?.token) == 'string' &&
-	    (!length(allowed_users) || sdat?.values?.username in allowed_users)) {
+	if (sdat && (!length(allowed_users) || sdat.values.username in allowed_users)) {
 		// uci:set_session_id(sid)
 		return {
 			sid,
 			data: sdat.values,
-			acls: length(sacl) ? sacl : {}
+			acls: length(sdat.acls) ? sdat.acls : {}
 		};
 	}
 
@@ -495,6 +599,67 @@ function randomid(num_bytes) {
 	return hexenc(data);
 }
 
+/* Copy of the given menu node without the lookup index fields added by
+ * index_pagetree(), these are of no use to clients. */
+function menu_export(node) {
+	let rv = {};
+
+	for (let k, v in node) {
+		if (k == 'weight' || k == 'firstchild_order' || k == 'indexed')
+			continue;
+
+		if (k == 'children') {
+			rv.children = {};
+
+			for (let name, child in v)
+				rv.children[name] = menu_export(child);
+		}
+		else {
+			rv[k] = v;
+		}
+	}
+
+	return rv;
+}
+
+/* Serialized menu filtered for the given ACLs. Results are cached per page
+ * tree, set of ACL groups and state of the uci configuration directory, the
+ * depends of all nodes are reevaluated on a cache miss. */
+function menu_cache(acl) {
+	load_pagetree();
+
+	let cst = stat('/etc/config');
+	let stamp = hash64(sprintf('%x|%x|%x', cst?.inode, cst?.mtime, cst?.size));
+	let prefix = sprintf('%s.%s.', menucache, tree_hash);
+	let suffix = sprintf('.%s.json', stamp);
+	let cachefile = sprintf('%s%s%s', prefix, acl_fingerprint(acl), suffix);
+	let data = read_cachefile(cachefile, readfile);
+
+	if (data)
+		return data;
+
+	for (let path in glob(menucache + '.*.json'))
+		if (index(path, prefix) != 0 || substr(path, -length(suffix)) != suffix)
+			unlink(path);
+
+	apply_tree_acls(tree, acl, true);
+	data = sprintf('%J', menu_export(tree));
+
+	/* a configuration change within the same second could go unnoticed */
+	if (cst && cst.mtime < time()) {
+		let tmpfile = `${cachefile}.${randomid(4)}`;
+		let fd = open(tmpfile, 'w', 0600);
+
+		if (fd) {
+			fd.write(data);
+			fd.close();
+			rename(tmpfile, cachefile);
+		}
+	}
+
+	return data;
+}
+
 function session_setup(user, pass, path) {
 	let timeout = uci.get('luci', 'sauth', 'sessiontime');
 	let login = ubus.call("session", "login", {
@@ -522,6 +687,8 @@ function session_setup(user, pass, path) {
 }
 
 function set_auth_required_plugins(session, plugin_ids) {
+	delete session_cache[session.sid];
+
 	ubus.call("session", "set", {
 		ubus_rpc_session: session.sid,
 		values: {
@@ -562,15 +729,6 @@ function is_authenticated(auth) {
 	return null;
 }
 
-function node_weight(node) {
-	let weight = min(node.order ?? 9999, 9999);
-
-	if (node.auth?.login)
-		weight += 10000;
-
-	return weight;
-}
-
 function clone(src) {
 	switch (type(src)) {
 	case 'array':
@@ -590,9 +748,9 @@ function clone(src) {
 }
 
 function resolve_firstchild(node, session, login_allowed, ctx) {
-	let candidate, candidate_ctx;
+	for (let name in node.firstchild_order) {
+		let child = node.children[name];
 
-	for (let name, child in node.children) {
 		if (!child.satisfied)
 			continue;
 
@@ -602,35 +760,22 @@ function resolve_firstchild(node, session, login_allowed, ctx) {
 		let cacl = child.depends?.acl;
 		let login = !session && (login_allowed || child.auth?.login);
 
-		if (login || check_acl_depends(cacl, session?.acls?.["access-group"]) != null) {
-			if (child.title && type(child.action) == "object") {
-				let child_ctx = ctx_append(clone(ctx), name, child);
-				if (child.action.type == "firstchild") {
-					if (!candidate || node_weight(candidate) > node_weight(child)) {
-						let have_grandchild = resolve_firstchild(child, session, login, child_ctx);
-						if (have_grandchild) {
-							candidate = child;
-							candidate_ctx = child_ctx;
-						}
-					}
-				}
-				else if (!child.firstchild_ineligible) {
-					if (!candidate || node_weight(candidate) > node_weight(child)) {
-						candidate = child;
-						candidate_ctx = child_ctx;
-					}
-				}
-			}
-		}
-	}
+		if (!login && check_acl_depends(cacl, session?.acls?.["access-group"]) == null)
+			continue;
 
-	if (!candidate)
-		return false;
+		let child_ctx = ctx_append(clone(ctx), name, child);
 
-	for (let k, v in candidate_ctx)
-		ctx[k] = v;
+		if (child.action.type == "firstchild" &&
+		    !resolve_firstchild(child, session, login, child_ctx))
+			continue;
 
-	return true;
+		for (let k, v in child_ctx)
+			ctx[k] = v;
+
+		return true;
+	}
+
+	return false;
 }
 
 function resolve_page(tree, request_path) {
@@ -891,6 +1036,7 @@ function run_action(request_path, lang, tree, resolved, action) {
 
 dispatch = function(_http, path) {
 	http = _http;
+	session_cache = {};
 
 	let version = determine_version();
 	let lang = determine_request_language();
@@ -911,6 +1057,7 @@ dispatch = function(_http, path) {
 			load_luabridge,
 			lookup,
 			menu_json,
+			menu_cache,
 			build_url,
 			randomid,
 			error404,
@@ -1008,6 +1155,7 @@ dispatch = function(_http, path) {
 						// Additional auth failed or not provided
 						// Destroy the temporary session to prevent bypass
 						ubus.call("session", "destroy", { ubus_rpc_session: session.sid });
+						delete session_cache[session.sid];
 
 						resolved.ctx.path = [];
 						http.status(403, 'Forbidden');
@@ -1111,4 +1259,22 @@ dispatch = function(_http, path) {
 	}
 };
 
+/* Build the page tree ahead of time, request handlers forked from the calling
+ * process inherit it and merely revalidate it against the menu files. */
+export function preload() {
+	try {
+		let files = pagetree_files();
+
+		tree_hash = hash_filelist(files);
+		tree = build_pagetree(files, tree_hash);
+		tree_stamp = indexcache_stamp(tree_hash);
+	}
+	catch (e) {
+		tree = tree_hash = tree_stamp = null;
+	}
+
+	/* do not leak configurations loaded by depends checks into handlers */
+	uci = cursor();
+}
+
 export default dispatch;
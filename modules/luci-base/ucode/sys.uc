@@ -1,151 +1,153 @@
 // Copyright 2022 Jo-Philipp Wich <jo@mein.io>
 // Licensed to the public under the Apache License 2.0.
 
-import { basename, readlink, readfile, open, popen, stat, glob } from 'fs';
-
-export function process_list() {
-	const top = popen('/bin/busybox top -bn1');
-	let line, list = [];
-
-	for (let line = top.read('line'); length(line); line = top.read('line')) {
-		let m = match(trim(line), /^([0-9]+) +([0-9]+) +(.+) +([RSDZTWI][<NW ][<N ]) +([0-9]+m?) +([0-9]+%) +([0-9]+%) +(.+)$/);
-
-		if (m && m[8] != '/bin/busybox top -bn1') {
-			push(list, {
-				PID: m[1],
-				PPID: m[2],
-				USER: trim(m[3]),
-				STAT: m[4],
-				VSZ: m[5],
-				'%MEM': m[6],
-				'%CPU': m[7],
-				COMMAND: m[8]
-			});
-		}
-	}
+import { basename, readlink, readfile, stat, lsdir } from 'fs';
+import { conntrack, process_list as native_process_list } from 'luci.core';
+
+// opts may hold sort and limit, see process_list() in luci.core
+export function process_list(opts) {
+	return native_process_list(opts) ?? [];
+};
 
-	top.close();
+// opts may hold family, proto, address, port, sort, offset and limit,
+// see conntrack() in luci.core
+export function conntrack_list(callback, opts) {
+	const ct = conntrack(opts);
 
-	return list;
+	if (!ct)
+		return callback ? true : [];
+
+	if (!callback)
+		return ct.entries;
+
+	for (let e in ct.entries)
+		callback(e);
+
+	return true;
 };
 
-export function conntrack_list(callback) {
-	const etcpr = open('/etc/protocols');
-	const protos = {};
+// Init script metadata is kept across calls and revalidated by the mtime of
+// the scripts and of the init.d and rc.d directories. Stat results changed
+// within the second of the scan are not trusted since the mtime resolution
+// would hide a subsequent modification.
+const init_cache = { names: null, dir: null, rc: null, links: null, scripts: {} };
 
-	if (etcpr) {
-		for (let line = etcpr.read('line'); length(line); line = etcpr.read('line')) {
-			const m = match(line, /^([^# \t\n]+)\s+([0-9]+)\s+/);
+function stat_key(s) {
+	return s ? { inode: s.inode, mtime: s.mtime, size: s.size, scanned: time() } : null;
+}
 
-			if (m)
-				protos[m[2]] = m[1];
-		}
+function stat_fresh(s, key) {
+	return !!(s && key && s.inode == key.inode && s.mtime == key.mtime &&
+		s.size == key.size && key.mtime < key.scanned);
+}
 
-		etcpr.close();
-	}
+function init_names() {
+	const s = stat('/etc/init.d');
 
-	let nfct = open('/proc/net/nf_conntrack', 'r');
-	if (! nfct) {
-		nfct = popen('/usr/sbin/conntrack -L -o extended', 'r');
+	if (!stat_fresh(s, init_cache.dir)) {
+		init_cache.names = sort(filter(lsdir('/etc/init.d') ?? [], n => index(n, '.') != 0));
+		init_cache.dir = stat_key(s);
+		init_cache.links = null;
 	}
-	let connt;
 
-	if (nfct) {
-		for (let line = nfct.read('line'); length(line); line = nfct.read('line')) {
-			let m = match(line, /^(ipv[46]) +([0-9]+) +\S+ +([0-9]+)( +.+)\n$/);
+	return init_cache.names;
+}
 
-			if (!m)
-				continue;
+function init_script(name) {
+	const path = `/etc/init.d/${name}`;
+	const s = stat(path);
+
+	if (s?.type != 'file') {
+		delete init_cache.scripts[name];
+		return null;
+	}
 
-			let fam = m[1];
-			let l3 = m[2];
-			let l4 = m[3];
-			let tuples = m[4];
-			let timeout = null;
+	let script = init_cache.scripts[name];
 
-			m = match(tuples, /^ +([0-9]+)( .+)$/);
+	if (!stat_fresh(s, script?.key)) {
+		const src = readfile(path, 2048);
+		const idx = [];
 
-			if (m) {
-				timeout = m[1];
-				tuples = m[2];
+		for (let m in match(src, /^[[:space:]]*(START|STOP)=('[0-9][0-9]'|"[0-9][0-9]"|[0-9][0-9])[[:space:]]*$/gs)) {
+			switch (m[1]) {
+			case 'START': idx[0] = +trim(m[2], '"\''); break;
+			case 'STOP':  idx[1] = +trim(m[2], '"\''); break;
 			}
+		}
+
+		script = init_cache.scripts[name] = {
+			key: stat_key(s),
+			index: length(idx) ? idx : null
+		};
+	}
+
+	script.exec = !!s.perm?.user_exec;
 
-			if (index(tuples, 'TIME_WAIT') !== -1)
+	return script;
+}
+
+// maps script names to the inodes their rc.d links point to
+function init_links() {
+	const s = stat('/etc/rc.d');
+
+	init_names();
+
+	if (!init_cache.links || !stat_fresh(s, init_cache.rc)) {
+		const links = {};
+
+		for (let ent in lsdir('/etc/rc.d') ?? []) {
+			const m = match(ent, /^[SK][0-9][0-9](.+)$/);
+			const ln = m ? readlink(`/etc/rc.d/${ent}`) : null;
+
+			if (!ln)
 				continue;
 
-			let e = {
-				bytes: 0,
-				packets: 0,
-				layer3: fam,
-				layer4: protos[l4] ?? 'unknown',
-				timeout: +timeout
-			};
-
-			for (let kv in match(tuples, / (\w+)=(\S+)/g)) {
-				switch (kv[1]) {
-				case 'bytes':
-				case 'packets':
-					e[kv[1]] += +kv[2];
-					break;
-
-				case 'src':
-				case 'dst':
-					e[kv[1]] ??= arrtoip(iptoarr(kv[2]));
-					break;
-
-				case 'sport':
-				case 'dport':
-					e[kv[1]] ??= +kv[2];
-					break;
-
-				default:
-					e[kv[1]] = kv[2];
-				}
-			}
+			const t = stat(index(ln, '/') == 0 ? ln : `/etc/rc.d/${ln}`);
 
-			if (callback)
-				callback(e);
-			else
-				push(connt ??= [], e);
+			if (t?.type == 'file')
+				push(links[m[1]] ??= [], t.inode);
 		}
 
-		nfct.close();
+		init_cache.links = links;
+		init_cache.rc = stat_key(s);
 	}
 
-	return callback ? true : (connt ?? []);
-};
+	return init_cache.links;
+}
 
 export function init_list() {
-	return map(filter(glob('/etc/init.d/*'), path => {
-		const s = stat(path);
-
-		return s?.type == 'file' && s?.perm?.user_exec;
-	}), basename);
+	return filter(init_names(), name => init_script(name)?.exec);
 };
 
 export function init_index(name) {
-	const src = readfile(`/etc/init.d/${basename(name)}`, 2048);
-	const idx = [];
+	return init_script(basename(name))?.index;
+};
 
-	for (let m in match(src, /^[[:space:]]*(START|STOP)=('[0-9][0-9]'|"[0-9][0-9]"|[0-9][0-9])[[:space:]]*$/gs)) {
-		switch (m[1]) {
-		case 'START': idx[0] = +trim(m[2], '"\''); break;
-		case 'STOP':  idx[1] = +trim(m[2], '"\''); break;
-		}
-	}
+export function init_enabled(name) {
+	name = basename(name);
 
-	return length(idx) ? idx : null;
+	const script = init_script(name);
+
+	return !!(script?.exec && script.key.inode in init_links()[name]);
 };
 
-export function init_enabled(name) {
-	for (let path in glob(`/etc/rc.d/[SK][0-9][0-9]${basename(name)}`)) {
-		const ln = readlink(path);
-		const s1 = stat(index(ln, '/') == 0 ? ln : `/etc/rc.d/${ln}`);
-		const s2 = stat(`/etc/init.d/${basename(name)}`);
+// returns index, stop and enabled state of the given or all init scripts
+export function init_status(names) {
+	const links = init_links();
+	const rv = {};
+
+	for (let name in (type(names) == 'array') ? map(names, basename) : init_names()) {
+		const script = init_script(name);
+
+		if (!script?.exec)
+			continue;
 
-		if (s1?.inode == s2?.inode && s1?.type == 'file' && s1?.perm?.user_exec)
-			return true;
+		rv[name] = {
+			index: script.index?.[0],
+			stop: script.index?.[1],
+			enabled: script.key.inode in links[name]
+		};
 	}
 
-	return false;
+	return rv;
 };
@@ -1,8 +1,20 @@
 {%
 
-import dispatch from 'luci.dispatcher';
+import dispatch, { preload } from 'luci.dispatcher';
 import request from 'luci.http';
 
+/* Keep a pre-initialized Lua state around in the server process so that
+ * request handlers forked from it skip the Lua runtime cold start. Only
+ * modules not bound to the per-request environment may be preloaded. */
+try {
+	require('lua').prewarm(1, [
+		'luci.util', 'luci.xml', 'luci.ltn12', 'luci.model.uci', 'luci.sys', 'nixio.fs'
+	]);
+}
+catch {}
+
+preload();
+
 global.handle_request = function(env) {
 	let req = request(env, uhttpd.recv, uhttpd.send);
 
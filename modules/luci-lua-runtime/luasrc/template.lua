@@ -36,6 +36,16 @@ viewdir = config.template.viewdir or util.libpath() .. "/view"
 -- Define the namespace for template modules
 context = {} --util.threadlocal()
 
+-- Template output is collected in a native buffer and passed on to the
+-- HTTP writer in large chunks
+local sink = tparser.sink(function(s) L.write(s) end)
+local depth = 0
+
+--- Pass pending template output on to the HTTP writer.
+function flush()
+	sink:flush()
+end
+
 --- Render a certain template.
 -- @param name		Template name
 -- @param scope		Scope to assign to template (optional)
@@ -90,9 +100,11 @@ context.viewns = setmetatable({
 		if fs.access(viewdir .. "/" .. name .. ".htm") then
 			Template(name):render(getfenv(2))
 		else
+			sink:flush()
 			L.include(name, getfenv(2))
 		end
 	end;
+	write       = sink:writer();
 	translate   = i18n.translate;
 	translatef  = i18n.translatef;
 	export      = function(k, v) if context.viewns[k] == nil then context.viewns[k] = v end end;
@@ -176,7 +188,14 @@ function Template.render(self, scope)
 		end}))
 
 	-- Now finally render the thing
+	depth = depth + 1
 	local stat, err = util.copcall(self.template)
+	depth = depth - 1
+
+	if depth == 0 then
+		sink:flush()
+	end
+
 	if not stat then
 		error("Failed to execute template '" .. self.name .. "'.\n" ..
 		      "A runtime error occurred: " .. tostring(err or "(nil)"))
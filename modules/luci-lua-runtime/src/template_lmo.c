@@ -212,6 +212,18 @@ void lmo_close(lmo_archive_t *ar)
 lmo_catalog_t *_lmo_catalogs = NULL;
 lmo_catalog_t *_lmo_active_catalog = NULL;
 
+/* direct mapped cache of lookup results in the active catalog */
+static struct lmo_slot {
+	uint32_t hash;
+	int length;
+	char *value;
+} _lmo_slots[LMO_SLOT_COUNT];
+
+static void lmo_flush_slots(void)
+{
+	memset(_lmo_slots, 0, sizeof(_lmo_slots));
+}
+
 int lmo_load_catalog(const char *lang, const char *dir)
 {
 	DIR *dh = NULL;
@@ -257,7 +269,10 @@ int lmo_load_catalog(const char *lang, const char *dir)
 	_lmo_catalogs = cat;
 
 	if (!_lmo_active_catalog)
+	{
 		_lmo_active_catalog = cat;
+		lmo_flush_slots();
+	}
 
 	return cat->archives ? 0 : -1;
 
@@ -276,7 +291,12 @@ int lmo_change_catalog(const char *lang)
 	{
 		if (!strncmp(cat->lang, lang, sizeof(cat->lang)))
 		{
-			_lmo_active_catalog = cat;
+			if (_lmo_active_catalog != cat)
+			{
+				_lmo_active_catalog = cat;
+				lmo_flush_slots();
+			}
+
 			return 0;
 		}
 	}
@@ -504,33 +524,54 @@ int lmo_translate(const char *key, int keylen, char **out, int *outlen)
 	return lmo_translate_ctxt(key, keylen, NULL, 0, out, outlen);
 }
 
-int lmo_translate_ctxt(const char *key, int keylen,
-                       const char *ctx, int ctxlen,
-                       char **out, int *outlen)
+int lmo_translate_hash(uint32_t hash, char **out, int *outlen)
 {
-	uint32_t hash;
+	struct lmo_slot *slot;
 	lmo_entry_t *e;
 	lmo_archive_t *ar;
 
-	if (!key || !_lmo_active_catalog)
+	if (!_lmo_active_catalog)
 		return -2;
 
-	hash = lmo_canon_hash(key, keylen, ctx, ctxlen, -1);
+	if (hash == 0)
+		return -1;
 
-	if (hash > 0)
+	slot = &_lmo_slots[hash % LMO_SLOT_COUNT];
+
+	if (slot->hash != hash)
 	{
+		slot->hash = hash;
+		slot->value = NULL;
+		slot->length = 0;
+
 		for (ar = _lmo_active_catalog->archives; ar; ar = ar->next)
 		{
 			if ((e = lmo_find_entry(ar, hash)) != NULL)
 			{
-				*out = ar->mmap + ntohl(e->offset);
-				*outlen = ntohl(e->length);
-				return 0;
+				slot->value = ar->mmap + ntohl(e->offset);
+				slot->length = ntohl(e->length);
+				break;
 			}
 		}
 	}
 
-	return -1;
+	if (!slot->value)
+		return -1;
+
+	*out = slot->value;
+	*outlen = slot->length;
+	return 0;
+}
+
+int lmo_translate_ctxt(const char *key, int keylen,
+                       const char *ctx, int ctxlen,
+                       char **out, int *outlen)
+{
+	if (!key || !_lmo_active_catalog)
+		return -2;
+
+	return lmo_translate_hash(lmo_canon_hash(key, keylen, ctx, ctxlen, -1),
+	                          out, outlen);
 }
 
 int lmo_translate_plural(int n, const char *skey, int skeylen,
@@ -572,15 +613,8 @@ int lmo_translate_plural_ctxt(int n, const char *skey, int skeylen,
 	if (hash == 0)
 		return -1;
 
-	for (ar = _lmo_active_catalog->archives; ar; ar = ar->next)
-	{
-		if ((e = lmo_find_entry(ar, hash)) != NULL)
-		{
-			*out = ar->mmap + ntohl(e->offset);
-			*outlen = ntohl(e->length);
-			return 0;
-		}
-	}
+	if (!lmo_translate_hash(hash, out, outlen))
+		return 0;
 
 	if (n != 1)
 	{
@@ -624,6 +658,12 @@ void lmo_close_catalog(const char *lang)
 			else
 				_lmo_catalogs = cat->next;
 
+			if (_lmo_active_catalog == cat)
+			{
+				_lmo_active_catalog = NULL;
+				lmo_flush_slots();
+			}
+
 			for (ar = cat->archives; ar; ar = next)
 			{
 				next = ar->next;
@@ -73,6 +73,9 @@ struct lmo_catalog {
 
 typedef struct lmo_catalog lmo_catalog_t;
 
+/* number of cached lookup results, must be a power of two */
+#define LMO_SLOT_COUNT 1024
+
 typedef void (*lmo_iterate_cb_t)(uint32_t, const char *, int, void *);
 
 uint32_t sfh_hash(const char *data, int len);
@@ -89,6 +92,7 @@ extern lmo_catalog_t *_lmo_active_catalog;
 int lmo_load_catalog(const char *lang, const char *dir);
 int lmo_change_catalog(const char *lang);
 int lmo_translate(const char *key, int keylen, char **out, int *outlen);
+int lmo_translate_hash(uint32_t hash, char **out, int *outlen);
 int lmo_translate_ctxt(const char *key, int keylen,
                        const char *ctx, int ctxlen, char **out, int *outlen);
 int lmo_translate_plural(int n, const char *skey, int skeylen,
@@ -18,6 +18,27 @@
 
 #include "template_lualib.h"
 
+#ifndef TEMPLATE_CACHE_DIR
+#define TEMPLATE_CACHE_DIR "/tmp/luci-tplcache"
+#endif
+
+#define TEMPLATE_CACHE_MAGIC   0x4c544331 /* LTC1 */
+#define TEMPLATE_CACHE_MAXSIZE (4 * 1024 * 1024)
+#define TEMPLATE_CACHE_REGKEY  "luci.template.cache"
+
+struct template_cache_hdr {
+	uint32_t magic;
+	uint32_t pad;
+	uint64_t inode;
+	int64_t  mtime;
+	int64_t  size;
+};
+
+static struct {
+	lmo_catalog_t *catalog;
+	uint32_t hash;
+} catalog_id;
+
 static int template_L_do_parse(lua_State *L, struct template_parser *parser, const char *chunkname)
 {
 	int lua_status, rv;
@@ -42,12 +63,266 @@ static int template_L_do_parse(lua_State *L, struct template_parser *parser, con
 	return rv;
 }
 
+/* Compiled templates are cached as lua_dump() bytecode, prefixed with a
+ * header recording the identity of the source file. Entries are kept in a
+ * registry table for the lifetime of the process and, if the cache directory
+ * is usable, mirrored to disk so that subsequent processes can skip the
+ * parser entirely. Since translations are resolved at parse time, the active
+ * catalog is part of the cache key. */
+static int template_cache_writer(lua_State *L, const void *p, size_t sz, void *ud)
+{
+	return (buf_append(ud, p, sz) == (int)sz) ? 0 : 1;
+}
+
+static uint32_t template_cache_catalog(void)
+{
+	lmo_catalog_t *cat = _lmo_active_catalog;
+	lmo_archive_t *ar;
+
+	if (!cat)
+		return 0;
+
+	if (catalog_id.catalog != cat)
+	{
+		catalog_id.catalog = cat;
+		catalog_id.hash = sfh_hash(cat->lang, strlen(cat->lang));
+
+		for (ar = cat->archives; ar; ar = ar->next)
+			catalog_id.hash ^= ar->size +
+				sfh_hash((const char *)ar->index, ar->length * sizeof(lmo_entry_t));
+	}
+
+	return catalog_id.hash;
+}
+
+static int template_cache_dir(void)
+{
+	struct stat s;
+
+	if (!*TEMPLATE_CACHE_DIR)
+		return 0;
+
+	if (lstat(TEMPLATE_CACHE_DIR, &s))
+	{
+		if (errno != ENOENT || mkdir(TEMPLATE_CACHE_DIR, 0700) ||
+		    lstat(TEMPLATE_CACHE_DIR, &s))
+			return 0;
+	}
+
+	/* refuse to load bytecode from a directory others can write to */
+	return (S_ISDIR(s.st_mode) && s.st_uid == geteuid() &&
+	        !(s.st_mode & (S_IWGRP | S_IWOTH)));
+}
+
+static void template_cache_table(lua_State *L)
+{
+	lua_getfield(L, LUA_REGISTRYINDEX, TEMPLATE_CACHE_REGKEY);
+
+	if (!lua_istable(L, -1))
+	{
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_setfield(L, LUA_REGISTRYINDEX, TEMPLATE_CACHE_REGKEY);
+	}
+}
+
+static int template_cache_valid(const char *data, size_t len, struct stat *s)
+{
+	struct template_cache_hdr hdr;
+
+	if (len <= sizeof(hdr))
+		return 0;
+
+	memcpy(&hdr, data, sizeof(hdr));
+
+	return (hdr.magic == TEMPLATE_CACHE_MAGIC &&
+	        hdr.inode == (uint64_t)s->st_ino &&
+	        hdr.mtime == (int64_t)s->st_mtime &&
+	        hdr.size  == (int64_t)s->st_size);
+}
+
+static int template_cache_read(lua_State *L, const char *key, struct stat *s)
+{
+	char path[PATH_MAX], *data = NULL;
+	struct stat fs;
+	ssize_t n;
+	size_t len = 0;
+	int fd, rv = 0;
+
+	if (!template_cache_dir())
+		return 0;
+
+	snprintf(path, sizeof(path), "%s/%s", TEMPLATE_CACHE_DIR, key);
+
+	if ((fd = open(path, O_RDONLY | O_NOFOLLOW)) < 0)
+		return 0;
+
+	if (fstat(fd, &fs) || !S_ISREG(fs.st_mode) || fs.st_uid != geteuid() ||
+	    fs.st_size > TEMPLATE_CACHE_MAXSIZE || !(data = malloc(fs.st_size)))
+		goto out;
+
+	while (len < (size_t)fs.st_size)
+	{
+		n = read(fd, data + len, fs.st_size - len);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			goto out;
+
+		len += n;
+	}
+
+	if (template_cache_valid(data, len, s))
+	{
+		lua_pushlstring(L, data, len);
+		rv = 1;
+	}
+
+out:
+	free(data);
+	close(fd);
+
+	return rv;
+}
+
+static void template_cache_write(const char *key, const char *data, size_t len)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	ssize_t n;
+	size_t off = 0;
+	int fd;
+
+	if (!template_cache_dir())
+		return;
+
+	snprintf(path, sizeof(path), "%s/%s", TEMPLATE_CACHE_DIR, key);
+	snprintf(tmp, sizeof(tmp), "%s/.%s.%d", TEMPLATE_CACHE_DIR, key, (int)getpid());
+
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW, 0600)) < 0)
+		return;
+
+	while (off < len)
+	{
+		n = write(fd, data + off, len - off);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+
+		if (n <= 0)
+			break;
+
+		off += n;
+	}
+
+	if (close(fd) || off < len || rename(tmp, path))
+		unlink(tmp);
+}
+
+static int template_cache_load(lua_State *L, const char *key, struct stat *s,
+                               const char *chunkname)
+{
+	size_t len;
+	const char *data;
+
+	template_cache_table(L);
+	lua_getfield(L, -1, key);
+
+	data = lua_tolstring(L, -1, &len);
+
+	if (!data || !template_cache_valid(data, len, s))
+	{
+		lua_pop(L, 1);
+
+		if (!template_cache_read(L, key, s))
+		{
+			lua_pop(L, 1);
+			return 0;
+		}
+
+		lua_pushvalue(L, -1);
+		lua_setfield(L, -3, key);
+
+		data = lua_tolstring(L, -1, &len);
+	}
+
+	if (luaL_loadbuffer(L, data + sizeof(struct template_cache_hdr),
+	                    len - sizeof(struct template_cache_hdr), chunkname))
+	{
+		lua_pop(L, 3);
+		return 0;
+	}
+
+	lua_replace(L, -3);
+	lua_pop(L, 1);
+
+	return 1;
+}
+
+static void template_cache_store(lua_State *L, const char *key, struct stat *s)
+{
+	struct template_cache_hdr hdr = {
+		.magic = TEMPLATE_CACHE_MAGIC,
+		.inode = s->st_ino,
+		.mtime = s->st_mtime,
+		.size  = s->st_size
+	};
+
+	struct template_buffer *buf = buf_init(s->st_size + sizeof(hdr));
+	char *data;
+	int len;
+
+	if (!buf)
+		return;
+
+	buf_append(buf, (const char *)&hdr, sizeof(hdr));
+
+	if (lua_dump(L, template_cache_writer, buf) == 0)
+	{
+		len = buf_length(buf);
+		data = buf_destroy(buf);
+
+		template_cache_table(L);
+		lua_pushlstring(L, data, len);
+		lua_setfield(L, -2, key);
+		lua_pop(L, 1);
+
+		template_cache_write(key, data, len);
+		free(data);
+	}
+	else
+	{
+		free(buf_destroy(buf));
+	}
+}
+
 int template_L_parse(lua_State *L)
 {
 	const char *file = luaL_checkstring(L, 1);
-	struct template_parser *parser = template_open(file);
+	struct template_parser *parser;
+	struct stat s;
+	char key[64];
+	int rv;
+
+	if (stat(file, &s) || !S_ISREG(s.st_mode))
+		return template_L_do_parse(L, template_open(file), file);
+
+	snprintf(key, sizeof(key), "%llx-%llx-%08x.luac",
+	         (unsigned long long)s.st_dev, (unsigned long long)s.st_ino,
+	         template_cache_catalog());
+
+	if (template_cache_load(L, key, &s, file))
+		return 1;
+
+	parser = template_open(file);
+	rv = template_L_do_parse(L, parser, file);
+
+	if (rv == 1)
+		template_cache_store(L, key, &s);
 
-	return template_L_do_parse(L, parser, file);
+	return rv;
 }
 
 int template_L_parse_string(lua_State *L)
@@ -113,12 +388,14 @@ int template_L_striptags(lua_State *L)
 static int template_L_load_catalog(lua_State *L) {
 	const char *lang = luaL_optstring(L, 1, "en");
 	const char *dir  = luaL_optstring(L, 2, NULL);
+	catalog_id.catalog = NULL;
 	lua_pushboolean(L, !lmo_load_catalog(lang, dir));
 	return 1;
 }
 
 static int template_L_close_catalog(lua_State *L) {
 	const char *lang = luaL_optstring(L, 1, "en");
+	catalog_id.catalog = NULL;
 	lmo_close_catalog(lang);
 	return 0;
 }
@@ -200,6 +477,117 @@ static int template_L_hash(lua_State *L) {
 	return 1;
 }
 
+static int template_L_sink(lua_State *L) {
+	struct template_sink *sink;
+	int threshold = luaL_optinteger(L, 2, 16384);
+
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+
+	sink = lua_newuserdata(L, sizeof(*sink));
+	sink->threshold = (threshold > 0) ? threshold : 16384;
+	sink->buf = buf_init(sink->threshold + 1024);
+
+	if (!sink->buf)
+		return luaL_error(L, "out of memory");
+
+	lua_pushvalue(L, 1);
+	sink->flush = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	luaL_getmetatable(L, TEMPLATE_SINK_META);
+	lua_setmetatable(L, -2);
+
+	return 1;
+}
+
+static void template_sink_flush(lua_State *L, struct template_sink *sink) {
+	if (!sink->buf || !buf_length(sink->buf))
+		return;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, sink->flush);
+	lua_pushlstring(L, sink->buf->data, buf_length(sink->buf));
+
+	/* reset before calling out, the callback might write again */
+	buf_reset(sink->buf);
+
+	lua_call(L, 1, 0);
+}
+
+static int template_sink_append(lua_State *L, struct template_sink *sink, int first) {
+	int i, top = lua_gettop(L);
+	const char *s;
+	size_t len;
+
+	if (!sink->buf)
+		return luaL_error(L, "sink is closed");
+
+	for (i = first; i <= top; i++)
+	{
+		switch (lua_type(L, i))
+		{
+		case LUA_TNIL:
+			continue;
+
+		case LUA_TSTRING:
+		case LUA_TNUMBER:
+			s = lua_tolstring(L, i, &len);
+			break;
+
+		default:
+			lua_getglobal(L, "tostring");
+			lua_pushvalue(L, i);
+			lua_call(L, 1, 1);
+			s = lua_tolstring(L, -1, &len);
+			break;
+		}
+
+		if (s && len && !buf_append(sink->buf, s, len))
+			return luaL_error(L, "out of memory");
+
+		lua_settop(L, top);
+
+		if (buf_length(sink->buf) >= sink->threshold)
+			template_sink_flush(L, sink);
+	}
+
+	return 0;
+}
+
+static int template_L_sink_write(lua_State *L) {
+	struct template_sink *sink = luaL_checkudata(L, 1, TEMPLATE_SINK_META);
+	return template_sink_append(L, sink, 2);
+}
+
+static int template_L_sink_writefn(lua_State *L) {
+	struct template_sink *sink = lua_touserdata(L, lua_upvalueindex(1));
+	return template_sink_append(L, sink, 1);
+}
+
+static int template_L_sink_writer(lua_State *L) {
+	luaL_checkudata(L, 1, TEMPLATE_SINK_META);
+	lua_pushvalue(L, 1);
+	lua_pushcclosure(L, template_L_sink_writefn, 1);
+	return 1;
+}
+
+static int template_L_sink_flush(lua_State *L) {
+	struct template_sink *sink = luaL_checkudata(L, 1, TEMPLATE_SINK_META);
+	template_sink_flush(L, sink);
+	return 0;
+}
+
+static int template_L_sink_gc(lua_State *L) {
+	struct template_sink *sink = luaL_checkudata(L, 1, TEMPLATE_SINK_META);
+
+	if (sink->buf)
+	{
+		free(buf_destroy(sink->buf));
+		luaL_unref(L, LUA_REGISTRYINDEX, sink->flush);
+		sink->buf = NULL;
+	}
+
+	return 0;
+}
+
 
 /* module table */
 static const luaL_reg R[] = {
@@ -215,10 +603,26 @@ static const luaL_reg R[] = {
 	{ "translate",			template_L_translate },
 	{ "ntranslate",			template_L_ntranslate },
 	{ "hash",				template_L_hash },
+	{ "sink",				template_L_sink },
+	{ NULL,					NULL }
+};
+
+/* sink methods */
+static const luaL_reg S[] = {
+	{ "write",				template_L_sink_write },
+	{ "writer",				template_L_sink_writer },
+	{ "flush",				template_L_sink_flush },
+	{ "__gc",				template_L_sink_gc },
 	{ NULL,					NULL }
 };
 
 LUALIB_API int luaopen_luci_template_parser(lua_State *L) {
+	luaL_newmetatable(L, TEMPLATE_SINK_META);
+	luaL_register(L, NULL, S);
+	lua_pushvalue(L, -1);
+	lua_setfield(L, -2, "__index");
+	lua_pop(L, 1);
+
 	luaL_register(L, TEMPLATE_LUALIB_META, R);
 	return 1;
 }
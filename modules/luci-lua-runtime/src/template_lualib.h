@@ -24,6 +24,14 @@
 #include "template_lmo.h"
 
 #define TEMPLATE_LUALIB_META  "template.parser"
+#define TEMPLATE_SINK_META    "template.sink"
+
+/* output sink object */
+struct template_sink {
+	struct template_buffer *buf;
+	int flush;
+	int threshold;
+};
 
 LUALIB_API int luaopen_luci_template_parser(lua_State *L);
 
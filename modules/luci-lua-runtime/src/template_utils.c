@@ -19,6 +19,53 @@
 #include "template_utils.h"
 #include "template_lmo.h"
 
+/* character classes */
+#define C_HIGH		0x01	/* non-ascii byte */
+#define C_NUL		0x02	/* null byte */
+#define C_XML_DROP	0x04	/* byte not allowed in XML */
+#define C_XML_ESC	0x08	/* XML special char */
+#define C_SPACE		0x10	/* isspace() in the C locale */
+#define C_LUA_ESC	0x20	/* needs escaping in Lua string literal */
+
+static const unsigned char char_class[256] = {
+	0x06, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x10, 0x30, 0x14, 0x14, 0x10, 0x04, 0x04,
+	0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04,
+	0x10, 0x00, 0x28, 0x00, 0x00, 0x00, 0x08, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x08, 0x00, 0x08, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x20, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x04,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01,
+	0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01, 0x01
+};
+
+/* XML entities for all C_XML_ESC chars, always five bytes long */
+static const char *xml_entity[256] = {
+	['"']  = "&#34;",
+	['&']  = "&#38;",
+	['\''] = "&#39;",
+	['<']  = "&#60;",
+	['>']  = "&#62;",
+};
+
+/* return the length of the run of bytes at s not matching the given classes */
+static inline unsigned int span_class(const unsigned char *s, unsigned int l,
+                                      unsigned char mask)
+{
+	unsigned int n;
+
+	for (n = 0; (n < l) && !(char_class[s[n]] & mask); n++);
+
+	return n;
+}
+
 /* initialize a buffer object */
 struct template_buffer * buf_init(int size)
 {
@@ -58,6 +105,10 @@ int buf_grow(struct template_buffer *buf, int size)
 	if (size <= 0)
 		size = 1024;
 
+	/* grow by at least half of the current size to avoid excessive reallocs */
+	if (size < buf->size / 2)
+		size = buf->size / 2;
+
 	data = realloc(buf->data, buf->size + size);
 
 	if (data != NULL)
@@ -109,6 +160,14 @@ int buf_length(struct template_buffer *buf)
 	return buf->fill;
 }
 
+/* discard buffer contents but keep the allocation */
+void buf_reset(struct template_buffer *buf)
+{
+	buf->fill = 0;
+	buf->dptr = buf->data;
+	buf->data[0] = 0;
+}
+
 /* destroy buffer object and return pointer to data */
 char * buf_destroy(struct template_buffer *buf)
 {
@@ -289,11 +348,14 @@ char * utf8(const char *s, unsigned int l)
 
 	for (o = 0; o < l; o++)
 	{
-		/* ascii char */
-		if ((*ptr >= 0x01) && (*ptr <= 0x7F))
+		/* run of ascii chars */
+		if ((v = span_class(ptr, l - o, C_HIGH | C_NUL)) > 0)
 		{
-			if (!buf_putchar(buf, (char)*ptr++))
+			if (!buf_append(buf, (char *)ptr, v))
 				break;
+
+			ptr += v;
+			o += (v - 1);
 		}
 
 		/* invalid byte or multi byte sequence */
@@ -317,44 +379,37 @@ char * pcdata(const char *s, unsigned int l)
 	struct template_buffer *buf = buf_init(l);
 	unsigned char *ptr = (unsigned char *)s;
 	unsigned int o, v;
-	char esq[8];
-	int esl;
 
 	if (!buf)
 		return NULL;
 
 	for (o = 0; o < l; o++)
 	{
+		/* run of plain ascii chars */
+		if ((v = span_class(ptr, l - o, C_HIGH | C_XML_DROP | C_XML_ESC)) > 0)
+		{
+			if (!buf_append(buf, (char *)ptr, v))
+				break;
+
+			ptr += v;
+			o += (v - 1);
+		}
+
 		/* Invalid XML bytes */
-		if (((*ptr >= 0x00) && (*ptr <= 0x08)) ||
-		    ((*ptr >= 0x0B) && (*ptr <= 0x0C)) ||
-		    ((*ptr >= 0x0E) && (*ptr <= 0x1F)) ||
-		    (*ptr == 0x7F))
+		else if (char_class[*ptr] & C_XML_DROP)
 		{
 			ptr++;
 		}
 
 		/* Escapes */
-		else if ((*ptr == 0x26) ||
-		         (*ptr == 0x27) ||
-		         (*ptr == 0x22) ||
-		         (*ptr == 0x3C) ||
-		         (*ptr == 0x3E))
+		else if (char_class[*ptr] & C_XML_ESC)
 		{
-			esl = snprintf(esq, sizeof(esq), "&#%i;", *ptr);
-
-			if (!buf_append(buf, esq, esl))
+			if (!buf_append(buf, xml_entity[*ptr], 5))
 				break;
 
 			ptr++;
 		}
 
-		/* ascii char */
-		else if (*ptr <= 0x7F)
-		{
-			buf_putchar(buf, (char)*ptr++);
-		}
-
 		/* multi byte sequence */
 		else
 		{
@@ -375,12 +430,21 @@ char * striptags(const char *s, unsigned int l)
 	unsigned char *end = ptr + l;
 	unsigned char *tag;
 	unsigned char prev;
-	char esq[8];
-	int esl;
+	unsigned int n;
+
+	if (!buf)
+		return NULL;
 
 	for (prev = ' '; ptr < end; ptr++)
 	{
-		if ((*ptr == '<') && ((ptr + 2) < end) &&
+		/* run of chars neither whitespace nor markup */
+		if ((n = span_class(ptr, end - ptr, C_SPACE | C_XML_ESC)) > 0)
+		{
+			buf_append(buf, (char *)ptr, n);
+			ptr += (n - 1);
+			prev = *ptr;
+		}
+		else if ((*ptr == '<') && ((ptr + 2) < end) &&
 			((*(ptr + 1) == '/') || isalpha(*(ptr + 1))))
 		{
 			for (tag = ptr; tag < end; tag++)
@@ -405,22 +469,7 @@ char * striptags(const char *s, unsigned int l)
 		}
 		else
 		{
-			switch(*ptr)
-			{
-				case '"':
-				case '\'':
-				case '<':
-				case '>':
-				case '&':
-					esl = snprintf(esq, sizeof(esq), "&#%i;", *ptr);
-					buf_append(buf, esq, esl);
-					break;
-
-				default:
-					buf_putchar(buf, *ptr);
-					break;
-			}
-
+			buf_append(buf, xml_entity[*ptr], 5);
 			prev = *ptr;
 		}
 	}
@@ -431,42 +480,40 @@ char * striptags(const char *s, unsigned int l)
 void luastr_escape(struct template_buffer *out, const char *s, unsigned int l,
 				   int escape_xml)
 {
-	int esl;
-	char esq[8];
-	char *ptr;
+	unsigned char mask = C_LUA_ESC | (escape_xml ? C_XML_ESC : 0);
+	unsigned char *ptr = (unsigned char *)s;
+	unsigned char *end = ptr + l;
+	unsigned int n;
 
-	for (ptr = (char *)s; ptr < (s + l); ptr++)
+	for (; ptr < end; ptr++)
 	{
+		if ((n = span_class(ptr, end - ptr, mask)) > 0)
+		{
+			buf_append(out, (char *)ptr, n);
+			ptr += (n - 1);
+			continue;
+		}
+
 		switch (*ptr)
 		{
 		case '\\':
 			buf_append(out, "\\\\", 2);
 			break;
 
-		case '"':
-			if (escape_xml)
-				buf_append(out, "&#34;", 5);
-			else
-				buf_append(out, "\\\"", 2);
-			break;
-
 		case '\n':
 			buf_append(out, "\\n", 2);
 			break;
 
-		case '\'':
-		case '&':
-		case '<':
-		case '>':
-			if (escape_xml)
+		case '"':
+			if (!escape_xml)
 			{
-				esl = snprintf(esq, sizeof(esq), "&#%i;", *ptr);
-				buf_append(out, esq, esl);
+				buf_append(out, "\\\"", 2);
 				break;
 			}
 
 		default:
-			buf_putchar(out, *ptr);
+			buf_append(out, xml_entity[*ptr], 5);
+			break;
 		}
 	}
 }
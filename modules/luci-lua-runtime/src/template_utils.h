@@ -37,6 +37,7 @@ int buf_grow(struct template_buffer *buf, int size);
 int buf_putchar(struct template_buffer *buf, char c);
 int buf_append(struct template_buffer *buf, const char *s, int len);
 int buf_length(struct template_buffer *buf);
+void buf_reset(struct template_buffer *buf);
 char * buf_destroy(struct template_buffer *buf);
 
 char * utf8(const char *s, unsigned int l);
@@ -0,0 +1,246 @@
+/*
+ * luci-bwc - ucode binding for reading the bandwidth collector database
+ *
+ *   Copyright (C) 2010 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <endian.h>
+
+#include <ucode/module.h>
+
+#include "luci-bwc.h"
+
+#define DB_MAX_ESIZE	sizeof(struct traffic_entry)
+
+
+/*
+ * Reset the countdown of a running collector, just like invoking the
+ * luci-bwc executable would. Returns false if no collector is running,
+ * the caller is expected to spawn one then.
+ */
+static bool
+bwc_ping(void)
+{
+	char buf[9] = { 0 };
+	int fd, pid = -1;
+
+	if ((fd = open(PID_PATH, O_RDONLY | O_CLOEXEC)) > -1)
+	{
+		if (read(fd, buf, sizeof(buf) - 1) > 0)
+			pid = atoi(buf);
+
+		close(fd);
+	}
+
+	return (pid > 0 && kill(pid, SIGUSR1) == 0);
+}
+
+static int
+bwc_read(const char *path, size_t esize, char *buf)
+{
+	ssize_t len, total = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+		return -1;
+
+	while (total < esize * STEP_COUNT)
+	{
+		len = read(fd, buf + total, esize * STEP_COUNT - total);
+
+		if (len < 0 && errno == EINTR)
+			continue;
+
+		if (len <= 0)
+			break;
+
+		total += len;
+	}
+
+	close(fd);
+
+	return total / esize;
+}
+
+static void
+bwc_push_traffic(uc_vm_t *vm, uc_value_t *rv, void *entry)
+{
+	struct traffic_entry *e = entry;
+	uc_value_t *row = ucv_array_new_length(vm, 5);
+
+	ucv_array_push(row, ucv_int64_new(be32toh(e->time)));
+	ucv_array_push(row, ucv_uint64_new(be64toh(e->rxb)));
+	ucv_array_push(row, ucv_uint64_new(be64toh(e->rxp)));
+	ucv_array_push(row, ucv_uint64_new(be64toh(e->txb)));
+	ucv_array_push(row, ucv_uint64_new(be64toh(e->txp)));
+	ucv_array_push(rv, row);
+}
+
+static void
+bwc_push_radio(uc_vm_t *vm, uc_value_t *rv, void *entry)
+{
+	struct radio_entry *e = entry;
+	uc_value_t *row = ucv_array_new_length(vm, 4);
+
+	ucv_array_push(row, ucv_int64_new(be32toh(e->time)));
+	ucv_array_push(row, ucv_int64_new(be16toh(e->rate)));
+	ucv_array_push(row, ucv_int64_new(e->rssi));
+	ucv_array_push(row, ucv_int64_new(e->noise));
+	ucv_array_push(rv, row);
+}
+
+static void
+bwc_push_conns(uc_vm_t *vm, uc_value_t *rv, void *entry)
+{
+	struct conn_entry *e = entry;
+	uc_value_t *row = ucv_array_new_length(vm, 4);
+
+	ucv_array_push(row, ucv_int64_new(be32toh(e->time)));
+	ucv_array_push(row, ucv_int64_new(be32toh(e->udp)));
+	ucv_array_push(row, ucv_int64_new(be32toh(e->tcp)));
+	ucv_array_push(row, ucv_int64_new(be32toh(e->other)));
+	ucv_array_push(rv, row);
+}
+
+static void
+bwc_push_load(uc_vm_t *vm, uc_value_t *rv, void *entry)
+{
+	struct load_entry *e = entry;
+	uc_value_t *row = ucv_array_new_length(vm, 4);
+
+	ucv_array_push(row, ucv_int64_new(be32toh(e->time)));
+	ucv_array_push(row, ucv_int64_new(be16toh(e->load1)));
+	ucv_array_push(row, ucv_int64_new(be16toh(e->load5)));
+	ucv_array_push(row, ucv_int64_new(be16toh(e->load15)));
+	ucv_array_push(rv, row);
+}
+
+static bool
+bwc_valid_device(uc_value_t *dev)
+{
+	const char *s = ucv_string_get(dev);
+
+	if (ucv_type(dev) != UC_STRING || !*s || strchr(s, '/'))
+		return false;
+
+	return strcmp(s, ".") && strcmp(s, "..");
+}
+
+/*
+ * stats(mode, device[, since]) - return the samples recorded by luci-bwc
+ * for the given mode ("interface", "wireless", "conntrack" or "load") as
+ * array of arrays in the same layout as the luci-bwc output. If since is
+ * given, only samples with a timestamp newer than it are returned, it may be
+ * an integer or a double.
+ */
+static uc_value_t *
+uc_bwc_stats(uc_vm_t *vm, size_t nargs)
+{
+	uc_value_t *mode = uc_fn_arg(0);
+	uc_value_t *dev = uc_fn_arg(1);
+	uc_value_t *since = uc_fn_arg(2);
+	void (*push)(uc_vm_t *, uc_value_t *, void *);
+	char buf[DB_MAX_ESIZE * STEP_COUNT];
+	char path[1024];
+	uint32_t min = 0;
+	const char *m;
+	uc_value_t *rv;
+	size_t esize;
+	int i, n;
+
+	if (ucv_type(mode) != UC_STRING)
+		return NULL;
+
+	if (since && ucv_type(since) != UC_INTEGER && ucv_type(since) != UC_DOUBLE)
+		return NULL;
+
+	m = ucv_string_get(mode);
+
+	if (!strcmp(m, "interface") && bwc_valid_device(dev))
+	{
+		snprintf(path, sizeof(path), DB_IF_FILE, ucv_string_get(dev));
+		esize = sizeof(struct traffic_entry);
+		push = bwc_push_traffic;
+	}
+	else if (!strcmp(m, "wireless") && bwc_valid_device(dev))
+	{
+		snprintf(path, sizeof(path), DB_RD_FILE, ucv_string_get(dev));
+		esize = sizeof(struct radio_entry);
+		push = bwc_push_radio;
+	}
+	else if (!strcmp(m, "conntrack"))
+	{
+		snprintf(path, sizeof(path), DB_CN_FILE);
+		esize = sizeof(struct conn_entry);
+		push = bwc_push_conns;
+	}
+	else if (!strcmp(m, "load"))
+	{
+		snprintf(path, sizeof(path), DB_LD_FILE);
+		esize = sizeof(struct load_entry);
+		push = bwc_push_load;
+	}
+	else
+	{
+		return NULL;
+	}
+
+	if (!bwc_ping())
+		return NULL;
+
+	if ((n = bwc_read(path, esize, buf)) < 0)
+		return NULL;
+
+	/* fractional timestamps are truncated */
+	if (ucv_type(since) == UC_DOUBLE && ucv_double_get(since) > 0)
+		min = (ucv_double_get(since) > UINT32_MAX)
+			? UINT32_MAX : (uint32_t)ucv_double_get(since);
+	else if (ucv_type(since) == UC_INTEGER && ucv_int64_get(since) > 0)
+		min = (ucv_int64_get(since) > UINT32_MAX)
+			? UINT32_MAX : ucv_int64_get(since);
+
+	rv = ucv_array_new_length(vm, n);
+
+	for (i = 0; i < n; i++)
+	{
+		/* the timestamp is the leading member of every entry type */
+		uint32_t t = be32toh(((struct conn_entry *)&buf[i * esize])->time);
+
+		if (t && t > min)
+			push(vm, rv, &buf[i * esize]);
+	}
+
+	return rv;
+}
+
+
+static const uc_function_list_t bwc_fns[] = {
+	{ "stats",	uc_bwc_stats },
+};
+
+void uc_module_init(uc_vm_t *vm, uc_value_t *scope)
+{
+	uc_function_list_register(scope, bwc_fns);
+}
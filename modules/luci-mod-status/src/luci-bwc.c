@@ -39,17 +39,7 @@
 #include <dlfcn.h>
 #include <iwinfo.h>
 
-#define STEP_COUNT	60
-#define STEP_TIME	1
-#define TIMEOUT		10
-
-#define PID_PATH	"/var/run/luci-bwc.pid"
-
-#define DB_PATH		"/var/lib/luci-bwc"
-#define DB_IF_FILE	DB_PATH "/if/%s"
-#define DB_RD_FILE	DB_PATH "/radio/%s"
-#define DB_CN_FILE	DB_PATH "/connections"
-#define DB_LD_FILE	DB_PATH "/load"
+#include "luci-bwc.h"
 
 #define LD_SCAN_PATTERN \
 	"%f %f %f"
@@ -61,35 +51,6 @@ struct file_map {
 	char *mmap;
 };
 
-struct traffic_entry {
-	uint32_t time;
-	uint64_t rxb;
-	uint64_t rxp;
-	uint64_t txb;
-	uint64_t txp;
-};
-
-struct conn_entry {
-	uint32_t time;
-	uint32_t udp;
-	uint32_t tcp;
-	uint32_t other;
-};
-
-struct load_entry {
-	uint32_t time;
-	uint16_t load1;
-	uint16_t load5;
-	uint16_t load15;
-};
-
-struct radio_entry {
-	uint32_t time;
-	uint16_t rate;
-	uint8_t  rssi;
-	uint8_t  noise;
-};
-
 static int readpid(void)
 {
 	int fd;
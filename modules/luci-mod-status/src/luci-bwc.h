@@ -0,0 +1,65 @@
+/*
+ * luci-bwc - Shared definitions of the bandwidth collector database
+ *
+ *   Copyright (C) 2010 Jo-Philipp Wich <jow@openwrt.org>
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * 	http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __LUCI_BWC_H_
+#define __LUCI_BWC_H_
+
+#include <stdint.h>
+
+#define STEP_COUNT	60
+#define STEP_TIME	1
+#define TIMEOUT		10
+
+#define PID_PATH	"/var/run/luci-bwc.pid"
+
+#define DB_PATH		"/var/lib/luci-bwc"
+#define DB_IF_FILE	DB_PATH "/if/%s"
+#define DB_RD_FILE	DB_PATH "/radio/%s"
+#define DB_CN_FILE	DB_PATH "/connections"
+#define DB_LD_FILE	DB_PATH "/load"
+
+struct traffic_entry {
+	uint32_t time;
+	uint64_t rxb;
+	uint64_t rxp;
+	uint64_t txb;
+	uint64_t txp;
+};
+
+struct conn_entry {
+	uint32_t time;
+	uint32_t udp;
+	uint32_t tcp;
+	uint32_t other;
+};
+
+struct load_entry {
+	uint32_t time;
+	uint16_t load1;
+	uint16_t load5;
+	uint16_t load15;
+};
+
+struct radio_entry {
+	uint32_t time;
+	uint16_t rate;
+	uint8_t  rssi;
+	uint8_t  noise;
+};
+
+#endif